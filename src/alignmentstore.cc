@@ -0,0 +1,161 @@
+#include "alignmentstore.hh"
+#include <stdexcept>
+#include <algorithm>
+
+using namespace focusstack;
+
+void AlignmentStore::load(const std::string &path)
+{
+  cv::FileStorage fs(path, cv::FileStorage::READ);
+  if (!fs.isOpened())
+  {
+    throw std::runtime_error("Could not open transform file " + path);
+  }
+
+  cv::FileNode frames = fs["frames"];
+  if (frames.empty())
+  {
+    throw std::runtime_error("No frames in transform file " + path);
+  }
+
+  // Files saved by older versions have no reference name
+  std::string reference;
+  if (!fs["reference"].empty())
+  {
+    reference = (std::string)fs["reference"];
+  }
+
+  std::vector<entry_t> entries;
+  for (size_t i = 0; i < frames.size(); i++)
+  {
+    cv::FileNode frame = frames[(int)i];
+    entry_t entry;
+    entry.name = (std::string)frame["name"];
+    entry.index = (int)frame["index"];
+    frame["transformation"] >> entry.transformation;
+    frame["contrast"] >> entry.contrast;
+    frame["whitebalance"] >> entry.whitebalance;
+
+    if (entry.transformation.rows != 2 || entry.transformation.cols != 3 ||
+        entry.contrast.total() != 5 || entry.whitebalance.total() != 6)
+    {
+      throw std::runtime_error("Invalid frame " + entry.name + " in transform file " + path);
+    }
+
+    entry.transformation.convertTo(entry.transformation, CV_32F);
+    entry.contrast.convertTo(entry.contrast, CV_32F);
+    entry.whitebalance.convertTo(entry.whitebalance, CV_32F);
+    entries.push_back(entry);
+  }
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_reference = reference;
+  m_entries = entries;
+}
+
+void AlignmentStore::save(const std::string &path) const
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+
+  std::vector<entry_t> entries = m_entries;
+  std::sort(entries.begin(), entries.end(),
+            [](const entry_t &a, const entry_t &b) { return a.index < b.index; });
+
+  cv::FileStorage fs(path, cv::FileStorage::WRITE);
+  if (!fs.isOpened())
+  {
+    throw std::runtime_error("Could not write transform file " + path);
+  }
+
+  fs << "reference" << m_reference;
+  fs << "frames" << "[";
+  for (const entry_t &entry : entries)
+  {
+    fs << "{";
+    fs << "name" << entry.name;
+    fs << "index" << entry.index;
+    fs << "transformation" << entry.transformation;
+    fs << "contrast" << entry.contrast;
+    fs << "whitebalance" << entry.whitebalance;
+    fs << "}";
+  }
+  fs << "]";
+  fs.release();
+}
+
+void AlignmentStore::set(const entry_t &entry)
+{
+  entry_t copy = entry;
+  copy.transformation = entry.transformation.clone();
+  copy.contrast = entry.contrast.clone();
+  copy.whitebalance = entry.whitebalance.clone();
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+  for (entry_t &old : m_entries)
+  {
+    if (old.name == copy.name)
+    {
+      old = copy;
+      return;
+    }
+  }
+  m_entries.push_back(copy);
+}
+
+void AlignmentStore::set_reference(const std::string &name)
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_reference = name;
+}
+
+std::string AlignmentStore::reference() const
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  return m_reference;
+}
+
+bool AlignmentStore::get(const std::string &name, entry_t &entry) const
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  for (const entry_t &e : m_entries)
+  {
+    if (e.name == name)
+    {
+      entry = e;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool AlignmentStore::get(int index, entry_t &entry) const
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  for (const entry_t &e : m_entries)
+  {
+    if (e.index == index)
+    {
+      entry = e;
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t AlignmentStore::size() const
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  return m_entries.size();
+}
+
+cv::Mat AlignmentStore::relative_transform(const cv::Mat &transform, const cv::Mat &neighbour)
+{
+  // Stacked transforms are combined as T = R * N, so R = T * N^-1.
+  cv::Mat inverse;
+  cv::invertAffineTransform(neighbour, inverse);
+  inverse.resize(3, 0.0f);
+  inverse.at<float>(2, 2) = 1.0f;
+
+  cv::Mat result = transform * inverse;
+  return result;
+}
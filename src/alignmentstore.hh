@@ -0,0 +1,53 @@
+// Stores alignment results per image, so that they can be saved to file
+// and reused when processing the same or a similar stack again.
+
+#pragma once
+#include <opencv2/core.hpp>
+#include <string>
+#include <vector>
+#include <mutex>
+
+namespace focusstack {
+
+class AlignmentStore
+{
+public:
+  struct entry_t
+  {
+    std::string name; // Image file name without path
+    int index; // Position of image in the stack
+    cv::Mat transformation; // 2x3 affine transform against reference image
+    cv::Mat contrast; // Contrast polynomial factors
+    cv::Mat whitebalance; // Per-channel brightness and contrast
+  };
+
+  // Load and save entries in OpenCV FileStorage format (YAML, XML or JSON by file extension).
+  // Throws std::runtime_error on failure.
+  void load(const std::string &path);
+  void save(const std::string &path) const;
+
+  // Add or replace entry for an image. Can be called from any thread.
+  void set(const entry_t &entry);
+
+  // Name of the reference image the transforms are against.
+  // Empty if the file was saved without one.
+  void set_reference(const std::string &name);
+  std::string reference() const;
+
+  // Find entry by image name or by position in stack.
+  bool get(const std::string &name, entry_t &entry) const;
+  bool get(int index, entry_t &entry) const;
+
+  size_t size() const;
+
+  // Compute transform relative to neighbour image, when both transforms are
+  // against the same reference image.
+  static cv::Mat relative_transform(const cv::Mat &transform, const cv::Mat &neighbour);
+
+private:
+  mutable std::mutex m_mutex;
+  std::string m_reference;
+  std::vector<entry_t> m_entries;
+};
+
+}
@@ -0,0 +1,99 @@
+#include <gtest/gtest.h>
+#include "alignmentstore.hh"
+#include <cstdio>
+
+namespace focusstack {
+
+static AlignmentStore::entry_t make_entry(std::string name, int index, float shift)
+{
+  AlignmentStore::entry_t entry;
+  entry.name = name;
+  entry.index = index;
+  entry.transformation = cv::Mat::eye(2, 3, CV_32F);
+  entry.transformation.at<float>(0, 0) = 1.01f;
+  entry.transformation.at<float>(0, 2) = shift;
+  entry.contrast = cv::Mat::zeros(5, 1, CV_32F);
+  entry.contrast.at<float>(0) = 0.9f;
+  entry.whitebalance = cv::Mat::ones(6, 1, CV_32F);
+  entry.whitebalance.at<float>(4) = 2.5f;
+  return entry;
+}
+
+TEST(AlignmentStore, SaveLoad) {
+  std::string path = testing::TempDir() + "alignmentstore_test.yml";
+
+  AlignmentStore store;
+  store.set_reference("img0.jpg");
+  store.set(make_entry("img2.jpg", 2, 4.0f));
+  store.set(make_entry("img1.jpg", 1, -3.5f));
+  store.save(path);
+
+  AlignmentStore loaded;
+  loaded.load(path);
+  std::remove(path.c_str());
+  ASSERT_EQ(loaded.size(), 2u);
+  EXPECT_EQ(loaded.reference(), "img0.jpg");
+
+  AlignmentStore::entry_t by_name, by_index;
+  ASSERT_TRUE(loaded.get("img1.jpg", by_name));
+  ASSERT_TRUE(loaded.get(2, by_index));
+  ASSERT_FALSE(loaded.get("img3.jpg", by_name));
+
+  EXPECT_EQ(by_name.index, 1);
+  EXPECT_FLOAT_EQ(by_name.transformation.at<float>(0, 2), -3.5f);
+  EXPECT_FLOAT_EQ(by_name.transformation.at<float>(0, 0), 1.01f);
+  EXPECT_FLOAT_EQ(by_name.contrast.at<float>(0), 0.9f);
+  EXPECT_FLOAT_EQ(by_name.whitebalance.at<float>(4), 2.5f);
+
+  EXPECT_EQ(by_index.name, "img2.jpg");
+  EXPECT_FLOAT_EQ(by_index.transformation.at<float>(0, 2), 4.0f);
+}
+
+// Files without a reference name can still be loaded
+TEST(AlignmentStore, LoadWithoutReference) {
+  std::string path = testing::TempDir() + "alignmentstore_noref_test.yml";
+
+  {
+    AlignmentStore::entry_t entry = make_entry("img1.jpg", 1, 2.0f);
+    cv::FileStorage fs(path, cv::FileStorage::WRITE);
+    fs << "frames" << "[";
+    fs << "{";
+    fs << "name" << entry.name;
+    fs << "index" << entry.index;
+    fs << "transformation" << entry.transformation;
+    fs << "contrast" << entry.contrast;
+    fs << "whitebalance" << entry.whitebalance;
+    fs << "}";
+    fs << "]";
+  }
+
+  AlignmentStore loaded;
+  loaded.load(path);
+  std::remove(path.c_str());
+  ASSERT_EQ(loaded.size(), 1u);
+  EXPECT_EQ(loaded.reference(), "");
+}
+
+TEST(AlignmentStore, RelativeTransform) {
+  cv::Mat neighbour = make_entry("a", 0, 3.0f).transformation;
+  cv::Mat relative = make_entry("b", 1, -2.0f).transformation;
+
+  // Stack the relative transform on top of neighbour, like Task_Align does
+  cv::Mat n3 = neighbour.clone();
+  n3.resize(3, 0.0f);
+  n3.at<float>(2, 2) = 1.0f;
+  cv::Mat stacked = relative * n3;
+
+  cv::Mat result = AlignmentStore::relative_transform(stacked, neighbour);
+  ASSERT_EQ(result.rows, 2);
+  ASSERT_EQ(result.cols, 3);
+  for (int y = 0; y < 2; y++)
+  {
+    for (int x = 0; x < 3; x++)
+    {
+      EXPECT_NEAR(result.at<float>(y, x), relative.at<float>(y, x), 1e-5);
+    }
+  }
+}
+
+}
@@ -4,10 +4,11 @@
 #include "task_loadimg.hh"
 #include "task_grayscale.hh"
 #include "task_align.hh"
+#include "task_align_opencl.hh"
+#include "task_pyramid.hh"
 #include "task_wavelet.hh"
 #include "task_wavelet_opencl.hh"
 #include "task_merge.hh"
-#include "task_denoise.hh"
 #include "task_reassign.hh"
 #include "task_saveimg.hh"
 #include "task_focusmeasure.hh"
@@ -15,6 +16,8 @@
 #include "task_depthmap_inpaint.hh"
 #include "task_background_removal.hh"
 #include "task_3dpreview.hh"
+#include "task_warp_wavelet.hh"
+#include "alignmentstore.hh"
 #include <thread>
 #include <opencv2/core/ocl.hpp>
 
@@ -25,6 +28,8 @@ FocusStack::FocusStack():
   m_depthmap_threshold(10),
   m_depthmap_smooth_xy(20),
   m_depthmap_smooth_z(40),
+  m_depthmap_scale(1),
+  m_depthmap_accumulators(0),
   m_halo_radius(20),
   m_remove_bg(0),
   m_disable_opencl(false),
@@ -32,10 +37,17 @@ FocusStack::FocusStack():
   m_nocrop(false),
   m_align_only(false),
   m_align_flags(ALIGN_DEFAULT),
+  m_align_schedule{256, 2048},
+  m_transforms_guess(false),
   m_3dviewpoint(1,1,1),
   m_3dzscale(1),
   m_threads(std::thread::hardware_concurrency() + 1), // +1 to have extra thread to give tasks for GPU
   m_batchsize(8),
+  m_stream_merge(false),
+  m_reassign_mode(REASSIGN_COLOR_MAP),
+  m_disk_map(false),
+  m_incremental_map(false),
+  m_two_phase(false),
   m_reference(-1),
   m_consistency(0),
   m_jpgquality(95),
@@ -115,6 +127,34 @@ void FocusStack::start()
     }
   }
 
+  if (m_incremental_map && m_disk_map)
+  {
+    m_logger->error("Incremental map is not supported with disk map, using batched map\n");
+    m_incremental_map = false;
+  }
+
+  m_saved_transforms.reset();
+  if (m_save_transforms != "")
+  {
+    m_saved_transforms = std::make_shared<AlignmentStore>();
+  }
+
+  m_loaded_transforms.reset();
+  if (m_load_transforms != "")
+  {
+    m_loaded_transforms = std::make_shared<AlignmentStore>();
+    try
+    {
+      m_loaded_transforms->load(m_load_transforms);
+      m_logger->verbose("Loaded %d transforms from %s\n", (int)m_loaded_transforms->size(), m_load_transforms.c_str());
+    }
+    catch (std::exception &e)
+    {
+      m_logger->error("%s, performing full alignment\n", e.what());
+      m_loaded_transforms.reset();
+    }
+  }
+
   // Add any images that have been added as filenames
   for (const std::string &input: m_inputs)
   {
@@ -180,6 +220,19 @@ bool FocusStack::wait_done(bool &status, std::string &errmsg, int timeout_ms)
     {
       errmsg = m_worker->error();
     }
+    else if (m_saved_transforms)
+    {
+      try
+      {
+        m_saved_transforms->save(m_save_transforms);
+      }
+      catch (std::exception &e)
+      {
+        status = false;
+        errmsg = e.what();
+      }
+      m_saved_transforms.reset();
+    }
 
     return true;
   }
@@ -194,17 +247,23 @@ void FocusStack::reset(bool keep_results)
   m_refidx = -1;
   m_input_images.clear();
   m_grayscale_imgs.clear();
+  m_pyramids.clear();
+  m_color_pyramids.clear();
   m_aligned_imgs.clear();
   m_aligned_grayscales.clear();
   m_refcolor.reset();
   m_refgray.reset();
   m_prev_merge.reset();
+  m_partial_depthmaps.clear();
   m_latest_depthmap.reset();
   m_merge_batch.clear();
+  m_stream_merge_task.reset();
   m_reassign_batch_grays.clear();
   m_reassign_batch_colors.clear();
   m_reassign_map.reset();
+  m_reassign_gather.reset();
   m_merged_gray.reset();
+  m_warp_window.clear();
 
   if (!keep_results)
   {
@@ -270,6 +329,8 @@ void FocusStack::schedule_queue_processing()
   if (count <= m_scheduled_image_count) return; // No new images
 
   m_grayscale_imgs.resize(count);
+  m_pyramids.resize(count);
+  m_color_pyramids.resize(count);
   m_aligned_imgs.resize(count);
   m_aligned_grayscales.resize(count);
 
@@ -285,10 +346,25 @@ void FocusStack::schedule_queue_processing()
 
     m_refcolor = m_input_images.at(m_refidx);
     m_refgray = std::make_shared<Task_Grayscale>(m_refcolor);
+    m_refgray->set_index(m_refidx);
     m_worker->add(m_refcolor);
     m_worker->add(m_refgray);
 
     m_grayscale_imgs.at(m_refidx) = m_refgray;
+
+    if (m_saved_transforms)
+    {
+      m_saved_transforms->set_reference(m_refcolor->basename());
+    }
+
+    // Exactly loaded transforms are only valid against the same reference image
+    if (m_loaded_transforms && !m_transforms_guess && m_loaded_transforms->reference() != ""
+        && m_loaded_transforms->reference() != m_refcolor->basename())
+    {
+      m_logger->verbose("Loaded transforms are against %s instead of %s, performing full alignment\n",
+                        m_loaded_transforms->reference().c_str(), m_refcolor->basename().c_str());
+      m_loaded_transforms.reset();
+    }
   }
 
   // Construct list of indexes. Perform alignment from reference image outwards.
@@ -306,22 +382,10 @@ void FocusStack::schedule_queue_processing()
     {
       // Schedule image loading
       m_worker->add(m_input_images.at(i));
-
-      // Convert image to grayscale
-      // The reference image is used to calculate the best mapping, which is then used for all images.
-      m_grayscale_imgs.at(i) = std::make_shared<Task_Grayscale>(m_input_images.at(i), m_refgray);
-      m_worker->add(m_grayscale_imgs.at(i));
     }
 
     // Track the indexes for depthmap
     m_input_images.at(i)->set_index(i);
-    m_grayscale_imgs.at(i)->set_index(i);
-
-    if (m_save_steps)
-    {
-      m_worker->add(std::make_shared<Task_SaveImg>("grayscale_" + m_grayscale_imgs.at(i)->basename(),
-                                                   m_grayscale_imgs.at(i), m_jpgquality, true));
-    }
 
     schedule_alignment(i);
 
@@ -330,29 +394,66 @@ void FocusStack::schedule_queue_processing()
       m_worker->add(std::make_shared<Task_SaveImg>(m_output + m_input_images.at(i)->basename(),
                                                    m_aligned_imgs.at(i), m_jpgquality, true));
     }
-    else
+    else if (!m_two_phase)
     {
-      if (m_save_steps)
-      {
-        // Task_Align adds "aligned_" prefix to the filename, so just use that name for saving also.
-        m_worker->add(std::make_shared<Task_SaveImg>(m_aligned_imgs.at(i)->filename(),
-                                                     m_aligned_imgs.at(i), m_jpgquality, true));
-      }
-
-      schedule_single_image_processing(i);
-      schedule_depthmap_processing(i, false);
+      schedule_merge_processing(i);
+    }
+  }
 
-      if (m_merge_batch.size() >= m_batchsize)
-      {
-        schedule_batch_merge();
-      }
+  if (m_two_phase && !m_align_only)
+  {
+    // Queue the second phase after all alignment tasks, so that the transforms
+    // are estimated first and the full-size images are processed afterwards.
+    for (int i : indexes)
+    {
+      schedule_merge_processing(i);
     }
+
+    // Don't keep the wavelet images of the last tasks alive
+    m_warp_window.clear();
   }
 
   m_scheduled_image_count = m_input_images.size();
   release_temporaries();
 }
 
+// Schedule the grayscale and downscaled images that are used for estimating
+// the alignment of image i or of its neighbour. Images with exactly known
+// alignment don't need them, so they are only created on first use.
+void FocusStack::schedule_alignment_inputs(int i)
+{
+  if (m_pyramids.at(i)) return;
+
+  if (!m_grayscale_imgs.at(i))
+  {
+    // Convert image to grayscale
+    // The reference image is used to calculate the best mapping, which is then used for all images.
+    m_grayscale_imgs.at(i) = std::make_shared<Task_Grayscale>(m_input_images.at(i), m_refgray);
+    m_grayscale_imgs.at(i)->set_index(i);
+    m_worker->add(m_grayscale_imgs.at(i));
+  }
+
+  // Downscaled images are shared between the alignment of this image and its neighbour
+  // Contrast and white balance are always matched at fine_resolution.
+  std::vector<int> levels = m_align_schedule;
+  levels.push_back(Task_Align::fine_resolution);
+  m_pyramids.at(i) = std::make_shared<Task_Pyramid>(m_grayscale_imgs.at(i), levels);
+  m_worker->add(m_pyramids.at(i));
+
+  if (!(m_align_flags & ALIGN_NO_WHITEBALANCE))
+  {
+    m_color_pyramids.at(i) = std::make_shared<Task_Pyramid>(m_input_images.at(i),
+                                                            std::vector<int>{Task_Align::fine_resolution});
+    m_worker->add(m_color_pyramids.at(i));
+  }
+
+  if (m_save_steps)
+  {
+    m_worker->add(std::make_shared<Task_SaveImg>("grayscale_" + m_grayscale_imgs.at(i)->basename(),
+                                                 m_grayscale_imgs.at(i), m_jpgquality, true));
+  }
+}
+
 void FocusStack::schedule_alignment(int i)
 {
   // Perform image alignment, against either the reference image or the neighbor image.
@@ -362,19 +463,84 @@ void FocusStack::schedule_alignment(int i)
   int neighbour = m_refidx;
   if (i < m_refidx) neighbour = i + 1;
   if (i > m_refidx) neighbour = i - 1;
-  if (i != m_refidx)
+
+  // Transforms from a previous run are matched by file name for exact reuse,
+  // and by position in stack when used as a guess for a similar stack.
+  AlignmentStore::entry_t loaded, loaded_neighbour;
+  bool have_loaded = false, have_loaded_neighbour = false;
+  if (m_loaded_transforms && i != m_refidx)
+  {
+    if (!m_transforms_guess)
+    {
+      have_loaded = m_loaded_transforms->get(m_input_images.at(i)->basename(), loaded);
+    }
+    else
+    {
+      have_loaded = m_loaded_transforms->get(i, loaded);
+      have_loaded_neighbour = m_loaded_transforms->get(neighbour, loaded_neighbour);
+    }
+
+    if (!have_loaded)
+    {
+      m_logger->verbose("No loaded transform for %s, performing full alignment\n",
+                        m_input_images.at(i)->basename().c_str());
+    }
+  }
+
+  // Tasks that only apply a known transform can do it with OpenCL.
+  // Estimation runs on CPU, and OpenCL tasks are run one at a time.
+  bool opencl_warp = m_have_opencl && !(m_two_phase && !m_align_only);
+
+  if (i != m_refidx && have_loaded && !m_transforms_guess)
   {
+    // Reuse the exact alignment from previous run.
+    // No grayscale or downscaled images are needed for this image.
+    if (opencl_warp)
+    {
+      aligned = std::make_shared<Task_Align_OpenCL>(m_refgray, m_refcolor,
+                                                    nullptr,
+                                                    m_input_images.at(i),
+                                                    nullptr,
+                                                    m_align_flags);
+    }
+    else
+    {
+      aligned = std::make_shared<Task_Align>(m_refgray, m_refcolor,
+                                              nullptr,
+                                              m_input_images.at(i),
+                                              nullptr,
+                                              m_align_flags);
+    }
+    aligned->set_loaded_transform(loaded, true);
+  }
+  else if (i != m_refidx)
+  {
+    schedule_alignment_inputs(i);
+
     if (m_align_flags & ALIGN_GLOBAL)
     {
+      schedule_alignment_inputs(m_refidx);
+
       // Align directly against the global reference, but use neighbour as a guess.
       // This can give slightly better alignment in shallow stacks with little blur.
       aligned = std::make_shared<Task_Align>(m_grayscale_imgs.at(m_refidx),
                                               m_aligned_imgs.at(m_refidx),
                                               m_grayscale_imgs.at(i),
                                               m_input_images.at(i),
-                                              m_aligned_imgs.at(neighbour),
-                                              nullptr,
-                                              m_align_flags);
+                                              have_loaded ? nullptr : m_aligned_imgs.at(neighbour),
+                                              m_align_flags,
+                                              m_pyramids.at(m_refidx),
+                                              m_pyramids.at(i));
+
+      if (m_color_pyramids.at(i))
+      {
+        aligned->set_color_pyramids(m_color_pyramids.at(m_refidx), m_color_pyramids.at(i));
+      }
+
+      if (have_loaded)
+      {
+        aligned->set_loaded_transform(loaded, false);
+      }
     }
     else
     {
@@ -384,13 +550,58 @@ void FocusStack::schedule_alignment(int i)
       // This also allows us to align against the original source image and stacking
       // the transforms later, which gives better parallelism while benefiting from
       // the similarity in alignment between neighbour images.
-      aligned = std::make_shared<Task_Align>(m_grayscale_imgs.at(neighbour),
+      // The estimation does not depend on the neighbour alignment, only the
+      // continuation task that stacks the transforms and warps the image does.
+      schedule_alignment_inputs(neighbour);
+
+      std::shared_ptr<Task_Align> estimate;
+      estimate = std::make_shared<Task_Align>(m_grayscale_imgs.at(neighbour),
                                               m_input_images.at(neighbour),
                                               m_grayscale_imgs.at(i),
                                               m_input_images.at(i),
                                               nullptr,
-                                              m_aligned_imgs.at(neighbour),
-                                              m_align_flags);
+                                              m_align_flags,
+                                              m_pyramids.at(neighbour),
+                                              m_pyramids.at(i));
+
+      if (m_color_pyramids.at(i))
+      {
+        estimate->set_color_pyramids(m_color_pyramids.at(neighbour), m_color_pyramids.at(i));
+      }
+
+      if (have_loaded && neighbour != m_refidx && !have_loaded_neighbour)
+      {
+        // The loaded transform is against the reference image and can't be
+        // made relative to the neighbour, so it is not usable as a guess.
+        m_logger->verbose("No loaded transform for neighbour of %s, aligning without guess\n",
+                          m_input_images.at(i)->basename().c_str());
+      }
+      else if (have_loaded)
+      {
+        // Loaded transforms are against the reference image, convert to neighbour
+        if (neighbour != m_refidx)
+        {
+          loaded.transformation = AlignmentStore::relative_transform(loaded.transformation,
+                                                                     loaded_neighbour.transformation);
+        }
+        estimate->set_loaded_transform(loaded, false);
+      }
+
+      estimate->set_schedule(m_align_schedule);
+      m_worker->add(estimate);
+
+      if (opencl_warp)
+      {
+        aligned = std::make_shared<Task_Align_OpenCL>(m_input_images.at(i), estimate,
+                                                      m_aligned_imgs.at(neighbour),
+                                                      m_align_flags);
+      }
+      else
+      {
+        aligned = std::make_shared<Task_Align>(m_input_images.at(i), estimate,
+                                                m_aligned_imgs.at(neighbour),
+                                                m_align_flags);
+      }
     }
   }
   else
@@ -400,49 +611,170 @@ void FocusStack::schedule_alignment(int i)
     aligned = std::make_shared<Task_Align>(m_refgray, m_refcolor, m_refgray, m_refcolor);
   }
 
+  aligned->set_schedule(m_align_schedule);
+
+  if (m_saved_transforms)
+  {
+    aligned->set_save_store(m_saved_transforms);
+  }
+
+  if (m_two_phase && !m_align_only)
+  {
+    // Image is warped later by Task_Warp_Wavelet
+    aligned->set_transform_only();
+  }
+  else if (!m_align_only)
+  {
+    // Grayscale of the aligned image is produced in the same pass as the color image
+    aligned->set_gray_output(m_refgray);
+  }
+
   m_aligned_imgs.at(i) = aligned;
   m_worker->add(aligned);
 }
 
+void FocusStack::schedule_merge_processing(int i)
+{
+  schedule_single_image_processing(i);
+  schedule_depthmap_processing(i, false);
+
+  if (m_merge_batch.size() >= m_batchsize || m_reassign_batch_colors.size() >= m_batchsize)
+  {
+    schedule_batch_merge();
+  }
+}
+
 void FocusStack::schedule_single_image_processing(int i)
 {
-  // Convert aligned image to grayscale again.
-  // We could also transform the grayscale images directly, but a new grayscale conversion is faster
-  // and results in less difference between the color and grayscale versions.
-  m_aligned_grayscales.at(i) = std::make_shared<Task_Grayscale>(m_aligned_imgs.at(i), m_refgray);
-  m_worker->add(m_aligned_grayscales.at(i));
-  m_reassign_batch_grays.push_back(m_aligned_grayscales.at(i));
-  m_reassign_batch_colors.push_back(m_aligned_imgs.at(i));
-
-  // Wavelet transform the image
+  std::shared_ptr<ImgTask> color = m_aligned_imgs.at(i);
   std::shared_ptr<ImgTask> wavelet;
-  if (m_have_opencl)
+
+  if (m_two_phase)
+  {
+    // The transform has been computed already, so the image can be aligned,
+    // converted to grayscale and wavelet transformed in one task.
+    // Images from files are loaded again, so that they don't need to stay in
+    // memory between the phases. A load waits until the image loaded as many
+    // tasks earlier has been transformed, so that no more images than threads
+    // are decoded at a time.
+    std::shared_ptr<Task_LoadImg> load;
+    std::shared_ptr<ImgTask> source = m_input_images.at(i);
+    if (i != m_refidx && !m_input_images.at(i)->is_memory_image())
+    {
+      load = std::make_shared<Task_LoadImg>(m_input_images.at(i)->filename());
+      load->set_index(i);
+
+      if (m_warp_window.size() >= (size_t)m_threads)
+      {
+        load->set_load_after(m_warp_window.front());
+        m_warp_window.pop_front();
+      }
+
+      m_worker->add(load);
+      source = load;
+    }
+
+    std::shared_ptr<Task_Warp_Wavelet> fused = std::make_shared<Task_Warp_Wavelet>(source, m_aligned_imgs.at(i), m_refgray);
+    m_worker->add(fused);
+    wavelet = fused;
+
+    if (load)
+    {
+      m_warp_window.push_back(fused);
+    }
+
+    color = Task_Warp_Wavelet::aligned_color(fused);
+    m_worker->add(color);
+    m_aligned_grayscales.at(i) = Task_Warp_Wavelet::aligned_gray(fused);
+    m_worker->add(m_aligned_grayscales.at(i));
+  }
+  else
   {
-    wavelet = std::make_shared<Task_Wavelet_OpenCL>(m_aligned_grayscales.at(i), false);
+    // Aligned image is converted to grayscale again, as part of the alignment task.
+    // We could also transform the grayscale images directly, but a new grayscale conversion is faster
+    // and results in less difference between the color and grayscale versions.
+    m_aligned_grayscales.at(i) = Task_Align::aligned_gray(m_aligned_imgs.at(i));
+    m_worker->add(m_aligned_grayscales.at(i));
+
+    // Wavelet transform the image
+    if (m_have_opencl)
+    {
+      wavelet = std::make_shared<Task_Wavelet_OpenCL>(m_aligned_grayscales.at(i), false);
+    }
+    else
+    {
+      wavelet = std::make_shared<Task_Wavelet>(m_aligned_grayscales.at(i), false);
+    }
+    m_worker->add(wavelet);
+  }
+
+  if (m_save_steps)
+  {
+    // Task_Align adds "aligned_" prefix to the filename, so just use that name for saving also.
+    m_worker->add(std::make_shared<Task_SaveImg>(color->filename(), color, m_jpgquality, true));
+  }
+
+  if (m_reassign_mode == REASSIGN_DEPTH_INDEX)
+  {
+    // Store the aligned image for gathering colors after the merge,
+    // so that it can be released right away.
+    if (!m_reassign_gather)
+    {
+      m_reassign_gather = std::make_shared<Task_Reassign_Gather>();
+    }
+
+    m_worker->add(m_reassign_gather->add(m_aligned_grayscales.at(i), color));
+  }
+  else if (m_incremental_map)
+  {
+    // Update reassignment map right away, so that the aligned image can be released.
+    m_reassign_map = std::make_shared<Task_Reassign_Map>(m_aligned_grayscales.at(i), color, m_reassign_map);
+    m_worker->add(m_reassign_map);
+  }
+  else
+  {
+    m_reassign_batch_grays.push_back(m_aligned_grayscales.at(i));
+    m_reassign_batch_colors.push_back(color);
+  }
+
+  if (m_stream_merge)
+  {
+    // Fold the wavelet image into the running merge as soon as it is ready
+    if (!m_stream_merge_task)
+    {
+      m_stream_merge_task = std::make_shared<Task_Merge_Stream>(m_consistency);
+    }
+
+    m_worker->add(m_stream_merge_task->add(wavelet));
   }
   else
   {
-    wavelet = std::make_shared<Task_Wavelet>(m_aligned_grayscales.at(i), false);
+    m_merge_batch.push_back(wavelet);
   }
-  m_worker->add(wavelet);
-  m_merge_batch.push_back(wavelet);
 }
 
 void FocusStack::schedule_batch_merge()
 {
   // Merge wavelet images accumulated so far
-  m_prev_merge = std::make_shared<Task_Merge>(m_prev_merge, m_merge_batch, m_consistency);
-  m_worker->add(m_prev_merge);
-  m_merge_batch.clear();
+  if (m_merge_batch.size() > 0)
+  {
+    m_prev_merge = std::make_shared<Task_Merge>(m_prev_merge, m_merge_batch, m_consistency);
+    m_worker->add(m_prev_merge);
+    m_merge_batch.clear();
+  }
 
-  // And update reassignment map.
+  // And update reassignment map, unless it is being updated incrementally.
   // After this, the aligned images can be unloaded from RAM.
-  m_reassign_map = std::make_shared<Task_Reassign_Map>(m_reassign_batch_grays,
-                                                       m_reassign_batch_colors,
-                                                       m_reassign_map);
-  m_worker->add(m_reassign_map);
-  m_reassign_batch_colors.clear();
-  m_reassign_batch_grays.clear();
+  if (m_reassign_batch_colors.size() > 0)
+  {
+    m_reassign_map = std::make_shared<Task_Reassign_Map>(m_reassign_batch_grays,
+                                                         m_reassign_batch_colors,
+                                                         m_reassign_map,
+                                                         m_disk_map);
+    m_worker->add(m_reassign_map);
+    m_reassign_batch_colors.clear();
+    m_reassign_batch_grays.clear();
+  }
 }
 
 void FocusStack::schedule_depthmap_processing(int i, bool is_final)
@@ -460,11 +792,54 @@ void FocusStack::schedule_depthmap_processing(int i, bool is_final)
         m_worker->add(std::make_shared<Task_SaveImg>(focusmeasure->filename(),
                               focusmeasure, m_jpgquality, true));
       }
+
+      // Layers are distributed over independent accumulators, so that they can be processed in parallel
+      if (m_partial_depthmaps.empty())
+      {
+        m_partial_depthmaps.resize(depthmap_accumulators());
+      }
+
+      std::shared_ptr<Task_Depthmap> &partial = m_partial_depthmaps.at(i % m_partial_depthmaps.size());
+      partial = std::make_shared<Task_Depthmap>(focusmeasure, i, false, partial,
+                                                m_save_steps, m_depthmap_scale);
+      m_worker->add(partial);
+    }
+
+    if (is_final)
+    {
+      // Sum the accumulators and compute the Gaussian fit
+      std::vector<std::shared_ptr<Task_Depthmap> > partials;
+      for (std::shared_ptr<Task_Depthmap> p : m_partial_depthmaps)
+      {
+        if (p) partials.push_back(p);
+      }
+
+      m_latest_depthmap = std::make_shared<Task_Depthmap>(partials, m_save_steps);
+      m_worker->add(m_latest_depthmap);
+      m_partial_depthmaps.clear();
     }
+  }
+}
 
-    m_latest_depthmap = std::make_shared<Task_Depthmap>(focusmeasure, i, is_final, m_latest_depthmap, m_save_steps);
-    m_worker->add(m_latest_depthmap);
+int FocusStack::depthmap_accumulators() const
+{
+  if (m_depthmap_accumulators > 0)
+  {
+    return m_depthmap_accumulators;
+  }
+
+  // Each accumulator holds 32 bytes per depthmap pixel.
+  // Use only one if low memory use has been requested.
+  if (m_stream_merge || m_disk_map || m_incremental_map || m_two_phase)
+  {
+    return 1;
   }
+
+  // With a reduced resolution depthmap, several accumulators together
+  // take no more memory than a single full resolution accumulator.
+  // At full resolution more than one is used only if requested.
+  int memory_limit = m_depthmap_scale * m_depthmap_scale;
+  return std::max(1, std::min(memory_limit, std::min(4, m_threads / 4)));
 }
 
 void FocusStack::release_temporaries()
@@ -485,6 +860,8 @@ void FocusStack::release_temporaries()
       // The image will be released by shared_ptr as soon as the tasks are done.
       m_input_images.at(i).reset();
       m_grayscale_imgs.at(i).reset();
+      m_pyramids.at(i).reset();
+      m_color_pyramids.at(i).reset();
       m_aligned_imgs.at(i).reset();
       m_aligned_grayscales.at(i).reset();
     }
@@ -500,7 +877,12 @@ void FocusStack::schedule_final_merge()
   {
     schedule_depthmap_processing(-1, true);
 
-    regenerate_depthmap();
+    // Reduced resolution depthmap is upsampled using the merged image,
+    // so it is scheduled only after the final merge below.
+    if (m_depthmap_scale <= 1)
+    {
+      regenerate_depthmap();
+    }
   }
 
   // Merge the final batch of images
@@ -509,25 +891,31 @@ void FocusStack::schedule_final_merge()
     schedule_batch_merge();
   }
 
-  // Denoise merged image
-  std::shared_ptr<ImgTask> denoised = m_prev_merge;
-  if (m_denoise > 0)
+  // All images have been folded into the streamed merge
+  if (m_stream_merge_task)
   {
-    denoised = std::make_shared<Task_Denoise>(m_prev_merge, m_denoise);
-    m_worker->add(denoised);
+    m_prev_merge = m_stream_merge_task;
+    m_worker->add(m_prev_merge);
+    m_stream_merge_task.reset();
   }
 
-  // Inverse-transform merged image
+  // Inverse-transform merged image, applying denoise on the fly.
+  // Merge result has no other consumers, so it can be overwritten.
   if (!m_have_opencl)
   {
-    m_merged_gray = std::make_shared<Task_Wavelet>(denoised, true);
+    m_merged_gray = std::make_shared<Task_Wavelet>(m_prev_merge, m_denoise, true);
   }
   else
   {
-    m_merged_gray = std::make_shared<Task_Wavelet_OpenCL>(denoised, true);
+    m_merged_gray = std::make_shared<Task_Wavelet_OpenCL>(m_prev_merge, m_denoise, true);
   }
   m_worker->add(m_merged_gray);
 
+  if (m_depthmap_scale > 1)
+  {
+    regenerate_depthmap();
+  }
+
   if (m_save_steps)
   {
     m_worker->add(std::make_shared<Task_SaveImg>(m_merged_gray->filename(), m_merged_gray, m_jpgquality, m_nocrop));
@@ -551,7 +939,16 @@ void FocusStack::schedule_final_merge()
   }
 
   // Reassign pixel values
-  m_result_image = std::make_shared<Task_Reassign>(m_reassign_map, m_merged_gray);
+  if (m_reassign_gather)
+  {
+    m_reassign_gather->set_merge(m_prev_merge, m_merged_gray);
+    m_result_image = m_reassign_gather;
+    m_reassign_gather.reset();
+  }
+  else
+  {
+    m_result_image = std::make_shared<Task_Reassign>(m_reassign_map, m_merged_gray);
+  }
   m_worker->add(m_result_image);
 
   // Save 3D preview
@@ -570,7 +967,8 @@ void FocusStack::regenerate_depthmap()
   if (m_latest_depthmap)
   {
     m_result_depthmap = std::make_shared<Task_Depthmap_Inpaint>(
-        m_latest_depthmap, m_depthmap_threshold, m_depthmap_smooth_xy, m_depthmap_smooth_z, m_halo_radius, m_save_steps);
+        m_latest_depthmap, m_depthmap_threshold, m_depthmap_smooth_xy, m_depthmap_smooth_z, m_halo_radius, m_save_steps,
+        (m_depthmap_scale > 1) ? m_merged_gray : nullptr);
     m_worker->add(m_result_depthmap);
   }
 }
@@ -4,6 +4,7 @@
 #include <sstream>
 #include <string>
 #include <vector>
+#include <deque>
 #include <unordered_set>
 #include <memory>
 #include <functional>
@@ -14,12 +15,17 @@ namespace focusstack {
 class Task_LoadImg;
 class Task_Grayscale;
 class Task_Merge;
+class Task_Merge_Stream;
 class Task_Align;
+class Task_Pyramid;
 class Task_Reassign_Map;
+class Task_Reassign_Gather;
 class Task_Depthmap;
 class Worker;
+class Task;
 class ImgTask;
 class Logger;
+class AlignmentStore;
 
 class FocusStack {
 public:
@@ -34,6 +40,20 @@ public:
     ALIGN_FULL_RESOLUTION     = 0x04,
     ALIGN_GLOBAL              = 0x08,
     ALIGN_KEEP_SIZE           = 0x10,
+
+    // Motion model used in alignment, default is full affine transform
+    ALIGN_MODEL_TRANSLATION   = 0x20, // Translation only, scale from initial estimate
+    ALIGN_MODEL_SIMILARITY    = 0x40, // Uniform scale, rotation and translation
+    ALIGN_MODEL_AUTO          = 0x80, // Translation, switching to affine if correlation is low
+    ALIGN_MODEL_MASK          = 0xE0,
+
+    ALIGN_NO_SEED             = 0x100, // Don't estimate initial scale and rotation with phase correlation
+  };
+
+  enum reassign_mode_t
+  {
+    REASSIGN_COLOR_MAP        = 0, // Store all distinct colors for each pixel
+    REASSIGN_DEPTH_INDEX      = 1, // Gather colors from the source images selected by the merge
   };
 
   enum log_level_t
@@ -54,6 +74,8 @@ public:
   void set_depthmap_threshold(int threshold) { m_depthmap_threshold = threshold; }
   void set_depthmap_smooth_xy(int smoothing) { m_depthmap_smooth_xy = smoothing; }
   void set_depthmap_smooth_z(int smoothing)  { m_depthmap_smooth_z = smoothing; }
+  void set_depthmap_scale(int scale) { m_depthmap_scale = scale; }
+  void set_depthmap_accumulators(int count) { m_depthmap_accumulators = count; } // 0 = automatic
   void set_halo_radius(int halo_radius) { m_halo_radius = halo_radius; }
   void set_remove_bg(int remove_bg) { m_remove_bg = remove_bg; }
   void set_disable_opencl(bool disable) { m_disable_opencl = disable; }
@@ -63,12 +85,20 @@ public:
   void set_verbose(bool verbose);
   void set_threads(int threads) { m_threads = threads; }
   void set_batchsize(int batchsize) { m_batchsize = batchsize; }
+  void set_stream_merge(bool stream) { m_stream_merge = stream; }
+  void set_reassign_mode(reassign_mode_t mode) { m_reassign_mode = mode; }
+  void set_disk_map(bool disk_map) { m_disk_map = disk_map; }
+  void set_incremental_map(bool incremental) { m_incremental_map = incremental; }
+  void set_two_phase(bool two_phase) { m_two_phase = two_phase; }
   void set_reference(int refidx) { m_reference = refidx; }
   void set_jpgquality(int level) { m_jpgquality = level; }
   void set_consistency(int level) { m_consistency = level; }
   void set_denoise(float level) { m_denoise = level; }
   void set_wait_images(float seconds) { m_wait_images = seconds; }
   void set_align_flags(int flags) { m_align_flags = static_cast<align_flags_t>(flags); }
+  void set_align_schedule(const std::vector<int> &resolutions) { m_align_schedule = resolutions; }
+  void set_save_transforms(std::string filename) { m_save_transforms = filename; }
+  void set_load_transforms(std::string filename, bool guess) { m_load_transforms = filename; m_transforms_guess = guess; }
   void set_3dviewpoint(float x, float y, float z, float zscale) { m_3dviewpoint = cv::Vec3f(x,y,z); m_3dzscale = zscale; }
   void set_3dviewpoint(std::string value) {
     std::istringstream is(value);
@@ -126,6 +156,8 @@ private:
   int m_depthmap_threshold;
   int m_depthmap_smooth_xy;
   int m_depthmap_smooth_z;
+  int m_depthmap_scale;
+  int m_depthmap_accumulators;
   int m_halo_radius;
   int m_remove_bg;
   bool m_disable_opencl;
@@ -134,12 +166,21 @@ private:
   bool m_align_only;
   std::shared_ptr<Logger> m_logger;
   align_flags_t m_align_flags;
+  std::vector<int> m_align_schedule;
+  std::string m_save_transforms;
+  std::string m_load_transforms;
+  bool m_transforms_guess;
 
   cv::Vec3f m_3dviewpoint;
   float m_3dzscale;
 
   int m_threads;
   int m_batchsize;
+  bool m_stream_merge;
+  reassign_mode_t m_reassign_mode;
+  bool m_disk_map;
+  bool m_incremental_map;
+  bool m_two_phase;
   int m_reference;
   int m_consistency;
   int m_jpgquality;
@@ -153,20 +194,31 @@ private:
   std::unique_ptr<Worker> m_worker;
   std::vector<std::shared_ptr<Task_LoadImg> > m_input_images; // Queued input images
   std::vector<std::shared_ptr<ImgTask> > m_grayscale_imgs;
+  std::vector<std::shared_ptr<Task_Pyramid> > m_pyramids; // Downscaled grayscale images for alignment
+  std::vector<std::shared_ptr<Task_Pyramid> > m_color_pyramids; // Downscaled color images for white balance
   std::vector<std::shared_ptr<Task_Align> > m_aligned_imgs;
   std::vector<std::shared_ptr<ImgTask> > m_aligned_grayscales;
   std::shared_ptr<Task_LoadImg> m_refcolor; // Alignment reference image
   std::shared_ptr<Task_Grayscale> m_refgray; // Grayscaled reference image
   std::shared_ptr<Task_Merge> m_prev_merge;
+  std::shared_ptr<AlignmentStore> m_saved_transforms; // Alignment results to save
+  std::shared_ptr<AlignmentStore> m_loaded_transforms; // Alignment results from previous run
+
+  // Latest fused warp tasks of two-phase processing. Images are loaded again
+  // only after the oldest of these has completed.
+  std::deque<std::shared_ptr<Task> > m_warp_window;
 
   // Depthmap building
+  std::vector<std::shared_ptr<Task_Depthmap> > m_partial_depthmaps; // Independent accumulators for subsets of layers
   std::shared_ptr<Task_Depthmap> m_latest_depthmap;
 
   // Final image merging
   std::vector<std::shared_ptr<ImgTask> > m_merge_batch;
+  std::shared_ptr<Task_Merge_Stream> m_stream_merge_task;
   std::vector<std::shared_ptr<ImgTask> > m_reassign_batch_grays;
   std::vector<std::shared_ptr<ImgTask> > m_reassign_batch_colors;
   std::shared_ptr<Task_Reassign_Map> m_reassign_map;
+  std::shared_ptr<Task_Reassign_Gather> m_reassign_gather;
   std::shared_ptr<ImgTask> m_merged_gray;
 
   // Result variables
@@ -178,10 +230,15 @@ private:
   // Queue worker tasks for new images in m_input_images
   void schedule_queue_processing();
   void schedule_alignment(int i);
+  void schedule_alignment_inputs(int i);
+  void schedule_merge_processing(int i);
   void schedule_single_image_processing(int i);
   void schedule_batch_merge();
   void schedule_depthmap_processing(int i, bool is_final);
 
+  // Number of partial depthmap accumulators to use
+  int depthmap_accumulators() const;
+
   // Release temporary images that are no longer needed
   void release_temporaries();
 
@@ -92,19 +92,28 @@ int main(int argc, const char *argv[])
                  "  --reference=0                 Set index of image used as alignment reference (default middle one)\n"
                  "  --global-align                Align directly against reference (default with neighbour image)\n"
                  "  --full-resolution-align       Use full resolution images in alignment (default max 2048 px)\n"
+                 "  --align-model=affine          Motion model: translation, similarity, affine or auto (default affine)\n"
+                 "  --align-schedule=256,2048     Resolutions of alignment passes, in increasing order (default 256,2048)\n"
+                 "  --no-align-seed               Don't estimate initial scale and rotation with phase correlation\n"
                  "  --no-whitebalance             Don't attempt to correct white balance differences\n"
                  "  --no-contrast                 Don't attempt to correct contrast and exposure differences\n"
                  "  --align-only                  Only align the input image stack and exit\n"
-                 "  --align-keep-size             Keep original image size by not cropping alignment borders\n";
+                 "  --align-keep-size             Keep original image size by not cropping alignment borders\n"
+                 "  --save-transforms=file.yml    Save alignment transforms to file\n"
+                 "  --load-transforms=file.yml    Reuse alignment transforms from file, skipping alignment\n"
+                 "  --transforms-guess            Use loaded transforms only as starting point for alignment\n";
     std::cerr << "\n";
     std::cerr << "Image merge options:\n"
                  "  --consistency=2               Neighbour pixel consistency filter level 0..2 (default 2)\n"
-                 "  --denoise=1.0                 Merged image denoise level (default 1.0)\n";
+                 "  --denoise=1.0                 Merged image denoise level (default 1.0)\n"
+                 "  --reassign=map                Color reassignment mode: map or depth (default map)\n";
     std::cerr << "\n";
     std::cerr << "Depth map generation options:\n"
                  "  --depthmap-threshold=10       Threshold to accept depth points (0-255, default 10)\n"
                  "  --depthmap-smooth-xy=20       Smoothing of depthmap in X and Y directions (default 20)\n"
                  "  --depthmap-smooth-z=40        Smoothing of depthmap in Z direction (default 40)\n"
+                 "  --depthmap-scale=1            Compute depthmap at 1/N resolution to save memory (default 1)\n"
+                 "  --depthmap-accumulators=K     Number of parallel depthmap accumulators (default 1, more with --depthmap-scale)\n"
                  "  --remove-bg=0                 Positive value removes black background, negative white\n"
                  "  --halo-radius=20              Radius of halo effects to remove from depthmap\n"
                  "  --3dviewpoint=x:y:z:zscale    Viewpoint for 3D view (default 1:1:1:2)\n";
@@ -112,6 +121,10 @@ int main(int argc, const char *argv[])
     std::cerr << "Performance options:\n"
                  "  --threads=2                   Select number of threads to use (default number of CPUs + 1)\n"
                  "  --batchsize=8                 Images per merge batch (default 8)\n"
+                 "  --stream-merge                Merge each image as soon as it is ready (lower memory use)\n"
+                 "  --disk-map                    Store color reassignment map in a temporary file (lower memory use)\n"
+                 "  --incremental-map             Update color reassignment map after each image (lower memory use, not with --disk-map)\n"
+                 "  --two-phase                   Estimate all alignments first, then process full images (lower memory use)\n"
                  "  --no-opencl                   Disable OpenCL GPU acceleration (default enabled)\n"
                  "  --wait-images=0.0             Wait for image files to appear (allows simultaneous capture and processing)\n";
     std::cerr << "\n";
@@ -150,13 +163,60 @@ int main(int argc, const char *argv[])
   if (options.has_flag("--no-whitebalance"))          flags |= FocusStack::ALIGN_NO_WHITEBALANCE;
   if (options.has_flag("--no-contrast"))              flags |= FocusStack::ALIGN_NO_CONTRAST;
   if (options.has_flag("--align-keep-size"))          flags |= FocusStack::ALIGN_KEEP_SIZE;
+  if (options.has_flag("--no-align-seed"))            flags |= FocusStack::ALIGN_NO_SEED;
+
+  std::string align_model = options.get_arg("--align-model", "affine");
+  if (align_model == "translation")
+  {
+    flags |= FocusStack::ALIGN_MODEL_TRANSLATION;
+  }
+  else if (align_model == "similarity")
+  {
+    flags |= FocusStack::ALIGN_MODEL_SIMILARITY;
+  }
+  else if (align_model == "auto")
+  {
+    flags |= FocusStack::ALIGN_MODEL_AUTO;
+  }
+  else if (align_model != "affine")
+  {
+    std::cerr << "Unknown align model: " << align_model << std::endl;
+    return 1;
+  }
   stack.set_align_flags(flags);
 
+  if (options.has_flag("--align-schedule"))
+  {
+    std::vector<int> schedule;
+    std::istringstream is(options.get_arg("--align-schedule"));
+    std::string level;
+    while (std::getline(is, level, ','))
+    {
+      schedule.push_back(std::stoi(level));
+      if (schedule.back() <= 0 || (schedule.size() > 1 && schedule.back() <= schedule.at(schedule.size() - 2)))
+      {
+        std::cerr << "Invalid align schedule, resolutions must be increasing" << std::endl;
+        return 1;
+      }
+    }
+
+    if (schedule.empty())
+    {
+      std::cerr << "Invalid align schedule, resolutions must be increasing" << std::endl;
+      return 1;
+    }
+
+    stack.set_align_schedule(schedule);
+  }
+
   if (options.has_flag("--reference"))
   {
     stack.set_reference(std::stoi(options.get_arg("--reference")));
   }
 
+  stack.set_save_transforms(options.get_arg("--save-transforms", ""));
+  stack.set_load_transforms(options.get_arg("--load-transforms", ""), options.has_flag("--transforms-guess"));
+
   if (options.has_flag("--align-only"))
   {
     stack.set_align_only(true);
@@ -167,10 +227,45 @@ int main(int argc, const char *argv[])
   stack.set_consistency(std::stoi(options.get_arg("--consistency", "2")));
   stack.set_denoise(std::stof(options.get_arg("--denoise", "1.0")));
 
+  std::string reassign = options.get_arg("--reassign", "map");
+  if (reassign == "map")
+  {
+    stack.set_reassign_mode(FocusStack::REASSIGN_COLOR_MAP);
+  }
+  else if (reassign == "depth")
+  {
+    stack.set_reassign_mode(FocusStack::REASSIGN_DEPTH_INDEX);
+  }
+  else
+  {
+    std::cerr << "Unknown reassign mode: " << reassign << std::endl;
+    return 1;
+  }
+
   // Depth map generation options
   stack.set_depthmap_smooth_xy(std::stof(options.get_arg("--depthmap-smooth-xy", "20")));
   stack.set_depthmap_smooth_z(std::stof(options.get_arg("--depthmap-smooth-z", "40")));
   stack.set_depthmap_threshold(std::stoi(options.get_arg("--depthmap-threshold", "10")));
+
+  int depthmap_scale = std::stoi(options.get_arg("--depthmap-scale", "1"));
+  if (depthmap_scale < 1)
+  {
+    std::cerr << "Invalid depthmap scale: " << depthmap_scale << std::endl;
+    return 1;
+  }
+  stack.set_depthmap_scale(depthmap_scale);
+
+  if (options.has_flag("--depthmap-accumulators"))
+  {
+    int accumulators = std::stoi(options.get_arg("--depthmap-accumulators"));
+    if (accumulators < 1)
+    {
+      std::cerr << "Invalid depthmap accumulator count: " << accumulators << std::endl;
+      return 1;
+    }
+    stack.set_depthmap_accumulators(accumulators);
+  }
+
   stack.set_halo_radius(std::stof(options.get_arg("--halo-radius", "20")));
   stack.set_remove_bg(std::stoi(options.get_arg("--remove-bg", "0")));
   stack.set_3dviewpoint(options.get_arg("--3dviewpoint", "1:1:1:2"));
@@ -186,6 +281,18 @@ int main(int argc, const char *argv[])
     stack.set_batchsize(std::stoi(options.get_arg("--batchsize")));
   }
 
+  if (options.has_flag("--stream-merge"))
+  {
+    stack.set_stream_merge(true);
+  }
+  if (options.has_flag("--disk-map") && options.has_flag("--incremental-map"))
+  {
+    std::cerr << "--incremental-map cannot be combined with --disk-map" << std::endl;
+    return 1;
+  }
+  stack.set_disk_map(options.has_flag("--disk-map"));
+  stack.set_incremental_map(options.has_flag("--incremental-map"));
+  stack.set_two_phase(options.has_flag("--two-phase"));
   stack.set_disable_opencl(options.has_flag("--no-opencl"));
   stack.set_wait_images(std::stof(options.get_arg("--wait-images", "0.0")));
 
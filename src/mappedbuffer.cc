@@ -0,0 +1,177 @@
+#include "mappedbuffer.hh"
+#include <stdexcept>
+#include <string>
+#include <cstdlib>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#endif
+
+using namespace focusstack;
+
+#ifdef _WIN32
+
+struct MappedBuffer::mapping_t
+{
+  HANDLE file;
+  HANDLE mapping;
+};
+
+void MappedBuffer::allocate(size_t size, bool disk_backed)
+{
+  release();
+
+  if (!disk_backed || size == 0)
+  {
+    m_heap.reset(new uint8_t[size]);
+    m_data = m_heap.get();
+    m_size = size;
+    return;
+  }
+
+  char dir[MAX_PATH + 1];
+  char path[MAX_PATH + 1];
+  if (!GetTempPathA(sizeof(dir), dir) || !GetTempFileNameA(dir, "fst", 0, path))
+  {
+    throw std::runtime_error("Failed to create temporary file name");
+  }
+
+  HANDLE file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                            FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (file == INVALID_HANDLE_VALUE)
+  {
+    throw std::runtime_error(std::string("Failed to create temporary file ") + path);
+  }
+
+  DWORD size_hi = (DWORD)((uint64_t)size >> 32);
+  DWORD size_lo = (DWORD)(size & 0xFFFFFFFF);
+  HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, size_hi, size_lo, NULL);
+  void *data = mapping ? MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size) : NULL;
+  if (!data)
+  {
+    if (mapping) CloseHandle(mapping);
+    CloseHandle(file);
+    throw std::runtime_error("Failed to map temporary file of " + std::to_string(size) + " bytes");
+  }
+
+  m_mapping = new mapping_t{file, mapping};
+  m_data = data;
+  m_size = size;
+}
+
+void MappedBuffer::release()
+{
+  if (m_mapping)
+  {
+    UnmapViewOfFile(m_data);
+    CloseHandle(m_mapping->mapping);
+    CloseHandle(m_mapping->file);
+    delete m_mapping;
+    m_mapping = nullptr;
+  }
+
+  m_heap.reset();
+  m_data = nullptr;
+  m_size = 0;
+}
+
+void MappedBuffer::advise_sequential()
+{
+  // Windows uses FILE_FLAG_SEQUENTIAL_SCAN given at file creation.
+}
+
+#else
+
+struct MappedBuffer::mapping_t
+{
+  int fd;
+};
+
+void MappedBuffer::allocate(size_t size, bool disk_backed)
+{
+  release();
+
+  if (!disk_backed || size == 0)
+  {
+    m_heap.reset(new uint8_t[size]);
+    m_data = m_heap.get();
+    m_size = size;
+    return;
+  }
+
+  // Create the file in TMPDIR, and unlink it immediately so that
+  // it gets deleted even if the process is terminated.
+  const char *dir = std::getenv("TMPDIR");
+  std::string path = std::string(dir ? dir : "/tmp") + "/focus-stack-XXXXXX";
+  int fd = mkstemp(&path[0]);
+  if (fd < 0)
+  {
+    throw std::runtime_error("Failed to create temporary file " + path + ": " + strerror(errno));
+  }
+  unlink(path.c_str());
+
+  // Reserve the disk space up front. A sparse file would only run out of
+  // space when the mapping is written, which kills the process with SIGBUS.
+#ifdef __APPLE__
+  // Mac OS X has no posix_fallocate()
+  fstore_t store = {F_ALLOCATEALL, F_PEOFPOSMODE, 0, (off_t)size, 0};
+  int err = 0;
+  if (fcntl(fd, F_PREALLOCATE, &store) == -1 || ftruncate(fd, size) != 0)
+  {
+    err = errno;
+  }
+#else
+  int err = posix_fallocate(fd, 0, size);
+#endif
+
+  if (err != 0)
+  {
+    close(fd);
+    throw std::runtime_error("Failed to allocate " + std::to_string(size) + " bytes for temporary file: " + strerror(err));
+  }
+
+  void *data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED)
+  {
+    int err = errno;
+    close(fd);
+    throw std::runtime_error("Failed to map temporary file: " + std::string(strerror(err)));
+  }
+
+  m_mapping = new mapping_t{fd};
+  m_data = data;
+  m_size = size;
+}
+
+void MappedBuffer::release()
+{
+  if (m_mapping)
+  {
+    munmap(m_data, m_size);
+    close(m_mapping->fd);
+    delete m_mapping;
+    m_mapping = nullptr;
+  }
+
+  m_heap.reset();
+  m_data = nullptr;
+  m_size = 0;
+}
+
+void MappedBuffer::advise_sequential()
+{
+  if (m_mapping)
+  {
+    madvise(m_data, m_size, MADV_SEQUENTIAL);
+  }
+}
+
+#endif
@@ -0,0 +1,68 @@
+// Memory buffer that can optionally be backed by a temporary file.
+// Used for large data structures that are accessed sequentially,
+// so that the operating system can page them out when RAM runs low.
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace focusstack {
+
+class MappedBuffer
+{
+public:
+  MappedBuffer() {}
+  ~MappedBuffer() { release(); }
+
+  MappedBuffer(const MappedBuffer&) = delete;
+  MappedBuffer& operator=(const MappedBuffer&) = delete;
+
+  // Allocate buffer of given size. Any previous contents are released.
+  // If disk_backed is true, the data is stored in a memory-mapped temporary file
+  // that is deleted when the buffer is released.
+  void allocate(size_t size, bool disk_backed);
+  void release();
+
+  // Hint the operating system that the data will be accessed sequentially.
+  void advise_sequential();
+
+  void *data() { return m_data; }
+  const void *data() const { return m_data; }
+  size_t size() const { return m_size; }
+  bool disk_backed() const { return m_mapping != nullptr; }
+
+private:
+  void *m_data = nullptr;
+  size_t m_size = 0;
+  std::unique_ptr<uint8_t[]> m_heap;
+
+  // Platform-specific handle of the mapping, nullptr when not disk backed.
+  struct mapping_t;
+  mapping_t *m_mapping = nullptr;
+};
+
+// Typed array stored in a MappedBuffer.
+// Elements are left uninitialized on allocation.
+template <typename T>
+class MappedArray
+{
+public:
+  void allocate(size_t count, bool disk_backed) { m_buffer.allocate(count * sizeof(T), disk_backed); m_count = count; }
+  void release() { m_buffer.release(); m_count = 0; }
+  void advise_sequential() { m_buffer.advise_sequential(); }
+
+  T *data() { return static_cast<T*>(m_buffer.data()); }
+  const T *data() const { return static_cast<const T*>(m_buffer.data()); }
+  size_t size() const { return m_count; }
+  bool disk_backed() const { return m_buffer.disk_backed(); }
+
+  T &operator[](size_t i) { return data()[i]; }
+  const T &operator[](size_t i) const { return data()[i]; }
+
+private:
+  MappedBuffer m_buffer;
+  size_t m_count = 0;
+};
+
+}
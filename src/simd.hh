@@ -0,0 +1,62 @@
+// Helpers for OpenCV universal intrinsics.
+// OpenCV 3.x and 4.x provide arithmetic and comparison operators for the
+// vector types, while OpenCV 5.x only has the function forms such as v_add().
+// The wrappers below compile with both, and must be called qualified as
+// simd::v_add() so that argument-dependent lookup doesn't make them ambiguous.
+
+#pragma once
+#include <opencv2/core.hpp>
+#include <opencv2/core/hal/intrin.hpp>
+
+namespace focusstack {
+namespace simd {
+
+#if CV_SIMD
+
+// Number of elements of type T in one vector register
+template <typename T>
+constexpr int lanes() { return CV_SIMD_WIDTH / sizeof(T); }
+
+#if CV_VERSION_MAJOR >= 5
+template <typename V> inline V v_add(const V &a, const V &b) { return cv::v_add(a, b); }
+template <typename V> inline V v_sub(const V &a, const V &b) { return cv::v_sub(a, b); }
+template <typename V> inline V v_mul(const V &a, const V &b) { return cv::v_mul(a, b); }
+template <typename V> inline V v_div(const V &a, const V &b) { return cv::v_div(a, b); }
+template <typename V> inline V v_and(const V &a, const V &b) { return cv::v_and(a, b); }
+template <typename V> inline V v_or(const V &a, const V &b) { return cv::v_or(a, b); }
+template <typename V> inline V v_eq(const V &a, const V &b) { return cv::v_eq(a, b); }
+template <typename V> inline V v_ne(const V &a, const V &b) { return cv::v_ne(a, b); }
+template <typename V> inline V v_lt(const V &a, const V &b) { return cv::v_lt(a, b); }
+template <typename V> inline V v_gt(const V &a, const V &b) { return cv::v_gt(a, b); }
+#else
+template <typename V> inline V v_add(const V &a, const V &b) { return a + b; }
+template <typename V> inline V v_sub(const V &a, const V &b) { return a - b; }
+template <typename V> inline V v_mul(const V &a, const V &b) { return a * b; }
+template <typename V> inline V v_div(const V &a, const V &b) { return a / b; }
+template <typename V> inline V v_and(const V &a, const V &b) { return a & b; }
+template <typename V> inline V v_or(const V &a, const V &b) { return a | b; }
+template <typename V> inline V v_eq(const V &a, const V &b) { return a == b; }
+template <typename V> inline V v_ne(const V &a, const V &b) { return a != b; }
+template <typename V> inline V v_lt(const V &a, const V &b) { return a < b; }
+template <typename V> inline V v_gt(const V &a, const V &b) { return a > b; }
+#endif
+
+// Convert a vector of 8-bit values to four vectors of floats
+inline void expand_f32(const cv::v_uint8 &v, cv::v_float32 &f0, cv::v_float32 &f1,
+                       cv::v_float32 &f2, cv::v_float32 &f3)
+{
+  cv::v_uint16 lo, hi;
+  cv::v_uint32 a, b, c, d;
+  cv::v_expand(v, lo, hi);
+  cv::v_expand(lo, a, b);
+  cv::v_expand(hi, c, d);
+  f0 = cv::v_cvt_f32(cv::v_reinterpret_as_s32(a));
+  f1 = cv::v_cvt_f32(cv::v_reinterpret_as_s32(b));
+  f2 = cv::v_cvt_f32(cv::v_reinterpret_as_s32(c));
+  f3 = cv::v_cvt_f32(cv::v_reinterpret_as_s32(d));
+}
+
+#endif
+
+}
+}
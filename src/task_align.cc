@@ -1,4 +1,5 @@
 #include "task_align.hh"
+#include "simd.hh"
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/imgcodecs.hpp>
@@ -7,16 +8,45 @@
 #include <opencv2/core/ocl.hpp>
 #include <cmath>
 #include <cstdio>
+#include <chrono>
 
 using namespace focusstack;
 
 static inline float sq(float x) { return x * x; }
 
+// Passes the grayscale version of the aligned image on as an image task.
+class Task_Align::GrayOutput: public ImgTask
+{
+public:
+  GrayOutput(std::shared_ptr<Task_Align> parent)
+  {
+    m_filename = parent->filename();
+    m_name = "Aligned grayscale " + m_filename;
+    m_index = parent->index();
+    m_parent = parent;
+    m_depends_on.push_back(parent);
+  }
+
+private:
+  virtual void task()
+  {
+    m_result = m_parent->m_gray;
+    m_uresult = m_parent->m_ugray;
+    m_parent->m_gray.release();
+    m_parent->m_ugray.release();
+    m_valid_area = m_parent->valid_area();
+    m_parent.reset();
+  }
+
+  std::shared_ptr<Task_Align> m_parent;
+};
+
 Task_Align::Task_Align(std::shared_ptr<ImgTask> refgray, std::shared_ptr<ImgTask> refcolor,
                        std::shared_ptr<ImgTask> srcgray, std::shared_ptr<ImgTask> srccolor,
                        std::shared_ptr<Task_Align> initial_guess,
-                       std::shared_ptr<Task_Align> stacked_transform,
-                       FocusStack::align_flags_t flags)
+                       FocusStack::align_flags_t flags,
+                       std::shared_ptr<Task_Pyramid> refpyramid,
+                       std::shared_ptr<Task_Pyramid> srcpyramid)
 {
   m_filename = "aligned_" + srccolor->basename();
   m_name = "Align " + srccolor->basename() + " to " + refcolor->basename();
@@ -27,14 +57,17 @@ Task_Align::Task_Align(std::shared_ptr<ImgTask> refgray, std::shared_ptr<ImgTask
   m_srcgray = srcgray;
   m_srccolor = srccolor;
   m_initial_guess = initial_guess;
-  m_stacked_transform = stacked_transform;
   m_flags = flags;
+  m_refpyramid = refpyramid;
+  m_srcpyramid = srcpyramid;
 
   m_depends_on.push_back(refgray);
   m_depends_on.push_back(refcolor);
-  m_depends_on.push_back(srcgray);
+  if (srcgray) m_depends_on.push_back(srcgray);
   m_depends_on.push_back(srccolor);
   if (initial_guess) m_depends_on.push_back(initial_guess);
+  if (refpyramid) m_depends_on.push_back(refpyramid);
+  if (srcpyramid) m_depends_on.push_back(srcpyramid);
 
   // Create initial guess for the transformation
   m_transformation.create(2, 3, CV_32F);
@@ -54,100 +87,108 @@ Task_Align::Task_Align(std::shared_ptr<ImgTask> refgray, std::shared_ptr<ImgTask
   m_whitebalance.at<float>(1, 0) = 1.0f;
   m_whitebalance.at<float>(3, 0) = 1.0f;
   m_whitebalance.at<float>(5, 0) = 1.0f;
+
+  m_seed_response = 0.0f;
+  m_escalated = false;
+  m_schedule = {rough_resolution, fine_resolution};
+  m_prev_movement = 0.0f;
+  m_prev_scale_ratio = 1.0f;
+  m_total_iterations = 0;
+  m_skipped_iterations = 0;
+  m_warp = true;
+  m_is_estimate = false;
+  m_identity = false;
+  m_loaded_exact = false;
+  m_loaded_guess = false;
+}
+
+Task_Align::Task_Align(std::shared_ptr<ImgTask> srccolor,
+                       std::shared_ptr<Task_Align> estimate,
+                       std::shared_ptr<Task_Align> stacked_transform,
+                       FocusStack::align_flags_t flags)
+{
+  m_filename = "aligned_" + srccolor->basename();
+  m_name = "Stack alignment of " + srccolor->basename();
+  m_index = srccolor->index();
+
+  m_srccolor = srccolor;
+  m_estimate = estimate;
+  m_stacked_transform = stacked_transform;
+  m_flags = flags;
+  m_seed_response = 0.0f;
+  m_escalated = false;
+  m_schedule = {rough_resolution, fine_resolution};
+  m_prev_movement = 0.0f;
+  m_prev_scale_ratio = 1.0f;
+  m_total_iterations = 0;
+  m_skipped_iterations = 0;
+  m_warp = true;
+  m_is_estimate = false;
+  m_identity = false;
+  m_loaded_exact = false;
+  m_loaded_guess = false;
+
+  m_depends_on.push_back(srccolor);
+  m_depends_on.push_back(estimate);
+  m_depends_on.push_back(stacked_transform);
+
+  // This task produces the aligned image, the estimate task only computes the transform.
+  estimate->m_warp = false;
+  estimate->m_is_estimate = true;
+  estimate->m_name = "Estimate alignment of " + srccolor->basename() + " to " + estimate->m_refcolor->basename();
+}
+
+void Task_Align::set_loaded_transform(const AlignmentStore::entry_t &entry, bool exact)
+{
+  entry.transformation.copyTo(m_transformation);
+
+  if (exact)
+  {
+    entry.contrast.copyTo(m_contrast);
+    entry.whitebalance.copyTo(m_whitebalance);
+    m_loaded_exact = true;
+  }
+  else
+  {
+    m_loaded_guess = true;
+  }
 }
 
 void Task_Align::task()
 {
   if (m_refcolor == m_srccolor)
   {
-    m_result = m_srccolor->img();
+    // Reference image is used as is
+    m_identity = true;
   }
   else
   {
-    if (m_initial_guess)
-    {
-      m_initial_guess->m_transformation.copyTo(m_transformation);
-    }
-
-    // Mask off the reflected borders generated by Task_LoadImg.
-    m_roi = m_srcgray->valid_area();
-
-    // Perform low resolution initial geometric alignment
-    match_transform(256, true);
-
-    // Perform grayscale brightness alignment
-    if (!(m_flags & FocusStack::ALIGN_NO_CONTRAST))
+    if (m_estimate)
     {
-      match_contrast();
+      m_estimate->m_transformation.copyTo(m_transformation);
+      m_estimate->m_contrast.copyTo(m_contrast);
+      m_estimate->m_whitebalance.copyTo(m_whitebalance);
+      stack_transform();
     }
-
-    // Perform color/whit balance alignment
-    if (!(m_flags & FocusStack::ALIGN_NO_WHITEBALANCE) && m_srccolor->img().channels() == 3)
+    else if (m_loaded_exact)
     {
-      match_whitebalance();
-    }
-
-    // Finally, do the high resolution geometric alignment step
-    if (m_flags & FocusStack::ALIGN_FULL_RESOLUTION)
-    {
-      int res = std::max(m_srccolor->img().cols, m_srccolor->img().rows);
-      match_transform(res, false);
+      m_logger->verbose("%s using transform loaded from file\n", basename().c_str());
     }
     else
     {
-      // By default limit image resolution used in alignment to 2k.
-      // Because this uses subpixel positioning, higher resolution provides little benefit.
-      match_transform(2048, false);
-    }
-
-    // The image is now aligned against the neighbour image.
-    // Now we can compute the alignment against the global reference image.
-    if (m_stacked_transform)
-    {
-      // At this point we need to know the stacked transform to apply it to the final image.
-      // Not putting this in m_depends_on gives better parallelism in the alignment phase.
-      m_stacked_transform->wait();
-      cv::Mat tmp = m_stacked_transform->m_transformation.clone();
-      tmp.resize(3, 0.0f);
-      tmp.at<float>(2, 2) = 1.0f;
-      m_transformation(cv::Rect(0, 0, 3, 2)) *= tmp;
-
-      // For contrast the stacking is not exact as x^3 and y^3 terms are not modelled,
-      // but close enough.
-      cv::Mat c = m_contrast.clone();
-      m_contrast *= m_stacked_transform->m_contrast.at<float>(0);
-      m_contrast.at<float>(1) += m_stacked_transform->m_contrast.at<float>(1) * c.at<float>(0);
-      m_contrast.at<float>(2) += m_stacked_transform->m_contrast.at<float>(2) * c.at<float>(0);
-      m_contrast.at<float>(2) += m_stacked_transform->m_contrast.at<float>(1) * c.at<float>(1);
-      m_contrast.at<float>(3) += m_stacked_transform->m_contrast.at<float>(3) * c.at<float>(0);
-      m_contrast.at<float>(4) += m_stacked_transform->m_contrast.at<float>(4) * c.at<float>(0);
-      m_contrast.at<float>(4) += m_stacked_transform->m_contrast.at<float>(3) * c.at<float>(3);
-
-      // For white balance, scale the brightness terms and multiply the contrast terms.
-      m_whitebalance.at<float>(0) += m_stacked_transform->m_whitebalance.at<float>(0) * m_whitebalance.at<float>(1);
-      m_whitebalance.at<float>(1) *= m_stacked_transform->m_whitebalance.at<float>(1);
-      m_whitebalance.at<float>(2) += m_stacked_transform->m_whitebalance.at<float>(2) * m_whitebalance.at<float>(3);
-      m_whitebalance.at<float>(3) *= m_stacked_transform->m_whitebalance.at<float>(3);
-      m_whitebalance.at<float>(4) += m_stacked_transform->m_whitebalance.at<float>(4) * m_whitebalance.at<float>(5);
-      m_whitebalance.at<float>(5) *= m_stacked_transform->m_whitebalance.at<float>(5);
+      estimate();
     }
 
-    if (m_logger->get_level() <= Logger::LOG_VERBOSE)
+    if (!m_is_estimate && m_logger->get_level() <= Logger::LOG_VERBOSE)
     {
       std::string name = basename();
       m_logger->verbose("%s transform: [%0.3f %0.3f %0.3f; %0.3f %0.3f %0.3f]\n",
                   name.c_str(),
                   m_transformation.at<float>(0, 0), m_transformation.at<float>(0, 1), m_transformation.at<float>(0, 2),
                   m_transformation.at<float>(1, 0), m_transformation.at<float>(1, 1), m_transformation.at<float>(1, 2));
-    }
-
-    apply_transform(m_srccolor->img(), m_result, false);
 
-    if (!(m_flags & FocusStack::ALIGN_NO_CONTRAST) || !(m_flags & FocusStack::ALIGN_NO_WHITEBALANCE))
-    {
-      if (m_logger->get_level() <= Logger::LOG_VERBOSE)
+      if (!(m_flags & FocusStack::ALIGN_NO_CONTRAST) || !(m_flags & FocusStack::ALIGN_NO_WHITEBALANCE))
       {
-        std::string name = basename();
         m_logger->verbose("%s contrast map: C:%0.3f, X:%0.3f, X2:%0.3f, Y:%0.3f, Y2:%0.3f\n",
                     name.c_str(),
                     m_contrast.at<float>(0), m_contrast.at<float>(1), m_contrast.at<float>(2),
@@ -159,19 +200,175 @@ void Task_Align::task()
                     m_whitebalance.at<float>(3), m_whitebalance.at<float>(2),
                     m_whitebalance.at<float>(1), m_whitebalance.at<float>(0));
       }
-
-      apply_contrast_whitebalance(m_result);
     }
   }
 
+  if (m_warp)
+  {
+    warp_result();
+  }
+
   compute_valid_area();
 
+  if (m_save_store)
+  {
+    AlignmentStore::entry_t entry;
+    entry.name = m_srccolor->basename();
+    entry.index = m_index;
+    entry.transformation = m_transformation;
+    entry.contrast = m_contrast;
+    entry.whitebalance = m_whitebalance;
+    m_save_store->set(entry);
+  }
+
+  release_inputs();
+}
+
+void Task_Align::release_inputs()
+{
   m_refgray.reset();
   m_refcolor.reset();
   m_srcgray.reset();
   m_srccolor.reset();
   m_initial_guess.reset();
+  m_estimate.reset();
   m_stacked_transform.reset();
+  m_refpyramid.reset();
+  m_srcpyramid.reset();
+  m_refcolorpyramid.reset();
+  m_srccolorpyramid.reset();
+  m_save_store.reset();
+  m_gray_reference.reset();
+}
+
+void Task_Align::apply_alignment(const cv::Mat &src, cv::Mat &dst) const
+{
+  apply_alignment(src, dst, nullptr, cv::Mat());
+}
+
+void Task_Align::apply_alignment(const cv::Mat &src, cv::Mat &dst, cv::Mat *gray, const cv::Mat &gray_weights) const
+{
+  if (m_identity)
+  {
+    dst = src;
+    if (gray) Task_Grayscale::convert(src, gray_weights, *gray);
+  }
+  else if (!(m_flags & FocusStack::ALIGN_NO_CONTRAST) || !(m_flags & FocusStack::ALIGN_NO_WHITEBALANCE))
+  {
+    // Grayscale conversion is done for each strip while it is still in cache
+    apply_transform_contrast_whitebalance(src, dst, gray, gray_weights);
+  }
+  else
+  {
+    apply_transform(src, dst, false);
+    if (gray) Task_Grayscale::convert(dst, gray_weights, *gray);
+  }
+}
+
+void Task_Align::warp_result()
+{
+  if (m_gray_reference)
+  {
+    apply_alignment(m_srccolor->img(), m_result, &m_gray, m_gray_reference->weights());
+  }
+  else
+  {
+    apply_alignment(m_srccolor->img(), m_result);
+  }
+}
+
+void Task_Align::set_gray_output(std::shared_ptr<Task_Grayscale> refgray)
+{
+  m_gray_reference = refgray;
+  m_depends_on.push_back(refgray);
+}
+
+std::shared_ptr<ImgTask> Task_Align::aligned_gray(std::shared_ptr<Task_Align> task)
+{
+  return std::make_shared<GrayOutput>(task);
+}
+
+void Task_Align::set_color_pyramids(std::shared_ptr<Task_Pyramid> refpyramid,
+                                    std::shared_ptr<Task_Pyramid> srcpyramid)
+{
+  m_refcolorpyramid = refpyramid;
+  m_srccolorpyramid = srcpyramid;
+  m_depends_on.push_back(refpyramid);
+  m_depends_on.push_back(srcpyramid);
+}
+
+// Estimate the transform, contrast and white balance against the reference image
+void Task_Align::estimate()
+{
+  if (m_initial_guess)
+  {
+    m_initial_guess->m_transformation.copyTo(m_transformation);
+  }
+
+  // Mask off the reflected borders generated by Task_LoadImg.
+  m_roi = m_srcgray->valid_area();
+
+  // The last level of the schedule is replaced by full resolution if requested
+  std::vector<int> schedule = m_schedule;
+  if (m_flags & FocusStack::ALIGN_FULL_RESOLUTION)
+  {
+    schedule.back() = std::max(m_srccolor->img().cols, m_srccolor->img().rows);
+  }
+
+  // Perform low resolution initial geometric alignment
+  match_transform(schedule.front(), 0, schedule.size());
+
+  // Perform grayscale brightness alignment
+  if (!(m_flags & FocusStack::ALIGN_NO_CONTRAST))
+  {
+    match_contrast();
+  }
+
+  // Perform color/whit balance alignment
+  if (!(m_flags & FocusStack::ALIGN_NO_WHITEBALANCE) && m_srccolor->img().channels() == 3)
+  {
+    match_whitebalance();
+  }
+
+  // Finally, refine the geometric alignment at increasing resolutions.
+  // By default resolution used in alignment is limited to 2k.
+  // Because this uses subpixel positioning, higher resolution provides little benefit.
+  for (size_t i = 1; i < schedule.size(); i++)
+  {
+    match_transform(schedule.at(i), i, schedule.size());
+  }
+
+  m_logger->verbose("%s ECC iteration limit %d in total, %d if the unseeded run was always made\n",
+                    basename().c_str(), m_total_iterations, m_total_iterations + m_skipped_iterations);
+}
+
+// The image has been aligned against the neighbour image.
+// Add the alignment of the neighbour to get the alignment against the global reference image.
+void Task_Align::stack_transform()
+{
+  cv::Mat tmp = m_stacked_transform->m_transformation.clone();
+  tmp.resize(3, 0.0f);
+  tmp.at<float>(2, 2) = 1.0f;
+  m_transformation(cv::Rect(0, 0, 3, 2)) *= tmp;
+
+  // For contrast the stacking is not exact as x^3 and y^3 terms are not modelled,
+  // but close enough.
+  cv::Mat c = m_contrast.clone();
+  m_contrast *= m_stacked_transform->m_contrast.at<float>(0);
+  m_contrast.at<float>(1) += m_stacked_transform->m_contrast.at<float>(1) * c.at<float>(0);
+  m_contrast.at<float>(2) += m_stacked_transform->m_contrast.at<float>(2) * c.at<float>(0);
+  m_contrast.at<float>(2) += m_stacked_transform->m_contrast.at<float>(1) * c.at<float>(1);
+  m_contrast.at<float>(3) += m_stacked_transform->m_contrast.at<float>(3) * c.at<float>(0);
+  m_contrast.at<float>(4) += m_stacked_transform->m_contrast.at<float>(4) * c.at<float>(0);
+  m_contrast.at<float>(4) += m_stacked_transform->m_contrast.at<float>(3) * c.at<float>(3);
+
+  // For white balance, scale the brightness terms and multiply the contrast terms.
+  m_whitebalance.at<float>(0) += m_stacked_transform->m_whitebalance.at<float>(0) * m_whitebalance.at<float>(1);
+  m_whitebalance.at<float>(1) *= m_stacked_transform->m_whitebalance.at<float>(1);
+  m_whitebalance.at<float>(2) += m_stacked_transform->m_whitebalance.at<float>(2) * m_whitebalance.at<float>(3);
+  m_whitebalance.at<float>(3) *= m_stacked_transform->m_whitebalance.at<float>(3);
+  m_whitebalance.at<float>(4) += m_stacked_transform->m_whitebalance.at<float>(4) * m_whitebalance.at<float>(5);
+  m_whitebalance.at<float>(5) *= m_stacked_transform->m_whitebalance.at<float>(5);
 }
 
 // Collect samples and use them to predict contrast between images
@@ -186,11 +383,15 @@ void Task_Align::match_contrast()
   int ysamples = 64;
   int total = xsamples * ysamples;
 
-  cv::Mat tmp;
-  apply_transform(m_srcgray->img(), tmp, false);
+  cv::Mat level;
+  float scale_ratio;
+  if (m_srcpyramid)
+    level = m_srcpyramid->level(fine_resolution, scale_ratio);
+  else
+    Task_Pyramid::downscale(m_srcgray->img(), level, fine_resolution, scale_ratio);
 
-  cv::resize(m_refgray->img()(m_roi), ref, cv::Size(xsamples, ysamples), 0, 0, cv::INTER_AREA);
-  cv::resize(tmp(m_roi), src, cv::Size(xsamples, ysamples), 0, 0, cv::INTER_AREA);
+  ref = sample_reference(m_refgray->img(), m_refpyramid, xsamples, ysamples);
+  src = sample_aligned(level, scale_ratio, xsamples, ysamples);
 
   cv::Mat contrast(total, 1, CV_32F);
   cv::Mat positions(total, 5, CV_32F);
@@ -205,7 +406,7 @@ void Task_Align::match_contrast()
       float xd = (x - ref.cols/2.0f) / (float)ref.cols;
 
       float refpix = (float)ref.at<uint8_t>(y, x);
-      float srcpix = (float)src.at<uint8_t>(y, x);
+      float srcpix = src.at<float>(y, x);
 
       float c = 1.0;
       if (refpix > 4 && srcpix > 4)
@@ -231,53 +432,456 @@ void Task_Align::match_contrast()
   }
 }
 
-void Task_Align::match_transform(int max_resolution, bool rough)
+void Task_Align::match_transform(int max_resolution, int level, int levels)
 {
-  cv::Mat ref, src, mask;
-
-  int resolution = std::max(m_refgray->img().cols, m_refgray->img().rows);
+  bool rough = (level == 0);
+  cv::Mat ref, src;
   float scale_ratio = 1.0f;
 
-  if (resolution <= max_resolution)
-  {
-    ref = m_refgray->img();
-    m_srcgray->img().copyTo(src);
-  }
+  // Use the shared downscaled images when available
+  if (m_refpyramid)
+    ref = m_refpyramid->level(max_resolution, scale_ratio);
   else
+    Task_Pyramid::downscale(m_refgray->img(), ref, max_resolution, scale_ratio);
+
+  if (m_srcpyramid)
+    src = m_srcpyramid->level(max_resolution, scale_ratio);
+  else
+    Task_Pyramid::downscale(m_srcgray->img(), src, max_resolution, scale_ratio);
+
+  // Contrast is applied in place, so the shared images must not be modified
+  if (m_srcpyramid || src.data == m_srcgray->img().data)
   {
-    scale_ratio = max_resolution / (float)resolution;
-    cv::resize(m_refgray->img(), ref, cv::Size(), scale_ratio, scale_ratio, cv::INTER_AREA);
-    cv::resize(m_srcgray->img(), src, cv::Size(), scale_ratio, scale_ratio, cv::INTER_AREA);
+    src = src.clone();
   }
 
-  mask.create(ref.rows, ref.cols, CV_8U);
-  mask = 0;
-  mask(cv::Rect((int)(m_roi.x * scale_ratio), (int)(m_roi.y * scale_ratio),
-                (int)(m_roi.width * scale_ratio), (int)(m_roi.height * scale_ratio))) = 255;
-
   apply_contrast_whitebalance(src);
 
+  // Only the valid area of the image is used in alignment
+  cv::Rect crop((int)(m_roi.x * scale_ratio), (int)(m_roi.y * scale_ratio),
+                (int)(m_roi.width * scale_ratio), (int)(m_roi.height * scale_ratio));
+  crop &= cv::Rect(0, 0, ref.cols, ref.rows);
+
   m_transformation.at<float>(0, 2) *= scale_ratio;
   m_transformation.at<float>(1, 2) *= scale_ratio;
 
-  if (rough)
+  // Without an initial guess, seed ECC from phase correlation.
+  cv::Mat unseeded;
+  if (rough && !m_initial_guess && !m_loaded_guess && !(m_flags & FocusStack::ALIGN_NO_SEED))
   {
-    cv::findTransformECC(src, ref, m_transformation, cv::MOTION_AFFINE,
-                        cv::TermCriteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, 25, 0.01),
-                        mask, 1);
+    unseeded = m_transformation.clone();
+    shift_transform(m_transformation, crop.x, crop.y);
+    seed_transform(src(crop), ref(crop));
+    shift_transform(m_transformation, -crop.x, -crop.y);
   }
-  else
+  // The seed is only used if the phase correlation peak was strong enough
+  bool seeded = !unseeded.empty() && (m_seed_response >= seed_good_response);
+
+  // A good seed needs fewer ECC iterations to converge.
+  bool good_seed = m_loaded_guess || (m_seed_response >= seed_good_response);
+  int default_iterations = rough ? 25 : 50;
+  int iterations = good_seed ? (rough ? 10 : 30) : default_iterations;
+
+  // Epsilon goes from 0.01 on the first level to 0.001 on the last one.
+  double epsilon = (levels > 1) ? 0.01 * std::pow(0.1, level / (double)(levels - 1)) : 0.01;
+
+  if (!rough)
+  {
+    // If the previous level moved the image only a little, it was already
+    // close to converged and this level needs fewer iterations.
+    float expected = m_prev_movement * scale_ratio / m_prev_scale_ratio;
+    float factor = std::min(1.0f, std::max(0.2f, expected / full_iterations_movement));
+    iterations = std::max(min_iterations, (int)std::round(iterations * factor));
+    epsilon = epsilon * std::min(2.0f, 1.0f / factor);
+  }
+
+  auto start_time = std::chrono::steady_clock::now();
+  cv::Mat before = m_transformation.clone();
+  int gauss_size = rough ? 1 : 3;
+  double correlation = -1.0;
+  bool seed_failed = false;
+
+  try
   {
-    cv::findTransformECC(src, ref, m_transformation, cv::MOTION_AFFINE,
-                        cv::TermCriteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, 50, 0.001),
-                        mask, 3);
+    m_total_iterations += iterations;
+    correlation = estimate_motion(src, ref, crop, rough, max_resolution, iterations, epsilon, gauss_size);
+  }
+  catch (cv::Exception &)
+  {
+    // A wrong seed can make ECC diverge, the unseeded run below is used instead.
+    if (!seeded) throw;
+    seed_failed = true;
+  }
+
+  if (seeded && !seed_failed && correlation >= seed_fallback_correlation)
+  {
+    // Seeded run converged well, phase correlation found the right peak.
+    m_skipped_iterations += default_iterations;
+  }
+  else if (seeded)
+  {
+    // Phase correlation can lock on to a wrong peak, so ECC is also run
+    // from the unseeded start and the result that correlates better is kept.
+    cv::Mat seeded_result = m_transformation.clone();
+    bool seeded_escalated = m_escalated;
+    unseeded.copyTo(m_transformation);
+    m_escalated = false;
+    double unseeded_correlation = -1.0;
+
+    try
+    {
+      m_total_iterations += default_iterations;
+      unseeded_correlation = estimate_motion(src, ref, crop, rough, max_resolution,
+                                             default_iterations, epsilon, gauss_size);
+    }
+    catch (cv::Exception &)
+    {
+      if (seed_failed) throw;
+    }
+
+    if (seed_failed || unseeded_correlation > correlation)
+    {
+      m_logger->verbose("%s unseeded correlation %0.4f is better than seeded %0.4f, ignoring seed\n",
+                        basename().c_str(), unseeded_correlation, correlation);
+      correlation = unseeded_correlation;
+      unseeded.copyTo(before);
+      m_seed_response = 0.0f;
+    }
+    else
+    {
+      seeded_result.copyTo(m_transformation);
+      m_escalated = seeded_escalated;
+    }
   }
 
+  // OpenCV does not report the number of iterations actually run, so the limit is logged.
+  float movement = transform_movement(before, m_transformation, crop.size());
+  double time_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_time).count();
+  m_logger->verbose("%s ECC at %d px: max %d iterations (default %d), eps %0.4f, "
+                    "moved %0.2f px, correlation %0.4f, %0.1f ms\n",
+                    basename().c_str(), max_resolution, iterations, default_iterations, epsilon,
+                    movement, correlation, time_ms);
+
+  m_prev_movement = movement;
+  m_prev_scale_ratio = scale_ratio;
 
   m_transformation.at<float>(0, 2) /= scale_ratio;
   m_transformation.at<float>(1, 2) /= scale_ratio;
 }
 
+// Run ECC with the selected motion model, starting from the current transform.
+double Task_Align::estimate_motion(const cv::Mat &src, const cv::Mat &ref, cv::Rect crop, bool rough,
+                                   int max_resolution, int iterations, double epsilon, int gauss_size)
+{
+  int model = m_flags & FocusStack::ALIGN_MODEL_MASK;
+  double correlation;
+
+  if (model == FocusStack::ALIGN_MODEL_TRANSLATION)
+  {
+    // The linear part of the transform stays as given by the seed.
+    correlation = find_transform_ecc(src, ref, crop, m_transformation,
+                                     cv::MOTION_TRANSLATION, iterations, epsilon, gauss_size);
+  }
+  else if (model == FocusStack::ALIGN_MODEL_SIMILARITY)
+  {
+    correlation = find_transform_ecc(src, ref, crop, m_transformation,
+                                     MOTION_SIMILARITY, iterations, epsilon, gauss_size);
+  }
+  else if (model == FocusStack::ALIGN_MODEL_AUTO && !m_escalated)
+  {
+    // Try the cheaper translation model first, and only estimate the full
+    // affine transform if the result does not correlate well.
+    cv::Mat start = m_transformation.clone();
+    correlation = -1.0;
+
+    try
+    {
+      correlation = find_transform_ecc(src, ref, crop, m_transformation,
+                                       cv::MOTION_TRANSLATION, iterations, epsilon, gauss_size);
+    }
+    catch (cv::Exception &)
+    {
+      // ECC fails if the model cannot converge at all, handled as low correlation.
+    }
+
+    if (correlation < auto_model_threshold)
+    {
+      m_logger->verbose("%s translation correlation %0.4f at %d px is below %0.2f, using affine model\n",
+                        basename().c_str(), correlation, max_resolution, auto_model_threshold);
+      start.copyTo(m_transformation);
+      m_escalated = true;
+      correlation = find_transform_ecc(src, ref, crop, m_transformation,
+                                       cv::MOTION_AFFINE, iterations, epsilon, gauss_size);
+    }
+  }
+  else
+  {
+    correlation = find_transform_ecc(src, ref, crop, m_transformation,
+                                     cv::MOTION_AFFINE, iterations, epsilon, gauss_size);
+  }
+
+  return correlation;
+}
+
+// Crop to the area instead of masking, so that ECC only processes the
+// pixels that matter. The translation is converted to the cropped
+// coordinates and back.
+double Task_Align::find_transform_ecc(const cv::Mat &src, const cv::Mat &ref, cv::Rect crop,
+                                      cv::Mat &transform, int motion,
+                                      int iterations, double epsilon, int gauss_size)
+{
+  shift_transform(transform, crop.x, crop.y);
+
+  double correlation;
+  if (motion == MOTION_SIMILARITY)
+  {
+    correlation = find_similarity_ecc(src(crop), ref(crop), transform, iterations, epsilon, gauss_size);
+  }
+  else
+  {
+    correlation = cv::findTransformECC(src(crop), ref(crop), transform, motion,
+                    cv::TermCriteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, iterations, epsilon),
+                    cv::noArray(), gauss_size);
+  }
+
+  shift_transform(transform, -crop.x, -crop.y);
+  return correlation;
+}
+
+// ECC alignment with transform [a -b tx; b a ty], which findTransformECC()
+// does not support. The iteration follows the OpenCV implementation: the
+// input image is warped onto the template, and the parameter update is
+// solved from the Jacobian of the warped image with respect to a, b, tx, ty.
+double Task_Align::find_similarity_ecc(const cv::Mat &templ, const cv::Mat &input, cv::Mat &transform,
+                                       int iterations, double epsilon, int gauss_size)
+{
+  project_similarity(transform);
+
+  cv::Mat tmpl, img;
+  templ.convertTo(tmpl, CV_32F);
+  input.convertTo(img, CV_32F);
+  cv::GaussianBlur(tmpl, tmpl, cv::Size(gauss_size, gauss_size), 0, 0);
+  cv::GaussianBlur(img, img, cv::Size(gauss_size, gauss_size), 0, 0);
+
+  cv::Mat gradx, grady;
+  cv::Sobel(img, gradx, CV_32F, 1, 0, 1, 0.5);
+  cv::Sobel(img, grady, CV_32F, 0, 1, 1, 0.5);
+
+  // Template pixel coordinates
+  cv::Mat xgrid(tmpl.size(), CV_32F), ygrid(tmpl.size(), CV_32F);
+  for (int y = 0; y < tmpl.rows; y++)
+  {
+    float *xrow = xgrid.ptr<float>(y);
+    float *yrow = ygrid.ptr<float>(y);
+    for (int x = 0; x < tmpl.cols; x++)
+    {
+      xrow[x] = x;
+      yrow[x] = y;
+    }
+  }
+
+  cv::Mat ones(img.size(), CV_8U, cv::Scalar(255));
+  cv::Mat warped, warpedx, warpedy, mask;
+  cv::Mat jacobian[4];
+  cv::Mat hessian(4, 4, CV_64F), image_projection(4, 1, CV_64F);
+  cv::Mat template_projection(4, 1, CV_64F), error_projection(4, 1, CV_64F);
+  double correlation = -1.0;
+  double last_correlation = -1.0;
+  int flags = cv::INTER_LINEAR | cv::WARP_INVERSE_MAP;
+
+  for (int i = 0; i < iterations; i++)
+  {
+    cv::warpAffine(img, warped, transform, tmpl.size(), flags);
+    cv::warpAffine(gradx, warpedx, transform, tmpl.size(), flags);
+    cv::warpAffine(grady, warpedy, transform, tmpl.size(), flags);
+    cv::warpAffine(ones, mask, transform, tmpl.size(), cv::INTER_NEAREST | cv::WARP_INVERSE_MAP);
+
+    // Zero-mean images over the area covered by the warped input
+    cv::Mat tmpl_zm = cv::Mat::zeros(tmpl.size(), CV_32F);
+    cv::Mat img_zm = cv::Mat::zeros(tmpl.size(), CV_32F);
+    cv::subtract(tmpl, cv::mean(tmpl, mask), tmpl_zm, mask);
+    cv::subtract(warped, cv::mean(warped, mask), img_zm, mask);
+    warpedx.setTo(0, mask == 0);
+    warpedy.setTo(0, mask == 0);
+
+    double tmpl_norm = cv::norm(tmpl_zm);
+    double img_norm = cv::norm(img_zm);
+    correlation = tmpl_zm.dot(img_zm) / (tmpl_norm * img_norm);
+
+    if (i > 0 && std::abs(correlation - last_correlation) < epsilon)
+    {
+      break;
+    }
+    last_correlation = correlation;
+
+    jacobian[0] = warpedx.mul(xgrid) + warpedy.mul(ygrid);
+    jacobian[1] = warpedy.mul(xgrid) - warpedx.mul(ygrid);
+    jacobian[2] = warpedx;
+    jacobian[3] = warpedy;
+
+    for (int r = 0; r < 4; r++)
+    {
+      for (int c = r; c < 4; c++)
+      {
+        hessian.at<double>(r, c) = hessian.at<double>(c, r) = jacobian[r].dot(jacobian[c]);
+      }
+      image_projection.at<double>(r) = jacobian[r].dot(img_zm);
+      template_projection.at<double>(r) = jacobian[r].dot(tmpl_zm);
+    }
+
+    cv::Mat hessian_inv = hessian.inv();
+    cv::Mat image_projection_hessian = hessian_inv * image_projection;
+    double lambda_n = img_norm * img_norm - image_projection.dot(image_projection_hessian);
+    double lambda_d = correlation * tmpl_norm * img_norm - template_projection.dot(image_projection_hessian);
+    if (lambda_d <= 0.0)
+    {
+      CV_Error(cv::Error::StsNoConv, "Similarity ECC did not converge");
+    }
+
+    cv::Mat error = (lambda_n / lambda_d) * tmpl_zm - img_zm;
+    for (int r = 0; r < 4; r++)
+    {
+      error_projection.at<double>(r) = jacobian[r].dot(error);
+    }
+
+    cv::Mat delta = hessian_inv * error_projection;
+    float da = (float)delta.at<double>(0);
+    float db = (float)delta.at<double>(1);
+    transform.at<float>(0, 0) += da;
+    transform.at<float>(1, 1) += da;
+    transform.at<float>(1, 0) += db;
+    transform.at<float>(0, 1) -= db;
+    transform.at<float>(0, 2) += (float)delta.at<double>(2);
+    transform.at<float>(1, 2) += (float)delta.at<double>(3);
+  }
+
+  return correlation;
+}
+
+// Largest distance that any corner of an image of given size moves
+// between two transforms.
+float Task_Align::transform_movement(const cv::Mat &a, const cv::Mat &b, cv::Size size)
+{
+  float result = 0.0f;
+  for (cv::Point2f p : {cv::Point2f(0, 0), cv::Point2f(size.width, 0),
+                        cv::Point2f(0, size.height), cv::Point2f(size.width, size.height)})
+  {
+    float dx = (b.at<float>(0, 0) - a.at<float>(0, 0)) * p.x + (b.at<float>(0, 1) - a.at<float>(0, 1)) * p.y
+             + (b.at<float>(0, 2) - a.at<float>(0, 2));
+    float dy = (b.at<float>(1, 0) - a.at<float>(1, 0)) * p.x + (b.at<float>(1, 1) - a.at<float>(1, 1)) * p.y
+             + (b.at<float>(1, 2) - a.at<float>(1, 2));
+    result = std::max(result, std::sqrt(dx * dx + dy * dy));
+  }
+  return result;
+}
+
+// Replace the linear part of an affine transform with the closest
+// combination of uniform scale and rotation.
+void Task_Align::project_similarity(cv::Mat &transform)
+{
+  float a = transform.at<float>(0, 0);
+  float b = transform.at<float>(0, 1);
+  float c = transform.at<float>(1, 0);
+  float d = transform.at<float>(1, 1);
+  float p = (a + d) / 2.0f;
+  float q = (c - b) / 2.0f;
+  transform.at<float>(0, 0) = p;
+  transform.at<float>(0, 1) = -q;
+  transform.at<float>(1, 0) = q;
+  transform.at<float>(1, 1) = p;
+}
+
+// Compute log magnitude of the centered Fourier spectrum of an image.
+// The magnitude does not depend on translation, and scaling the image by s
+// scales the spectrum by 1/s.
+static void log_spectrum(const cv::Mat &img, const cv::Mat &window, cv::Mat &dst)
+{
+  cv::Mat spectrum;
+  cv::Mat planes[2];
+  cv::dft(img.mul(window), spectrum, cv::DFT_COMPLEX_OUTPUT);
+  cv::split(spectrum, planes);
+  cv::magnitude(planes[0], planes[1], dst);
+  dst += 1.0f;
+  cv::log(dst, dst);
+
+  // Move the zero frequency to the center
+  int cx = dst.cols / 2;
+  int cy = dst.rows / 2;
+  cv::Mat shifted(dst.size(), dst.type());
+  dst(cv::Rect(0, 0, cx, cy)).copyTo(shifted(cv::Rect(dst.cols - cx, dst.rows - cy, cx, cy)));
+  dst(cv::Rect(cx, 0, dst.cols - cx, cy)).copyTo(shifted(cv::Rect(0, dst.rows - cy, dst.cols - cx, cy)));
+  dst(cv::Rect(0, cy, cx, dst.rows - cy)).copyTo(shifted(cv::Rect(dst.cols - cx, 0, cx, dst.rows - cy)));
+  dst(cv::Rect(cx, cy, dst.cols - cx, dst.rows - cy)).copyTo(shifted(cv::Rect(0, 0, dst.cols - cx, dst.rows - cy)));
+  dst = shifted;
+}
+
+// Estimate scale and translation between images by phase correlation.
+// Scale is found first from log-polar images of the spectra, where scaling
+// becomes a shift along the radius axis. Translation is then found between
+// the scale-corrected source and the reference.
+void Task_Align::seed_transform(const cv::Mat &src, const cv::Mat &ref)
+{
+  cv::Mat src32, ref32, window;
+  src.convertTo(src32, CV_32F);
+  ref.convertTo(ref32, CV_32F);
+  cv::createHanningWindow(window, src32.size(), CV_32F);
+
+  cv::Mat src_spectrum, ref_spectrum;
+  log_spectrum(src32, window, src_spectrum);
+  log_spectrum(ref32, window, ref_spectrum);
+
+  cv::Point2f center(src.cols / 2.0f, src.rows / 2.0f);
+  double max_radius = std::min(src.cols, src.rows) / 2.0;
+  cv::Size polar_size(src.cols, src.rows);
+  cv::Mat src_polar, ref_polar;
+  cv::warpPolar(src_spectrum, src_polar, polar_size, center, max_radius, cv::INTER_LINEAR | cv::WARP_POLAR_LOG);
+  cv::warpPolar(ref_spectrum, ref_polar, polar_size, center, max_radius, cv::INTER_LINEAR | cv::WARP_POLAR_LOG);
+
+  double response = 0;
+  cv::Point2d polar_shift = cv::phaseCorrelate(src_polar, ref_polar, cv::noArray(), &response);
+  float scale = (float)std::exp(-polar_shift.x * std::log(max_radius) / polar_size.width);
+
+  if (response < seed_good_response || std::abs(scale - 1.0f) > 0.1f)
+  {
+    // Focus breathing is small, larger values are most likely wrong.
+    scale = 1.0f;
+  }
+
+  cv::Mat seed(2, 3, CV_32F);
+  seed = 0.0f;
+  seed.at<float>(0, 0) = scale;
+  seed.at<float>(1, 1) = scale;
+  seed.at<float>(0, 2) = (1 - scale) * center.x;
+  seed.at<float>(1, 2) = (1 - scale) * center.y;
+
+  cv::Mat scaled = src32;
+  if (scale != 1.0f)
+  {
+    cv::warpAffine(src32, scaled, seed, src32.size(), cv::INTER_LINEAR, cv::BORDER_REFLECT);
+  }
+
+  cv::Point2d shift = cv::phaseCorrelate(scaled, ref32, window, &response);
+  seed.at<float>(0, 2) += (float)shift.x;
+  seed.at<float>(1, 2) += (float)shift.y;
+
+  m_logger->verbose("%s phase correlation seed: scale %0.4f, shift (%0.2f, %0.2f), response %0.3f\n",
+                    basename().c_str(), scale, shift.x, shift.y, response);
+
+  m_seed_response = (float)response;
+  if (response >= seed_good_response)
+  {
+    seed.copyTo(m_transformation);
+  }
+}
+
+// Convert transformation to coordinate system where origin is moved to (dx, dy).
+// For x' = x - d, the transformation A x + t becomes A x' + (t + A d - d).
+void Task_Align::shift_transform(cv::Mat &transform, float dx, float dy)
+{
+  transform.at<float>(0, 2) += transform.at<float>(0, 0) * dx + transform.at<float>(0, 1) * dy - dx;
+  transform.at<float>(1, 2) += transform.at<float>(1, 0) * dx + transform.at<float>(1, 1) * dy - dy;
+}
+
 void Task_Align::match_whitebalance()
 {
   cv::Mat ref, src;
@@ -286,12 +890,18 @@ void Task_Align::match_whitebalance()
   int ysamples = 64;
   int total = xsamples * ysamples;
 
-  cv::Mat tmp;
-  apply_transform(m_srccolor->img(), tmp, false);
-  apply_contrast_whitebalance(tmp);
+  cv::Mat level;
+  float scale_ratio;
+  if (m_srccolorpyramid)
+    level = m_srccolorpyramid->level(fine_resolution, scale_ratio);
+  else
+    Task_Pyramid::downscale(m_srccolor->img(), level, fine_resolution, scale_ratio);
 
-  cv::resize(m_refcolor->img()(m_roi), ref, cv::Size(xsamples, ysamples), 0, 0, cv::INTER_AREA);
-  cv::resize(tmp(m_roi), src, cv::Size(xsamples, ysamples), 0, 0, cv::INTER_AREA);
+  ref = sample_reference(m_refcolor->img(), m_refcolorpyramid, xsamples, ysamples);
+  src = sample_aligned(level, scale_ratio, xsamples, ysamples);
+
+  int rows = m_srccolor->img().rows;
+  int cols = m_srccolor->img().cols;
 
   cv::Mat targets(total * 3, 1, CV_32F);
   cv::Mat factors(total * 3, 6, CV_32F);
@@ -303,19 +913,29 @@ void Task_Align::match_whitebalance()
     {
       int idx = y * xsamples + x;
 
-      cv::Vec3b srcpixel = src.at<cv::Vec3b>(y, x);
+      cv::Vec3f srcpixel = src.at<cv::Vec3f>(y, x);
       cv::Vec3b refpixel = ref.at<cv::Vec3b>(y, x);
 
+      // Apply the contrast correction at the sample position, like
+      // apply_contrast_whitebalance() would do for the full image.
+      cv::Point2f center(m_roi.x + (x + 0.5f) * m_roi.width / xsamples,
+                         m_roi.y + (y + 0.5f) * m_roi.height / ysamples);
+      float yd = (center.y - rows/2.0f) / (float)rows;
+      float xd = (center.x - cols/2.0f) / (float)cols;
+      float c = m_contrast.at<float>(0)
+                + xd * (m_contrast.at<float>(1) + m_contrast.at<float>(2) * xd)
+                + yd * (m_contrast.at<float>(3) + m_contrast.at<float>(4) * yd);
+
       targets.at<float>(idx * 3 + 0, 0) = refpixel[0];
       targets.at<float>(idx * 3 + 1, 0) = refpixel[1];
       targets.at<float>(idx * 3 + 2, 0) = refpixel[2];
 
       factors.at<float>(idx * 3 + 0, 0) = 1.0f;
-      factors.at<float>(idx * 3 + 0, 1) = srcpixel[0];
+      factors.at<float>(idx * 3 + 0, 1) = srcpixel[0] * c;
       factors.at<float>(idx * 3 + 1, 2) = 1.0f;
-      factors.at<float>(idx * 3 + 1, 3) = srcpixel[1];
+      factors.at<float>(idx * 3 + 1, 3) = srcpixel[1] * c;
       factors.at<float>(idx * 3 + 2, 4) = 1.0f;
-      factors.at<float>(idx * 3 + 2, 5) = srcpixel[2];
+      factors.at<float>(idx * 3 + 2, 5) = srcpixel[2] * c;
     }
   }
 
@@ -327,6 +947,81 @@ void Task_Align::match_whitebalance()
   }
 }
 
+// Compute area averages of the reference image over a grid of blocks
+// covering m_roi. The downscaled image from the pyramid is used if available,
+// which is much cheaper than resizing the full resolution image.
+cv::Mat Task_Align::sample_reference(const cv::Mat &ref, std::shared_ptr<Task_Pyramid> pyramid,
+                                     int xsamples, int ysamples)
+{
+  cv::Mat level = ref;
+  float scale_ratio = 1.0f;
+  if (pyramid)
+  {
+    level = pyramid->level(fine_resolution, scale_ratio);
+  }
+
+  cv::Rect roi(cvRound(m_roi.x * scale_ratio), cvRound(m_roi.y * scale_ratio),
+               cvRound(m_roi.width * scale_ratio), cvRound(m_roi.height * scale_ratio));
+  roi &= cv::Rect(0, 0, level.cols, level.rows);
+
+  cv::Mat result;
+  cv::resize(level(roi), result, cv::Size(xsamples, ysamples), 0, 0, cv::INTER_AREA);
+  return result;
+}
+
+// Compute area averages of the aligned source image over a grid of blocks
+// covering m_roi. Instead of warping the whole image, each block center is
+// mapped back through the transformation and the average is taken from an
+// integral image of the downscaled source. Returns float samples.
+cv::Mat Task_Align::sample_aligned(const cv::Mat &src, float scale_ratio, int xsamples, int ysamples)
+{
+  int channels = src.channels();
+  cv::Mat sum;
+  cv::integral(src, sum, CV_64F);
+
+  cv::Mat inverse;
+  cv::invertAffineTransform(m_transformation, inverse);
+
+  // Block size in source level pixels. The transformation is close to
+  // identity, so the block size is not transformed.
+  float bw = m_roi.width / (float)xsamples;
+  float bh = m_roi.height / (float)ysamples;
+  int hw = std::max(1, cvRound(bw * scale_ratio / 2));
+  int hh = std::max(1, cvRound(bh * scale_ratio / 2));
+
+  cv::Mat result(ysamples, xsamples, CV_32FC(channels));
+  for (int y = 0; y < ysamples; y++)
+  {
+    float *dst = result.ptr<float>(y);
+    for (int x = 0; x < xsamples; x++)
+    {
+      float cx = m_roi.x + (x + 0.5f) * bw;
+      float cy = m_roi.y + (y + 0.5f) * bh;
+      float sx = inverse.at<float>(0, 0) * cx + inverse.at<float>(0, 1) * cy + inverse.at<float>(0, 2);
+      float sy = inverse.at<float>(1, 0) * cx + inverse.at<float>(1, 1) * cy + inverse.at<float>(1, 2);
+
+      int px = cvRound(sx * scale_ratio);
+      int py = cvRound(sy * scale_ratio);
+      int x0 = std::min(std::max(px - hw, 0), src.cols - 1);
+      int x1 = std::min(std::max(px + hw, x0 + 1), src.cols);
+      int y0 = std::min(std::max(py - hh, 0), src.rows - 1);
+      int y1 = std::min(std::max(py + hh, y0 + 1), src.rows);
+      double area = (double)(x1 - x0) * (y1 - y0);
+
+      const double *top = sum.ptr<double>(y0);
+      const double *bottom = sum.ptr<double>(y1);
+      for (int c = 0; c < channels; c++)
+      {
+        double s = bottom[x1 * channels + c] - bottom[x0 * channels + c]
+                 - top[x1 * channels + c] + top[x0 * channels + c];
+        dst[x * channels + c] = (float)(s / area);
+      }
+    }
+  }
+
+  return result;
+}
+
 // Round value to integer and add quantization error to delta for dithering.
 // Finally, clamp the result to 0..255 range
 static inline int round_and_dither(float value, float &delta)
@@ -336,62 +1031,174 @@ static inline int round_and_dither(float value, float &delta)
     return std::min(255, std::max(0, intval));
 }
 
-void Task_Align::apply_contrast_whitebalance(cv::Mat& img)
+Task_Align::correction_t Task_Align::get_correction(int rows, int cols, int channels) const
 {
-  if (img.channels() == 1)
+  correction_t corr;
+  corr.rows = rows;
+  corr.cols = cols;
+  corr.channels = channels;
+  corr.c0 = m_contrast.at<float>(0);
+  corr.c3 = m_contrast.at<float>(3);
+  corr.c4 = m_contrast.at<float>(4);
+
+  corr.c1 = m_contrast.at<float>(1);
+  corr.c2 = m_contrast.at<float>(2);
+  corr.xterms.resize(cols);
+  for (int x = 0; x < cols; x++)
+  {
+    float xd = (x - cols/2.0f) / (float)cols;
+    corr.xterms[x] = xd * (corr.c1 + corr.c2 * xd);
+  }
+
+  for (int c = 0; c < 3; c++)
   {
     // For grayscale images, apply contrast only
-    for (int y = 0; y < img.rows; y++)
-    {
-      float delta = 0.0f;
-      for (int x = 0; x < img.cols; x++)
-      {
-        float yd = (y - img.rows/2.0f) / (float)img.rows;
-        float xd = (x - img.cols/2.0f) / (float)img.cols;
+    corr.gain[c] = (channels == 3) ? m_whitebalance.at<float>(c * 2 + 1) : 1.0f;
+    corr.offset[c] = (channels == 3) ? m_whitebalance.at<float>(c * 2) : 0.0f;
+  }
 
-        float c = m_contrast.at<float>(0)
-                + xd * (m_contrast.at<float>(1) + m_contrast.at<float>(2) * xd)
-                + yd * (m_contrast.at<float>(3) + m_contrast.at<float>(4) * yd);
+  return corr;
+}
+
+#if CV_SIMD
+// Compute the corrected values for one vector of 8-bit pixels of channel c,
+// storing them to the planar buffer.
+static inline void correct_vector(const cv::v_uint8 &pixels, int x, int c, const float *xterms,
+                                  const cv::v_float32 &yterm, const cv::v_float32 &gain,
+                                  const cv::v_float32 &offset, float *buf, int cols)
+{
+  const int n = simd::lanes<float>();
+  cv::v_float32 f[4];
+  simd::expand_f32(pixels, f[0], f[1], f[2], f[3]);
+
+  for (int i = 0; i < 4; i++)
+  {
+    cv::v_float32 factor = simd::v_add(yterm, cv::vx_load(xterms + x + i * n));
+    cv::v_float32 value = simd::v_add(simd::v_mul(simd::v_mul(f[i], factor), gain), offset);
+    cv::v_store(buf + c * cols + x + i * n, value);
+  }
+}
+#endif
+
+// Apply contrast, white balance and dithering to one image row.
+// buf must have space for one row of float values, and is used as
+// planar storage with each channel on its own.
+void Task_Align::correct_row(uint8_t *row, int y, const correction_t &corr, float *buf)
+{
+  int cols = (int)corr.xterms.size();
+  int channels = corr.channels;
+  const float *xterms = corr.xterms.data();
+  float yterm = corr.yterm(y);
+
+  // Compute the corrected values first, as this has no dependencies between pixels
+  int x0 = 0;
+#if CV_SIMD
+  if (channels == 1 || channels == 3)
+  {
+    const int n = simd::lanes<uint8_t>();
+    cv::v_float32 vyterm = cv::vx_setall_f32(yterm);
+    cv::v_float32 gain[3], offset[3];
+    for (int c = 0; c < 3; c++)
+    {
+      gain[c] = cv::vx_setall_f32(corr.gain[c]);
+      offset[c] = cv::vx_setall_f32(corr.offset[c]);
+    }
 
-        // Simple dithering reduces banding in result image
-        uint8_t v = img.at<uint8_t>(y, x);
-        float f = v * c;
-        v = round_and_dither(f, delta);
-        img.at<uint8_t>(y, x) = v;
+    for (; x0 <= cols - n; x0 += n)
+    {
+      if (channels == 3)
+      {
+        cv::v_uint8 b, g, r;
+        cv::v_load_deinterleave(row + x0 * 3, b, g, r);
+        correct_vector(b, x0, 0, xterms, vyterm, gain[0], offset[0], buf, cols);
+        correct_vector(g, x0, 1, xterms, vyterm, gain[1], offset[1], buf, cols);
+        correct_vector(r, x0, 2, xterms, vyterm, gain[2], offset[2], buf, cols);
+      }
+      else
+      {
+        correct_vector(cv::vx_load(row + x0), x0, 0, xterms, vyterm, gain[0], offset[0], buf, cols);
       }
     }
   }
-  else
+#endif
+
+  for (int c = 0; c < channels; c++)
   {
-    // For RGB images, apply contrast and white balance
-    for (int y = 0; y < img.rows; y++)
+    float gain = corr.gain[c];
+    float offset = corr.offset[c];
+    for (int x = x0; x < cols; x++)
     {
-      float delta[3] = {0.0f, 0.0f, 0.0f};
+      buf[c * cols + x] = row[x * channels + c] * (yterm + xterms[x]) * gain + offset;
+    }
+  }
 
-      for (int x = 0; x < img.cols; x++)
-      {
-        float yd = (y - img.rows/2.0f) / (float)img.rows;
-        float xd = (x - img.cols/2.0f) / (float)img.cols;
+  // Simple dithering reduces banding in result image.
+  // The error carries from pixel to pixel, so this part is sequential.
+  float delta[3] = {0.0f, 0.0f, 0.0f};
+  for (int x = 0; x < cols; x++)
+  {
+    for (int c = 0; c < channels; c++)
+    {
+      row[x * channels + c] = round_and_dither(buf[c * cols + x], delta[c]);
+    }
+  }
+}
 
-        float c = m_contrast.at<float>(0)
-                + xd * (m_contrast.at<float>(1) + m_contrast.at<float>(2) * xd)
-                + yd * (m_contrast.at<float>(3) + m_contrast.at<float>(4) * yd);
+void Task_Align::apply_contrast_whitebalance(cv::Mat& img)
+{
+  correction_t corr = get_correction(img.rows, img.cols, img.channels());
+
+  cv::parallel_for_(cv::Range(0, img.rows), [&](const cv::Range &range) {
+    std::vector<float> buf(img.cols * img.channels());
+    for (int y = range.start; y < range.end; y++)
+    {
+      correct_row(img.ptr<uint8_t>(y), y, corr, buf.data());
+    }
+  });
+}
+
+// Warp the source image and apply contrast and white balance in one pass.
+// The output is processed in strips of rows, so that each strip is still
+// in cache when the correction is applied to it.
+void Task_Align::apply_transform_contrast_whitebalance(const cv::Mat &src, cv::Mat &dst,
+                                                       cv::Mat *gray, const cv::Mat &gray_weights) const
+{
+  const int strip_rows = 32;
+  int strips = (src.rows + strip_rows - 1) / strip_rows;
+  correction_t corr = get_correction(src.rows, src.cols, src.channels());
 
+  dst.create(src.rows, src.cols, src.type());
+  if (gray) gray->create(src.rows, src.cols, CV_8U);
+
+  cv::parallel_for_(cv::Range(0, strips), [&](const cv::Range &range) {
+    std::vector<float> buf(src.cols * src.channels());
+    cv::Mat transformation = m_transformation.clone();
+
+    for (int i = range.start; i < range.end; i++)
+    {
+      int y0 = i * strip_rows;
+      int y1 = std::min(src.rows, y0 + strip_rows);
+
+      // Warp only this strip by moving the output origin to its first row
+      cv::Mat strip = dst.rowRange(y0, y1);
+      transformation.at<float>(1, 2) = m_transformation.at<float>(1, 2) - y0;
+      cv::warpAffine(src, strip, transformation, strip.size(), cv::INTER_CUBIC, cv::BORDER_REFLECT);
 
-        cv::Vec3b v = img.at<cv::Vec3b>(y, x);
-        float b = v[0] * c * m_whitebalance.at<float>(1) + m_whitebalance.at<float>(0);
-        float g = v[1] * c * m_whitebalance.at<float>(3) + m_whitebalance.at<float>(2);
-        float r = v[2] * c * m_whitebalance.at<float>(5) + m_whitebalance.at<float>(4);
-        v[0] = round_and_dither(b, delta[0]);
-        v[1] = round_and_dither(g, delta[1]);
-        v[2] = round_and_dither(r, delta[2]);
-        img.at<cv::Vec3b>(y, x) = v;
+      for (int y = y0; y < y1; y++)
+      {
+        correct_row(dst.ptr<uint8_t>(y), y, corr, buf.data());
+      }
+
+      if (gray)
+      {
+        cv::Mat gray_strip = gray->rowRange(y0, y1);
+        Task_Grayscale::convert(strip, gray_weights, &gray_strip, nullptr);
       }
     }
-  }
+  });
 }
 
-void Task_Align::apply_transform(const cv::Mat &src, cv::Mat &dst, bool inverse)
+void Task_Align::apply_transform(const cv::Mat &src, cv::Mat &dst, bool inverse) const
 {
   int invflag = (!inverse) ? 0 : cv::WARP_INVERSE_MAP;
 
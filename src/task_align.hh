@@ -6,6 +6,9 @@
 #pragma once
 #include "worker.hh"
 #include "task_loadimg.hh"
+#include "task_pyramid.hh"
+#include "task_grayscale.hh"
+#include "alignmentstore.hh"
 #include "focusstack.hh"
 
 namespace focusstack {
@@ -16,40 +19,189 @@ public:
   // refgray / refcolor is the image to align with
   // srcgray / srccolor is the image to align
   // initial_guess is optional and result from that is used as the starting point for alignment
-  // stacked_transform is optional, if given it should represent the alignment computed for refgray, and is added to result.
-  // cropinfo is optional, if given it tells how much border was added in load phase
+  // refpyramid / srcpyramid are optional downscaled versions of refgray / srcgray
+  // srcgray can be null if the exact transform is given with set_loaded_transform()
   Task_Align(std::shared_ptr<ImgTask> refgray,
              std::shared_ptr<ImgTask> refcolor,
              std::shared_ptr<ImgTask> srcgray, std::shared_ptr<ImgTask> srccolor,
              std::shared_ptr<Task_Align> initial_guess = nullptr,
-             std::shared_ptr<Task_Align> stacked_transform = nullptr,
-             FocusStack::align_flags_t flags = FocusStack::ALIGN_DEFAULT
+             FocusStack::align_flags_t flags = FocusStack::ALIGN_DEFAULT,
+             std::shared_ptr<Task_Pyramid> refpyramid = nullptr,
+             std::shared_ptr<Task_Pyramid> srcpyramid = nullptr
             );
 
+  // Continuation of neighbour alignment:
+  // estimate is the alignment of srccolor against the neighbour image.
+  // stacked_transform is the alignment computed for the neighbour image, and is added to result.
+  // The estimate task will then only compute the transform, and this task applies it to srccolor.
+  Task_Align(std::shared_ptr<ImgTask> srccolor,
+             std::shared_ptr<Task_Align> estimate,
+             std::shared_ptr<Task_Align> stacked_transform,
+             FocusStack::align_flags_t flags = FocusStack::ALIGN_DEFAULT);
+
+  // Use transform loaded from file. If exact, the estimation is skipped.
+  // Otherwise the transformation is used as starting point for alignment.
+  void set_loaded_transform(const AlignmentStore::entry_t &entry, bool exact);
+
+  // Record the final alignment of the image to store when done.
+  void set_save_store(std::shared_ptr<AlignmentStore> store) { m_save_store = store; }
+
+  // Only compute the alignment, without producing the aligned image.
+  // The alignment can then be applied with apply_alignment().
+  void set_transform_only() { m_warp = false; }
+
+  // Apply the computed alignment to an image, after the task has completed.
+  // If gray is given, it is set to the grayscale conversion of dst.
+  void apply_alignment(const cv::Mat &src, cv::Mat &dst) const;
+  void apply_alignment(const cv::Mat &src, cv::Mat &dst, cv::Mat *gray, const cv::Mat &gray_weights) const;
+
+  // Also produce the grayscale version of the aligned image in the same pass,
+  // using the conversion weights of refgray. The result is available from
+  // the task returned by aligned_gray().
+  void set_gray_output(std::shared_ptr<Task_Grayscale> refgray);
+  static std::shared_ptr<ImgTask> aligned_gray(std::shared_ptr<Task_Align> task);
+
+  // Downscaled versions of refcolor / srccolor for white balance matching.
+  // Must include a level at fine_resolution.
+  void set_color_pyramids(std::shared_ptr<Task_Pyramid> refpyramid,
+                          std::shared_ptr<Task_Pyramid> srcpyramid);
+
+  // Set the resolutions of the ECC alignment passes, in increasing order.
+  // Contrast and white balance are matched after the first pass.
+  // Default is rough_resolution, fine_resolution.
+  void set_schedule(const std::vector<int> &resolutions) { m_schedule = resolutions; }
+
+  // Motion model of uniform scale, rotation and translation, which OpenCV does not have.
+  static const int MOTION_SIMILARITY = 16;
+
+  // Run ECC alignment of src against ref, using only the area inside crop.
+  // transform is in full image coordinates and is updated with the result.
+  // motion is cv::MOTION_TRANSLATION, cv::MOTION_AFFINE or MOTION_SIMILARITY.
+  // Returns the correlation coefficient of the result.
+  static double find_transform_ecc(const cv::Mat &src, const cv::Mat &ref, cv::Rect crop,
+                                   cv::Mat &transform, int motion,
+                                   int iterations, double epsilon, int gauss_size);
+
+  // Resolutions used in alignment, for building the pyramids
+  static const int rough_resolution = 256;
+  static const int fine_resolution = 2048;
+
+protected:
+  // Apply the alignment to the source image to produce the result, and
+  // the grayscale version if requested. Overridden by the OpenCL version.
+  virtual void warp_result();
+
+  // Precomputed terms of the contrast polynomial and white balance gains.
+  // The polynomial is separable, so the x terms are computed once per column
+  // and the y terms once per row.
+  struct correction_t
+  {
+    std::vector<float> xterms;
+    float c0, c1, c2, c3, c4;
+    int rows;
+    int cols;
+    int channels;
+    float gain[3];
+    float offset[3];
+
+    float yterm(int y) const
+    {
+      float yd = (y - rows/2.0f) / (float)rows;
+      return c0 + yd * (c3 + c4 * yd);
+    }
+  };
+
+  correction_t get_correction(int rows, int cols, int channels) const;
+
+  std::shared_ptr<ImgTask> m_srccolor;
+  std::shared_ptr<Task_Grayscale> m_gray_reference;
+  FocusStack::align_flags_t m_flags;
+  cv::Mat m_transformation;
+  bool m_identity;
+
+  // Grayscale output, in OpenCL memory if produced by the OpenCL version
+  class GrayOutput;
+  cv::Mat m_gray;
+  cv::UMat m_ugray;
+
 private:
   virtual void task();
 
+  void estimate();
+  void stack_transform();
+  void release_inputs();
   void match_contrast();
-  void match_transform(int max_resolution, bool rough);
+  void match_transform(int max_resolution, int level, int levels);
+  static void shift_transform(cv::Mat &transform, float dx, float dy);
+  void seed_transform(const cv::Mat &src, const cv::Mat &ref);
+  double estimate_motion(const cv::Mat &src, const cv::Mat &ref, cv::Rect crop, bool rough,
+                         int max_resolution, int iterations, double epsilon, int gauss_size);
+  static float transform_movement(const cv::Mat &a, const cv::Mat &b, cv::Size size);
+  static void project_similarity(cv::Mat &transform);
+  static double find_similarity_ecc(const cv::Mat &templ, const cv::Mat &input, cv::Mat &transform,
+                                    int iterations, double epsilon, int gauss_size);
   void match_whitebalance();
+  cv::Mat sample_reference(const cv::Mat &ref, std::shared_ptr<Task_Pyramid> pyramid, int xsamples, int ysamples);
+  cv::Mat sample_aligned(const cv::Mat &src, float scale_ratio, int xsamples, int ysamples);
 
+  static void correct_row(uint8_t *row, int y, const correction_t &corr, float *buf);
   void apply_contrast_whitebalance(cv::Mat &img);
-  void apply_transform(const cv::Mat &src, cv::Mat &dst, bool inverse);
+  void apply_transform_contrast_whitebalance(const cv::Mat &src, cv::Mat &dst,
+                                             cv::Mat *gray = nullptr, const cv::Mat &gray_weights = cv::Mat()) const;
+  void apply_transform(const cv::Mat &src, cv::Mat &dst, bool inverse) const;
   cv::Point2f transform_point(cv::Point2f point);
   void compute_valid_area();
 
   std::shared_ptr<ImgTask> m_refgray;
   std::shared_ptr<ImgTask> m_refcolor;
   std::shared_ptr<ImgTask> m_srcgray;
-  std::shared_ptr<ImgTask> m_srccolor;
   std::shared_ptr<Task_Align> m_initial_guess;
+  std::shared_ptr<Task_Align> m_estimate;
   std::shared_ptr<Task_Align> m_stacked_transform;
+  std::shared_ptr<Task_Pyramid> m_refpyramid;
+  std::shared_ptr<Task_Pyramid> m_srcpyramid;
+  std::shared_ptr<Task_Pyramid> m_refcolorpyramid;
+  std::shared_ptr<Task_Pyramid> m_srccolorpyramid;
 
-  FocusStack::align_flags_t m_flags;
   cv::Rect m_roi;
-  cv::Mat m_transformation;
   cv::Mat m_contrast;
   cv::Mat m_whitebalance;
+
+  // False if a continuation task applies the transform to the image
+  bool m_warp;
+  bool m_is_estimate;
+
+  // Transform loaded from file
+  bool m_loaded_exact;
+  bool m_loaded_guess;
+  std::shared_ptr<AlignmentStore> m_save_store;
+
+  // Phase correlation peak strength of the initial estimate, 0 if not seeded
+  float m_seed_response;
+  static constexpr float seed_good_response = 0.1f;
+
+  // ECC is run again from the unseeded start only if the seeded run fails
+  // or its correlation is below this, in case phase correlation locked on
+  // to a wrong peak.
+  static constexpr double seed_fallback_correlation = 0.95;
+
+  // Automatic motion model selection switches to affine model when the
+  // translation-only result correlates worse than this.
+  bool m_escalated;
+  static constexpr double auto_model_threshold = 0.95;
+
+  // Multi-scale ECC schedule. Iterations on each level are reduced when the
+  // previous level moved the image less than full_iterations_movement pixels.
+  std::vector<int> m_schedule;
+  float m_prev_movement;
+  float m_prev_scale_ratio;
+  static const int min_iterations = 5;
+
+  // Sum of ECC iteration limits over all runs for this image, and the
+  // limits of the unseeded runs that were skipped.
+  int m_total_iterations;
+  int m_skipped_iterations;
+  static constexpr float full_iterations_movement = 4.0f;
 };
 
 }
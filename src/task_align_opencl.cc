@@ -0,0 +1,114 @@
+#include "task_align_opencl.hh"
+#include <opencv2/imgproc.hpp>
+#include <opencv2/core/ocl.hpp>
+#include <stdexcept>
+#include <mutex>
+#include "task_align_opencl_kernels.cl"
+
+using namespace focusstack;
+
+// Work items per row in the warp kernel
+static const size_t warp_local_size = 64;
+
+static cv::ocl::Program &load_kernel(std::shared_ptr<Logger> logger)
+{
+  static std::once_flag s_init;
+  static cv::ocl::Program s_program;
+
+  std::call_once(s_init, [logger](){
+    cv::ocl::ProgramSource kernel_progsrc(g_focusstack_align_kernel_src);
+    cv::String buildflags = "";
+    cv::String errmsg;
+    if (!s_program.create(kernel_progsrc, buildflags, errmsg))
+    {
+      logger->error("Failed to build OpenCL alignment kernel: %s\n", errmsg.c_str());
+    }
+    else if (!errmsg.empty())
+    {
+      logger->verbose("OpenCL alignment kernel build log: %s\n", errmsg.c_str());
+    }
+  });
+
+  return s_program;
+}
+
+void Task_Align_OpenCL::warp_result()
+{
+  if (m_identity)
+  {
+    Task_Align::warp_result();
+    return;
+  }
+
+  cv::UMat usrc = m_srccolor->img().getUMat(cv::ACCESS_READ);
+
+  // Results stay in OpenCL memory. They are copied to host memory
+  // by img() only if a later task needs them there.
+  if (m_gray_reference)
+  {
+    apply_alignment_opencl(usrc, m_uresult, &m_ugray, m_gray_reference->weights());
+  }
+  else
+  {
+    apply_alignment_opencl(usrc, m_uresult, nullptr, cv::Mat());
+  }
+}
+
+void Task_Align_OpenCL::apply_alignment_opencl(const cv::UMat &src, cv::UMat &dst, cv::UMat *gray,
+                                               const cv::Mat &gray_weights) const
+{
+  // Contrast and white balance terms are identity when disabled
+  correction_t corr = get_correction(src.rows, src.cols, src.channels());
+
+  bool with_gray = (gray && src.channels() == 3);
+  cv::ocl::Kernel kernel;
+  if (!kernel.create("warp_correct", load_kernel(m_logger)))
+  {
+    throw std::runtime_error("Failed to create OpenCL kernel");
+  }
+
+  // cv::warpAffine() also uses the inverse transform for sampling
+  cv::Mat inverse;
+  cv::invertAffineTransform(m_transformation, inverse);
+
+  dst.create(src.rows, src.cols, src.type());
+  if (with_gray) gray->create(src.rows, src.cols, CV_8U);
+
+  // Gray output argument is always needed, but only written if with_gray is set
+  cv::UMat &gray_arg = with_gray ? *gray : dst;
+
+  int idx = 0;
+  idx = kernel.set(idx, cv::ocl::KernelArg::ReadOnly(src));
+  idx = kernel.set(idx, cv::ocl::KernelArg::WriteOnly(dst));
+  idx = kernel.set(idx, cv::ocl::KernelArg::WriteOnlyNoSize(gray_arg));
+  idx = kernel.set(idx, src.channels());
+  idx = kernel.set(idx, (int)with_gray);
+
+  for (int i = 0; i < 6; i++)
+  {
+    idx = kernel.set(idx, inverse.at<float>(i / 3, i % 3));
+  }
+
+  idx = kernel.set(idx, corr.c0);
+  idx = kernel.set(idx, corr.c1);
+  idx = kernel.set(idx, corr.c2);
+  idx = kernel.set(idx, corr.c3);
+  idx = kernel.set(idx, corr.c4);
+  for (int c = 0; c < 3; c++) idx = kernel.set(idx, corr.gain[c]);
+  for (int c = 0; c < 3; c++) idx = kernel.set(idx, corr.offset[c]);
+  for (int c = 0; c < 3; c++) idx = kernel.set(idx, with_gray ? gray_weights.at<float>(c) : 0.0f);
+
+  // One work group per row
+  size_t globalsize[1] = {(size_t)src.rows * warp_local_size};
+  size_t localsize[1] = {warp_local_size};
+  if (!kernel.run(1, globalsize, localsize, true))
+  {
+    throw std::runtime_error("Failed to execute OpenCL kernel");
+  }
+
+  if (gray && !with_gray)
+  {
+    // Grayscale input
+    *gray = dst;
+  }
+}
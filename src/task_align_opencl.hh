@@ -0,0 +1,28 @@
+// OpenCL-based GPU-accelerated version of Task_Align.
+// The alignment estimation runs on the CPU, but the final warp, contrast
+// and white balance correction and grayscale conversion are done in a
+// single OpenCL kernel. The results are kept in OpenCL memory, so that
+// the grayscale output can be passed to Task_Wavelet_OpenCL without
+// copying it to host memory.
+
+#pragma once
+#include "task_align.hh"
+
+namespace focusstack {
+
+class Task_Align_OpenCL: public Task_Align
+{
+public:
+  using Task_Align::Task_Align;
+
+  virtual bool uses_opencl() { return true; }
+
+  // Apply the computed alignment to an image using the OpenCL kernel.
+  // If gray is given, it is set to the grayscale conversion of dst.
+  void apply_alignment_opencl(const cv::UMat &src, cv::UMat &dst, cv::UMat *gray, const cv::Mat &gray_weights) const;
+
+protected:
+  virtual void warp_result();
+};
+
+}
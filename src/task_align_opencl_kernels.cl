@@ -0,0 +1,130 @@
+static const char* g_focusstack_align_kernel_src = R"---(
+// This file contains OpenCL code for applying the alignment in Task_Align_OpenCL.
+// It's wrapped in a C++ raw string literal to simplify including it in binary.
+
+// Results must match the CPU version, so multiply-add must not be fused.
+#pragma OPENCL FP_CONTRACT OFF
+
+inline int reflect_index(int i, int n)
+{
+  if (n == 1) return 0;
+  while (i < 0 || i >= n)
+  {
+    i = (i < 0) ? (-i - 1) : (2 * n - i - 1);
+  }
+  return i;
+}
+
+inline void cubic_coeffs(float x, float *c)
+{
+  const float A = -0.75f;
+  c[0] = ((A * (x + 1.0f) - 5.0f * A) * (x + 1.0f) + 8.0f * A) * (x + 1.0f) - 4.0f * A;
+  c[1] = ((A + 2.0f) * x - (A + 3.0f)) * x * x + 1.0f;
+  c[2] = ((A + 2.0f) * (1.0f - x) - (A + 3.0f)) * (1.0f - x) * (1.0f - x) + 1.0f;
+  c[3] = 1.0f - c[0] - c[1] - c[2];
+}
+
+// Number of pixels processed at a time by one work group
+#define CHUNK 256
+
+// Each work group computes one output row. The work items compute the
+// pixels of a chunk in parallel: bicubic interpolation with reflected
+// borders as in cv::warpAffine(), then the contrast polynomial and white
+// balance. The first work item then rounds the chunk with the same
+// error diffusion dither as Task_Align::correct_row(), continuing from
+// the previous chunk, and optionally converts it to grayscale.
+// m0..m5 is the inverse transform, from output to source coordinates.
+__kernel void warp_correct(__global const uchar *src, int src_step, int src_offset, int src_rows, int src_cols,
+                           __global uchar *dst, int dst_step, int dst_offset, int dst_rows, int dst_cols,
+                           __global uchar *gray, int gray_step, int gray_offset,
+                           int cn, int with_gray,
+                           float m0, float m1, float m2, float m3, float m4, float m5,
+                           float c0, float c1, float c2, float c3, float c4,
+                           float gain0, float gain1, float gain2,
+                           float offset0, float offset1, float offset2,
+                           float w0, float w1, float w2)
+{
+  __local float values[CHUNK * 3];
+
+  int y = get_group_id(0);
+  int lid = get_local_id(0);
+  int lsize = get_local_size(0);
+  if (y >= dst_rows) return;
+
+  float gain[3] = {gain0, gain1, gain2};
+  float offset[3] = {offset0, offset1, offset2};
+  float yd = (y - dst_rows / 2.0f) / (float)dst_rows;
+  float yterm = c0 + yd * (c3 + c4 * yd);
+  float delta[3] = {0.0f, 0.0f, 0.0f};
+
+  __global uchar *out = dst + dst_offset + y * dst_step;
+  __global uchar *grayout = gray + gray_offset + y * gray_step;
+
+  for (int x0 = 0; x0 < dst_cols; x0 += CHUNK)
+  {
+    int n = min(CHUNK, dst_cols - x0);
+
+    for (int i = lid; i < n; i += lsize)
+    {
+      int x = x0 + i;
+
+      // Source position by the inverse transform
+      float sx = m0 * x + m1 * y + m2;
+      float sy = m3 * x + m4 * y + m5;
+      int ix = (int)floor(sx);
+      int iy = (int)floor(sy);
+      float cx[4], cy[4];
+      cubic_coeffs(sx - ix, cx);
+      cubic_coeffs(sy - iy, cy);
+
+      float sum[3] = {0.0f, 0.0f, 0.0f};
+      for (int j = 0; j < 4; j++)
+      {
+        __global const uchar *row = src + src_offset + reflect_index(iy + j - 1, src_rows) * src_step;
+        for (int k = 0; k < 4; k++)
+        {
+          __global const uchar *p = row + reflect_index(ix + k - 1, src_cols) * cn;
+          float w = cy[j] * cx[k];
+          for (int c = 0; c < cn; c++) sum[c] += p[c] * w;
+        }
+      }
+
+      // The warp output is rounded to 8 bits before correction on CPU
+      float xd = (x - dst_cols / 2.0f) / (float)dst_cols;
+      float factor = yterm + xd * (c1 + c2 * xd);
+      for (int c = 0; c < cn; c++)
+      {
+        float v = clamp(rint(sum[c]), 0.0f, 255.0f);
+        values[i * cn + c] = v * factor * gain[c] + offset[c];
+      }
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (lid == 0)
+    {
+      for (int i = 0; i < n; i++)
+      {
+        int result[3];
+        for (int c = 0; c < cn; c++)
+        {
+          float value = values[i * cn + c];
+          int intval = (int)(value + delta[c]);
+          delta[c] += value - intval;
+          result[c] = clamp(intval, 0, 255);
+          out[(x0 + i) * cn + c] = (uchar)result[c];
+        }
+
+        if (with_gray)
+        {
+          // Same rounding as Task_Grayscale::convert()
+          float t = clamp(rint(result[0] * w0 + result[1] * w1), 0.0f, 255.0f);
+          grayout[x0 + i] = (uchar)clamp(rint(t + result[2] * w2), 0.0f, 255.0f);
+        }
+      }
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+}
+)---";
@@ -0,0 +1,97 @@
+#include <gtest/gtest.h>
+#include <opencv2/core/ocl.hpp>
+#include <opencv2/imgproc.hpp>
+#include "task_align_opencl.hh"
+#include "logger.hh"
+
+namespace focusstack {
+
+#ifndef GTEST_SKIP
+// Compatibility with old googletest versions.
+#define GTEST_SKIP() return
+#endif
+
+// Warp with contrast and white balance correction on OpenCL should
+// give the same result as on CPU, including the dithering.
+TEST(Task_Align_OpenCL, MatchesCPU) {
+  if (!cv::ocl::haveOpenCL()) GTEST_SKIP();
+  cv::ocl::setUseOpenCL(true);
+
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+
+  cv::Mat input(120, 160, CV_8UC3);
+  cv::randu(input, 0, 256);
+  cv::GaussianBlur(input, input, cv::Size(0, 0), 2.0);
+
+  std::shared_ptr<ImgTask> ref = std::make_shared<ImgTask>(input);
+  std::shared_ptr<ImgTask> src = std::make_shared<ImgTask>(input);
+  std::shared_ptr<Task_Grayscale> refgray = std::make_shared<Task_Grayscale>(ref);
+  refgray->run(logger);
+
+  AlignmentStore::entry_t entry;
+  entry.transformation.create(2, 3, CV_32F);
+  entry.transformation.at<float>(0, 0) = 1.01f;
+  entry.transformation.at<float>(0, 1) = 0.02f;
+  entry.transformation.at<float>(0, 2) = 3.3f;
+  entry.transformation.at<float>(1, 0) = -0.015f;
+  entry.transformation.at<float>(1, 1) = 0.99f;
+  entry.transformation.at<float>(1, 2) = -2.7f;
+
+  entry.contrast.create(5, 1, CV_32F);
+  entry.contrast.at<float>(0) = 1.1f;
+  entry.contrast.at<float>(1) = 0.05f;
+  entry.contrast.at<float>(2) = -0.1f;
+  entry.contrast.at<float>(3) = 0.02f;
+  entry.contrast.at<float>(4) = 0.1f;
+
+  entry.whitebalance.create(6, 1, CV_32F);
+  entry.whitebalance.at<float>(0) = 2.0f;
+  entry.whitebalance.at<float>(1) = 0.9f;
+  entry.whitebalance.at<float>(2) = 0.0f;
+  entry.whitebalance.at<float>(3) = 1.0f;
+  entry.whitebalance.at<float>(4) = -3.0f;
+  entry.whitebalance.at<float>(5) = 1.1f;
+
+  // With identity transform the interpolation is exact, and the correction,
+  // dithering and grayscale conversion must match exactly.
+  // Otherwise cv::warpAffine() uses fixed point coordinates, which causes
+  // small differences in interpolation.
+  cv::Mat transforms[2] = {cv::Mat::eye(2, 3, CV_32F), entry.transformation};
+  double max_diff[2] = {0.0, 2.0};
+  double max_mean[2] = {0.0, 0.02};
+  for (int i = 0; i < 2; i++)
+  {
+    entry.transformation = transforms[i];
+    std::shared_ptr<Task_Align> cpu = std::make_shared<Task_Align>(refgray, ref, refgray, src);
+    std::shared_ptr<Task_Align> gpu = std::make_shared<Task_Align_OpenCL>(refgray, ref, refgray, src);
+    cpu->set_loaded_transform(entry, true);
+    gpu->set_loaded_transform(entry, true);
+    cpu->set_gray_output(refgray);
+    gpu->set_gray_output(refgray);
+    cpu->run(logger);
+    gpu->run(logger);
+
+    std::shared_ptr<ImgTask> cpugray = Task_Align::aligned_gray(cpu);
+    std::shared_ptr<ImgTask> gpugray = Task_Align::aligned_gray(gpu);
+    cpugray->run(logger);
+    gpugray->run(logger);
+
+    // Results stay in OpenCL memory until requested from host
+    ASSERT_FALSE(gpu->uimg().empty());
+    ASSERT_FALSE(gpugray->uimg().empty());
+
+    cv::Mat diff;
+    cv::absdiff(cpu->img(), gpu->img(), diff);
+    double maxdiff;
+    cv::minMaxLoc(diff.reshape(1), nullptr, &maxdiff);
+    ASSERT_LE(maxdiff, max_diff[i]);
+    ASSERT_LE(cv::mean(diff)[0], max_mean[i]);
+
+    cv::absdiff(cpugray->img(), gpugray->img(), diff);
+    cv::minMaxLoc(diff, nullptr, &maxdiff);
+    ASSERT_LE(maxdiff, max_diff[i]);
+    ASSERT_LE(cv::mean(diff)[0], max_mean[i]);
+  }
+}
+
+}
@@ -0,0 +1,345 @@
+#include <gtest/gtest.h>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/video.hpp>
+#include "task_align.hh"
+#include "logger.hh"
+
+namespace focusstack {
+
+// Smooth random texture that ECC can lock on to
+static cv::Mat make_texture(int rows, int cols)
+{
+  cv::Mat img(rows, cols, CV_8U);
+  cv::randu(img, 0, 256);
+  cv::GaussianBlur(img, img, cv::Size(0, 0), 3.0);
+  cv::normalize(img, img, 0, 255, cv::NORM_MINMAX);
+  return img;
+}
+
+// Largest distance between the corners of the image mapped through two transforms
+static float corner_distance(const cv::Mat &a, const cv::Mat &b, cv::Size size)
+{
+  float result = 0.0f;
+  for (cv::Point2f p : {cv::Point2f(0, 0), cv::Point2f(size.width, 0),
+                        cv::Point2f(0, size.height), cv::Point2f(size.width, size.height)})
+  {
+    float dx = (b.at<float>(0, 0) - a.at<float>(0, 0)) * p.x + (b.at<float>(0, 1) - a.at<float>(0, 1)) * p.y
+             + (b.at<float>(0, 2) - a.at<float>(0, 2));
+    float dy = (b.at<float>(1, 0) - a.at<float>(1, 0)) * p.x + (b.at<float>(1, 1) - a.at<float>(1, 1)) * p.y
+             + (b.at<float>(1, 2) - a.at<float>(1, 2));
+    result = std::max(result, std::sqrt(dx * dx + dy * dy));
+  }
+  return result;
+}
+
+// ECC on the cropped valid area must give the same transform as ECC on
+// the full frame with the area outside the crop masked off.
+TEST(Task_Align, CroppedMatchesMasked) {
+  cv::Mat ref = make_texture(256, 256);
+
+  // Small rotation, scale and translation
+  cv::Mat expected(2, 3, CV_32F);
+  expected.at<float>(0, 0) = 1.01f * std::cos(0.01f);
+  expected.at<float>(0, 1) = -std::sin(0.01f);
+  expected.at<float>(0, 2) = 3.2f;
+  expected.at<float>(1, 0) = std::sin(0.01f);
+  expected.at<float>(1, 1) = 1.01f * std::cos(0.01f);
+  expected.at<float>(1, 2) = -1.7f;
+  cv::Mat src;
+  cv::warpAffine(ref, src, expected, ref.size(), cv::INTER_LINEAR | cv::WARP_INVERSE_MAP, cv::BORDER_REFLECT);
+
+  // Pixels outside the crop are garbage and must not affect the result
+  cv::Rect crop(24, 16, 200, 220);
+  cv::Mat mask(ref.size(), CV_8U, cv::Scalar(0));
+  mask(crop) = 255;
+  cv::Mat garbage(ref.size(), CV_8U);
+  cv::randu(garbage, 0, 256);
+  ref(crop).copyTo(garbage(crop));
+  ref = garbage;
+
+  cv::Mat masked = cv::Mat::eye(2, 3, CV_32F);
+  cv::findTransformECC(src, ref, masked, cv::MOTION_AFFINE,
+                       cv::TermCriteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, 50, 0.001),
+                       mask, 3);
+
+  cv::Mat cropped = cv::Mat::eye(2, 3, CV_32F);
+  Task_Align::find_transform_ecc(src, ref, crop, cropped, cv::MOTION_AFFINE, 50, 0.001, 3);
+
+  EXPECT_LT(corner_distance(masked, expected, ref.size()), 0.25f);
+  EXPECT_LT(corner_distance(cropped, expected, ref.size()), 0.25f);
+  EXPECT_LT(corner_distance(cropped, masked, ref.size()), 0.25f);
+}
+
+
+// Run alignment on a synthetic image pair and return the resulting transform
+static cv::Mat run_alignment(const cv::Mat &ref, const cv::Mat &src, int flags)
+{
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+  cv::Mat refcolor, srccolor;
+  cv::cvtColor(ref, refcolor, cv::COLOR_GRAY2BGR);
+  cv::cvtColor(src, srccolor, cv::COLOR_GRAY2BGR);
+
+  std::shared_ptr<ImgTask> refimg = std::make_shared<ImgTask>(refcolor);
+  std::shared_ptr<ImgTask> srcimg = std::make_shared<ImgTask>(srccolor);
+  std::shared_ptr<Task_Grayscale> refgray = std::make_shared<Task_Grayscale>(refimg);
+  std::shared_ptr<Task_Grayscale> srcgray = std::make_shared<Task_Grayscale>(srcimg, refgray);
+  refgray->run(logger);
+  srcgray->run(logger);
+
+  std::shared_ptr<AlignmentStore> store = std::make_shared<AlignmentStore>();
+  std::shared_ptr<Task_Align> task = std::make_shared<Task_Align>(
+    refgray, refimg, srcgray, srcimg, nullptr,
+    (FocusStack::align_flags_t)(flags | FocusStack::ALIGN_NO_CONTRAST | FocusStack::ALIGN_NO_WHITEBALANCE));
+  task->set_save_store(store);
+  task->run(logger);
+
+  AlignmentStore::entry_t entry;
+  EXPECT_TRUE(store->get(srcimg->basename(), entry));
+  return entry.transformation;
+}
+
+// Scale and rotation between the images must be found with and without
+// the phase correlation seed. With the translation model, the scale can
+// only come from the seed.
+TEST(Task_Align, SeedRotateScale) {
+  cv::Mat ref = make_texture(512, 512);
+
+  cv::Mat expected(2, 3, CV_32F);
+  expected.at<float>(0, 0) = 1.04f * std::cos(0.02f);
+  expected.at<float>(0, 1) = -1.04f * std::sin(0.02f);
+  expected.at<float>(0, 2) = 6.5f;
+  expected.at<float>(1, 0) = 1.04f * std::sin(0.02f);
+  expected.at<float>(1, 1) = 1.04f * std::cos(0.02f);
+  expected.at<float>(1, 2) = -4.2f;
+  cv::Mat src;
+  cv::warpAffine(ref, src, expected, ref.size(), cv::INTER_LINEAR | cv::WARP_INVERSE_MAP, cv::BORDER_REFLECT);
+
+  cv::Mat seeded = run_alignment(ref, src, FocusStack::ALIGN_DEFAULT);
+  cv::Mat unseeded = run_alignment(ref, src, FocusStack::ALIGN_NO_SEED);
+  EXPECT_LT(corner_distance(seeded, expected, ref.size()), 0.25f);
+  EXPECT_LT(corner_distance(unseeded, expected, ref.size()), 0.25f);
+
+  cv::Mat seeded_translation = run_alignment(ref, src, FocusStack::ALIGN_MODEL_TRANSLATION);
+  cv::Mat unseeded_translation = run_alignment(ref, src, FocusStack::ALIGN_MODEL_TRANSLATION | FocusStack::ALIGN_NO_SEED);
+  EXPECT_NEAR(seeded_translation.at<float>(0, 0), 1.04f, 0.01f);
+  EXPECT_LT(corner_distance(seeded_translation, expected, ref.size()),
+            corner_distance(unseeded_translation, expected, ref.size()));
+}
+
+
+static cv::Mat warp_texture(const cv::Mat &img, float scale, float angle, float dx, float dy)
+{
+  cv::Mat transform(2, 3, CV_32F);
+  transform.at<float>(0, 0) = scale * std::cos(angle);
+  transform.at<float>(0, 1) = -scale * std::sin(angle);
+  transform.at<float>(0, 2) = dx;
+  transform.at<float>(1, 0) = scale * std::sin(angle);
+  transform.at<float>(1, 1) = scale * std::cos(angle);
+  transform.at<float>(1, 2) = dy;
+  cv::Mat result;
+  cv::warpAffine(img, result, transform, img.size(), cv::INTER_LINEAR | cv::WARP_INVERSE_MAP, cv::BORDER_REFLECT);
+  return result;
+}
+
+// Stack the alignment of an image against its neighbour with the alignment
+// of the neighbour against the reference, as neighbour alignment did before
+// it was split into estimate and continuation tasks.
+static AlignmentStore::entry_t chain_entry(const AlignmentStore::entry_t &entry,
+                                           const AlignmentStore::entry_t &neighbour)
+{
+  AlignmentStore::entry_t result;
+  cv::Mat tmp = neighbour.transformation.clone();
+  tmp.resize(3, 0.0f);
+  tmp.at<float>(2, 2) = 1.0f;
+  result.transformation = entry.transformation * tmp;
+
+  const cv::Mat &c = entry.contrast;
+  const cv::Mat &n = neighbour.contrast;
+  result.contrast = c * n.at<float>(0);
+  result.contrast.at<float>(1) += n.at<float>(1) * c.at<float>(0);
+  result.contrast.at<float>(2) += n.at<float>(2) * c.at<float>(0) + n.at<float>(1) * c.at<float>(1);
+  result.contrast.at<float>(3) += n.at<float>(3) * c.at<float>(0);
+  result.contrast.at<float>(4) += n.at<float>(4) * c.at<float>(0) + n.at<float>(3) * c.at<float>(3);
+
+  result.whitebalance = entry.whitebalance.clone();
+  for (int i = 0; i < 6; i += 2)
+  {
+    result.whitebalance.at<float>(i) += neighbour.whitebalance.at<float>(i) * entry.whitebalance.at<float>(i + 1);
+    result.whitebalance.at<float>(i + 1) *= neighbour.whitebalance.at<float>(i + 1);
+  }
+  return result;
+}
+
+// Neighbour alignment split into estimate and continuation tasks must
+// give the same result as aligning against the neighbour and then
+// stacking the neighbour's alignment.
+TEST(Task_Align, ContinuationMatchesChained) {
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+
+  cv::Mat a = make_texture(256, 256);
+  cv::Mat b = warp_texture(a, 1.01f, 0.005f, 2.5f, -1.5f);
+  cv::Mat c = warp_texture(b, 1.01f, -0.003f, -1.2f, 3.1f);
+  c = c * 1.1 + 5;
+
+  std::shared_ptr<ImgTask> imgs[3];
+  std::shared_ptr<Task_Grayscale> grays[3];
+  const cv::Mat *inputs[3] = {&a, &b, &c};
+  for (int i = 0; i < 3; i++)
+  {
+    cv::Mat color;
+    cv::cvtColor(*inputs[i], color, cv::COLOR_GRAY2BGR);
+    imgs[i] = std::make_shared<ImgTask>(color);
+    imgs[i]->set_index(i);
+    grays[i] = std::make_shared<Task_Grayscale>(imgs[i], i ? grays[0] : nullptr);
+    grays[i]->run(logger);
+  }
+
+  // The images have no file names, so each result goes to its own store
+  std::shared_ptr<AlignmentStore> stores[3];
+  for (auto &store : stores) store = std::make_shared<AlignmentStore>();
+
+  // Image 1 against the reference image 0
+  std::shared_ptr<Task_Align> neighbour = std::make_shared<Task_Align>(grays[0], imgs[0], grays[1], imgs[1]);
+  neighbour->set_save_store(stores[0]);
+  neighbour->run(logger);
+
+  // Image 2 against image 1, split into estimate and continuation
+  std::shared_ptr<Task_Align> estimate = std::make_shared<Task_Align>(grays[1], imgs[1], grays[2], imgs[2]);
+  std::shared_ptr<Task_Align> continuation = std::make_shared<Task_Align>(imgs[2], estimate, neighbour);
+  continuation->set_save_store(stores[1]);
+  estimate->run(logger);
+  continuation->run(logger);
+
+  // Image 2 against image 1 in a single task, stacked afterwards
+  std::shared_ptr<Task_Align> single = std::make_shared<Task_Align>(grays[1], imgs[1], grays[2], imgs[2]);
+  single->set_save_store(stores[2]);
+  single->run(logger);
+
+  AlignmentStore::entry_t neighbour_entry, single_entry, result;
+  ASSERT_TRUE(stores[0]->get(1, neighbour_entry));
+  ASSERT_TRUE(stores[1]->get(2, result));
+  ASSERT_TRUE(stores[2]->get(2, single_entry));
+  AlignmentStore::entry_t expected = chain_entry(single_entry, neighbour_entry);
+
+  EXPECT_LT(cv::norm(result.transformation, expected.transformation, cv::NORM_INF), 1e-5);
+  EXPECT_LT(cv::norm(result.contrast, expected.contrast, cv::NORM_INF), 1e-5);
+  EXPECT_LT(cv::norm(result.whitebalance, expected.whitebalance, cv::NORM_INF), 1e-5);
+
+  // The warped image must be the same as with the chained transform applied directly
+  std::shared_ptr<Task_Align> direct = std::make_shared<Task_Align>(grays[0], imgs[0], grays[2], imgs[2]);
+  direct->set_loaded_transform(expected, true);
+  direct->run(logger);
+  cv::Mat diff;
+  cv::absdiff(continuation->img(), direct->img(), diff);
+  double maxdiff;
+  cv::minMaxLoc(diff.reshape(1), nullptr, &maxdiff);
+  EXPECT_LE(maxdiff, 1.0);
+}
+
+
+// The similarity model must find scale and rotation, and keep the
+// transform free of shear.
+TEST(Task_Align, SimilarityModel) {
+  cv::Mat ref = make_texture(256, 256);
+  cv::Mat src = warp_texture(ref, 1.02f, 0.01f, 3.5f, -2.2f);
+
+  cv::Mat expected(2, 3, CV_32F);
+  expected.at<float>(0, 0) = 1.02f * std::cos(0.01f);
+  expected.at<float>(0, 1) = -1.02f * std::sin(0.01f);
+  expected.at<float>(0, 2) = 3.5f;
+  expected.at<float>(1, 0) = 1.02f * std::sin(0.01f);
+  expected.at<float>(1, 1) = 1.02f * std::cos(0.01f);
+  expected.at<float>(1, 2) = -2.2f;
+
+  cv::Rect crop(8, 8, 240, 240);
+  cv::Mat transform = cv::Mat::eye(2, 3, CV_32F);
+  double correlation = Task_Align::find_transform_ecc(src, ref, crop, transform,
+                                                      Task_Align::MOTION_SIMILARITY, 50, 0.0001, 3);
+
+  EXPECT_GT(correlation, 0.99);
+  EXPECT_LT(corner_distance(transform, expected, ref.size()), 0.25f);
+  EXPECT_FLOAT_EQ(transform.at<float>(0, 0), transform.at<float>(1, 1));
+  EXPECT_FLOAT_EQ(transform.at<float>(0, 1), -transform.at<float>(1, 0));
+}
+
+
+// Reducing iterations on the fine level when the rough level moved the
+// image only a little must give the same result as the fixed iteration
+// limits, 25 at 256 px and 50 at full resolution.
+TEST(Task_Align, AdaptiveScheduleMatchesFixed) {
+  cv::Mat ref = make_texture(1024, 1024);
+  cv::Mat src = warp_texture(ref, 1.0f, 0.0f, 0.6f, -0.4f);
+
+  cv::Mat adaptive = run_alignment(ref, src, FocusStack::ALIGN_NO_SEED);
+
+  cv::Mat smallref, smallsrc;
+  float scale_ratio = 1.0f;
+  Task_Pyramid::downscale(ref, smallref, Task_Align::rough_resolution, scale_ratio);
+  Task_Pyramid::downscale(src, smallsrc, Task_Align::rough_resolution, scale_ratio);
+  cv::Rect full(0, 0, ref.cols, ref.rows);
+  cv::Rect small(0, 0, smallref.cols, smallref.rows);
+
+  cv::Mat fixed = cv::Mat::eye(2, 3, CV_32F);
+  Task_Align::find_transform_ecc(smallsrc, smallref, small, fixed, cv::MOTION_AFFINE, 25, 0.01, 1);
+  fixed.at<float>(0, 2) /= scale_ratio;
+  fixed.at<float>(1, 2) /= scale_ratio;
+  Task_Align::find_transform_ecc(src, ref, full, fixed, cv::MOTION_AFFINE, 50, 0.001, 3);
+
+  EXPECT_LT(corner_distance(adaptive, fixed, ref.size()), 0.02f);
+}
+
+
+// The grayscale image produced in the same pass as the aligned color
+// image must be the same as converting the aligned image afterwards.
+TEST(Task_Align, GrayOutputMatchesGrayscale) {
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+
+  cv::Mat input(120, 170, CV_8UC3);
+  cv::randu(input, 0, 256);
+  cv::GaussianBlur(input, input, cv::Size(0, 0), 2.0);
+
+  std::shared_ptr<ImgTask> ref = std::make_shared<ImgTask>(input);
+  std::shared_ptr<ImgTask> src = std::make_shared<ImgTask>(input);
+  std::shared_ptr<Task_Grayscale> refgray = std::make_shared<Task_Grayscale>(ref);
+  refgray->run(logger);
+
+  AlignmentStore::entry_t entry;
+  entry.transformation = cv::Mat::eye(2, 3, CV_32F);
+  entry.transformation.at<float>(0, 0) = 1.01f;
+  entry.transformation.at<float>(0, 1) = 0.02f;
+  entry.transformation.at<float>(0, 2) = 3.3f;
+  entry.transformation.at<float>(1, 2) = -2.7f;
+  entry.contrast = cv::Mat::zeros(5, 1, CV_32F);
+  entry.contrast.at<float>(0) = 1.1f;
+  entry.contrast.at<float>(1) = 0.05f;
+  entry.contrast.at<float>(4) = 0.1f;
+  entry.whitebalance = cv::Mat::zeros(6, 1, CV_32F);
+  entry.whitebalance.at<float>(0) = 2.0f;
+  entry.whitebalance.at<float>(1) = 0.9f;
+  entry.whitebalance.at<float>(3) = 1.0f;
+  entry.whitebalance.at<float>(4) = -3.0f;
+  entry.whitebalance.at<float>(5) = 1.1f;
+
+  // With and without the contrast and white balance correction
+  const int flag_sets[] = {FocusStack::ALIGN_DEFAULT,
+                           FocusStack::ALIGN_NO_CONTRAST | FocusStack::ALIGN_NO_WHITEBALANCE};
+  for (int flags : flag_sets)
+  {
+    std::shared_ptr<Task_Align> task = std::make_shared<Task_Align>(
+      refgray, ref, refgray, src, nullptr, (FocusStack::align_flags_t)flags);
+    task->set_loaded_transform(entry, true);
+    task->set_gray_output(refgray);
+    task->run(logger);
+
+    std::shared_ptr<ImgTask> gray = Task_Align::aligned_gray(task);
+    gray->run(logger);
+
+    Task_Grayscale expected(std::make_shared<ImgTask>(task->img()), refgray);
+    expected.run(logger);
+
+    ASSERT_EQ(gray->img().size(), expected.img().size());
+    EXPECT_EQ(cv::norm(gray->img(), expected.img(), cv::NORM_INF), 0.0);
+  }
+}
+
+}
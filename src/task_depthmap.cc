@@ -3,7 +3,11 @@
 #include "task_wavelet_templates.hh"
 #include "task_merge.hh"
 #include "histogrampercentile.hh"
+#include "simd.hh"
 #include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/core/utility.hpp>
+#include <opencv2/core/hal/hal.hpp>
 #include <stdio.h>
 
 using namespace focusstack;
@@ -11,7 +15,7 @@ using namespace focusstack;
 Task_Depthmap::Task_Depthmap(std::shared_ptr<ImgTask> input,
                 int depth, bool last,
                 std::shared_ptr<Task_Depthmap> previous,
-                bool save_steps):
+                bool save_steps, int scale):
   m_input(input), m_depth(depth), m_previous(previous)
 {
   m_filename = "depthmap.png";
@@ -20,6 +24,7 @@ Task_Depthmap::Task_Depthmap(std::shared_ptr<ImgTask> input,
   m_last = last;
   m_save_steps = save_steps;
   m_maxdepth = m_depth;
+  m_scale = std::max(1, scale);
 
   if (m_input)
     m_depends_on.push_back(m_input);
@@ -33,12 +38,39 @@ Task_Depthmap::Task_Depthmap(std::shared_ptr<ImgTask> input,
   }
 }
 
+Task_Depthmap::Task_Depthmap(const std::vector<std::shared_ptr<Task_Depthmap> > &partials,
+                bool save_steps):
+  m_depth(-1)
+{
+  if (partials.empty())
+  {
+    throw std::logic_error("Task_Depthmap: At least one partial depthmap is required!");
+  }
+
+  m_filename = "depthmap.png";
+  m_name = "Combine " + std::to_string(partials.size()) + " partial depthmaps";
+
+  m_last = true;
+  m_save_steps = save_steps;
+  m_maxdepth = m_depth;
+  m_scale = partials.at(0)->m_scale;
+
+  m_previous = partials.at(0);
+  m_partials.assign(partials.begin() + 1, partials.end());
+
+  for (std::shared_ptr<Task_Depthmap> partial : partials)
+  {
+    m_depends_on.push_back(partial);
+  }
+}
+
 void Task_Depthmap::task()
 {
   // Continue from previous layer or start afresh?
   if (m_previous)
   {
     m_valid_area = m_previous->m_valid_area;
+    m_fullsize = m_previous->m_fullsize;
     m_maxdepth = std::max(m_depth, m_previous->m_maxdepth);
     m_noiselevel = m_previous->m_noiselevel;
     m_guo = m_previous->m_guo;
@@ -46,25 +78,48 @@ void Task_Depthmap::task()
   else
   {
     assert(m_input);
-    cv::Mat input = m_input->img();
-    m_valid_area = m_input->valid_area();
+    m_fullsize = m_input->img().size();
+    m_valid_area = scaled_area(m_input->valid_area());
     m_noiselevel = 10.0f; // estimate_noise_level(input);
-    m_guo.create(input.rows, input.cols, CV_32FC(8));
+    m_guo.create((m_fullsize.height + m_scale - 1) / m_scale,
+                 (m_fullsize.width + m_scale - 1) / m_scale, CV_32FC(8));
     m_guo = 0;
   }
   m_previous.reset();
 
+  // Sum the moments of other partial depthmaps
+  for (std::shared_ptr<Task_Depthmap> partial : m_partials)
+  {
+    assert(partial->m_guo.size() == m_guo.size());
+    m_maxdepth = std::max(m_maxdepth, partial->m_maxdepth);
+    limit_valid_area(partial->m_valid_area);
+
+    const cv::Mat &guo = partial->m_guo;
+    cv::parallel_for_(cv::Range(0, m_guo.rows), [&](const cv::Range &range) {
+      cv::Mat rows = m_guo.rowRange(range);
+      rows += guo.rowRange(range);
+    });
+  }
+  m_partials.clear();
+
   // Process input image from Task_FocusMeasure
   if (m_input)
   {
-    cv::Mat input = m_input->img().clone();
-    limit_valid_area(m_input->valid_area());
-    assert(m_guo.size() == input.size());
+    const cv::Mat &input = m_input->img();
+    limit_valid_area(scaled_area(m_input->valid_area()));
 
-    cv::Mat y_nobias = input - m_noiselevel;
-    y_nobias.setTo(1, y_nobias < 1);
-
-    add_to_guo(y_nobias, m_depth);
+    if (m_scale > 1)
+    {
+      // Area averaging keeps the contribution of details smaller than the grid
+      cv::Mat reduced;
+      cv::resize(input, reduced, m_guo.size(), 0, 0, cv::INTER_AREA);
+      add_to_guo(reduced, m_depth);
+    }
+    else
+    {
+      assert(m_guo.size() == input.size());
+      add_to_guo(input, m_depth);
+    }
 
     m_input.reset();
   }
@@ -77,6 +132,16 @@ void Task_Depthmap::task()
   }
 }
 
+cv::Rect Task_Depthmap::scaled_area(const cv::Rect &area) const
+{
+  // Round inwards so that the reduced pixels are fully inside the area
+  int left = (area.x + m_scale - 1) / m_scale;
+  int top = (area.y + m_scale - 1) / m_scale;
+  int right = (area.x + area.width) / m_scale;
+  int bottom = (area.y + area.height) / m_scale;
+  return cv::Rect(left, top, right - left, bottom - top);
+}
+
 float Task_Depthmap::estimate_noise_level(const cv::Mat &data)
 {
   HistogramPercentile hist(data, 1024);
@@ -85,32 +150,100 @@ float Task_Depthmap::estimate_noise_level(const cv::Mat &data)
   return noisefloor;
 }
 
-void Task_Depthmap::add_to_guo(const cv::Mat &y_values, float x)
+void Task_Depthmap::add_to_guo(const cv::Mat &input, float x)
 {
-  cv::Mat y_log;
-  cv::log(y_values, y_log);
+  // Powers of x are the same for the whole image
+  float x2 = x * x;
+  float x3 = x2 * x;
+  float x4 = x3 * x;
+  float noiselevel = m_noiselevel;
 
   // Refer to "A Simple Algorithm for Fitting a Gaussian Function" by Hongwei Guo:
   // https://www.researchgate.net/publication/252062037_A_Simple_Algorithm_for_Fitting_a_Gaussian_Function_DSP_Tips_and_Tricks
-  for (int yi = 0; yi < m_guo.rows; yi++)
-  {
-    for (int xi = 0; xi < m_guo.cols; xi++)
+#if CV_SIMD
+  const int step = simd::lanes<float>();
+  cv::v_float32 vnoise = cv::vx_setall_f32(noiselevel);
+  cv::v_float32 vone = cv::vx_setall_f32(1.0f);
+
+  // Multipliers for the pairs of sums in each channel, see below
+  cv::v_float32 k0, k1, k2, k3, unused;
+  cv::v_zip(vone, cv::vx_setall_f32(x4), k0, unused);
+  cv::v_zip(cv::vx_setall_f32(x), vone, k1, unused);
+  cv::v_zip(cv::vx_setall_f32(x2), cv::vx_setall_f32(x), k2, unused);
+  cv::v_zip(cv::vx_setall_f32(x3), cv::vx_setall_f32(x2), k3, unused);
+#endif
+
+  cv::parallel_for_(cv::Range(0, m_guo.rows), [&](const cv::Range &range) {
+    std::vector<float> buf(m_guo.cols * 2);
+    float *y_values = buf.data();
+    float *y_log = y_values + m_guo.cols;
+
+    for (int yi = range.start; yi < range.end; yi++)
     {
-      float y = y_values.at<float>(yi, xi);
-      float y2 = y * y;
-      float lny = y_log.at<float>(yi, xi);
-      cv::Vec<float, 8> &guo = m_guo.at<cv::Vec<float, 8> >(yi, xi);
-
-      guo[0] += y2;
-      guo[1] += x * y2;
-      guo[2] += x * x * y2;
-      guo[3] += x * x * x * y2;
-      guo[4] += x * x * x * x * y2;
-      guo[5] += y2 * lny;
-      guo[6] += (x * y2) * lny;
-      guo[7] += (x * x * y2) * lny;
+      // Subtract the noise level, limiting values to at least 1 so that the logarithm is positive
+      const float *src = input.ptr<float>(yi);
+      int xi = 0;
+#if CV_SIMD
+      for (; xi <= m_guo.cols - step; xi += step)
+      {
+        cv::v_float32 v = simd::v_sub(cv::vx_load(src + xi), vnoise);
+        cv::v_store(y_values + xi, cv::v_max(v, vone));
+      }
+#endif
+      for (; xi < m_guo.cols; xi++)
+      {
+        y_values[xi] = std::max(1.0f, src[xi] - noiselevel);
+      }
+
+      cv::hal::log32f(y_values, y_log, m_guo.cols);
+
+      float *guo = m_guo.ptr<float>(yi);
+      xi = 0;
+#if CV_SIMD
+      // The sums are interleaved 8 per pixel. Loading them as 4 channels
+      // gives pairs of sums alternating between consecutive pixels, for
+      // example g[1] and g[5] in the second channel. These are updated from
+      // the zipped y² and y² ln y values of each pixel.
+      for (; xi <= m_guo.cols - step; xi += step)
+      {
+        cv::v_float32 y = cv::vx_load(y_values + xi);
+        cv::v_float32 y2 = simd::v_mul(y, y);
+        cv::v_float32 y2lny = simd::v_mul(y2, cv::vx_load(y_log + xi));
+
+        cv::v_float32 yy[2], yl[2];
+        cv::v_zip(y2, y2, yy[0], yy[1]);
+        cv::v_zip(y2, y2lny, yl[0], yl[1]);
+
+        for (int h = 0; h < 2; h++)
+        {
+          float *g = guo + (xi + h * step / 2) * 8;
+          cv::v_float32 g0, g1, g2, g3;
+          cv::v_load_deinterleave(g, g0, g1, g2, g3);
+          g0 = simd::v_add(g0, simd::v_mul(yy[h], k0));
+          g1 = simd::v_add(g1, simd::v_mul(yl[h], k1));
+          g2 = simd::v_add(g2, simd::v_mul(yl[h], k2));
+          g3 = simd::v_add(g3, simd::v_mul(yl[h], k3));
+          cv::v_store_interleave(g, g0, g1, g2, g3);
+        }
+      }
+#endif
+      for (; xi < m_guo.cols; xi++)
+      {
+        float y2 = y_values[xi] * y_values[xi];
+        float y2lny = y2 * y_log[xi];
+        float *g = guo + xi * 8;
+
+        g[0] += y2;
+        g[1] += x * y2;
+        g[2] += x2 * y2;
+        g[3] += x3 * y2;
+        g[4] += x4 * y2;
+        g[5] += y2lny;
+        g[6] += x * y2lny;
+        g[7] += x2 * y2lny;
+      }
     }
-  }
+  });
 }
 
 cv::Mat Task_Depthmap::mask(int halo_radius) const
@@ -134,13 +267,121 @@ cv::Mat Task_Depthmap::mask(int halo_radius) const
   return mask;
 }
 
-void Task_Depthmap::compute_result()
+void Task_Depthmap::solve_gaussian(const cv::Vec<float, 8> *guo, int count, float *a, float *b, float *c)
+{
+  // The matrix is symmetric, so the solution is computed from the six
+  // unique cofactors by Cramer's rule. The products of the x⁴ sums exceed
+  // float range, so the computation is done in double precision.
+  int i = 0;
+
+#if CV_SIMD_64F
+  // The sums are stored interleaved per pixel. Blocks of pixels are first
+  // transposed to one array per sum, so that each sum loads as a vector.
+  const int step = simd::lanes<float>();
+  const int block = 64;
+  float sums[8][block];
+  cv::v_float64 zero = cv::vx_setzero_f64();
+  cv::v_float64 one = cv::vx_setall_f64(1.0);
+
+  while (i <= count - step)
+  {
+    int n = std::min(block, (count - i) / step * step);
+    for (int j = 0; j < n; j++)
+    {
+      for (int k = 0; k < 8; k++)
+      {
+        sums[k][j] = guo[i + j][k];
+      }
+    }
+
+    for (int j = 0; j < n; j += step)
+    {
+      cv::v_float64 r[3][2];
+      for (int h = 0; h < 2; h++)
+      {
+        cv::v_float64 s[8];
+        for (int k = 0; k < 8; k++)
+        {
+          cv::v_float32 v = cv::vx_load(sums[k] + j);
+          s[k] = h ? cv::v_cvt_f64_high(v) : cv::v_cvt_f64(v);
+        }
+
+        cv::v_float64 m00 = simd::v_sub(simd::v_mul(s[2], s[4]), simd::v_mul(s[3], s[3]));
+        cv::v_float64 m01 = simd::v_sub(simd::v_mul(s[2], s[3]), simd::v_mul(s[1], s[4]));
+        cv::v_float64 m02 = simd::v_sub(simd::v_mul(s[1], s[3]), simd::v_mul(s[2], s[2]));
+        cv::v_float64 m11 = simd::v_sub(simd::v_mul(s[0], s[4]), simd::v_mul(s[2], s[2]));
+        cv::v_float64 m12 = simd::v_sub(simd::v_mul(s[1], s[2]), simd::v_mul(s[0], s[3]));
+        cv::v_float64 m22 = simd::v_sub(simd::v_mul(s[0], s[2]), simd::v_mul(s[1], s[1]));
+        cv::v_float64 det = simd::v_add(simd::v_add(simd::v_mul(s[0], m00), simd::v_mul(s[1], m01)),
+                                        simd::v_mul(s[2], m02));
+
+        cv::v_float64 inv = cv::v_select(simd::v_ne(det, zero), simd::v_div(one, det), zero);
+        cv::v_float64 va = simd::v_add(simd::v_add(simd::v_mul(m00, s[5]), simd::v_mul(m01, s[6])), simd::v_mul(m02, s[7]));
+        cv::v_float64 vb = simd::v_add(simd::v_add(simd::v_mul(m01, s[5]), simd::v_mul(m11, s[6])), simd::v_mul(m12, s[7]));
+        cv::v_float64 vc = simd::v_add(simd::v_add(simd::v_mul(m02, s[5]), simd::v_mul(m12, s[6])), simd::v_mul(m22, s[7]));
+        r[0][h] = simd::v_mul(va, inv);
+        r[1][h] = simd::v_mul(vb, inv);
+        r[2][h] = simd::v_mul(vc, inv);
+      }
+
+      cv::v_store(a + i + j, cv::v_cvt_f32(r[0][0], r[0][1]));
+      cv::v_store(b + i + j, cv::v_cvt_f32(r[1][0], r[1][1]));
+      cv::v_store(c + i + j, cv::v_cvt_f32(r[2][0], r[2][1]));
+    }
+
+    i += n;
+  }
+#endif
+
+  for (; i < count; i++)
+  {
+    double s0 = guo[i][0], s1 = guo[i][1], s2 = guo[i][2], s3 = guo[i][3], s4 = guo[i][4];
+    double b0 = guo[i][5], b1 = guo[i][6], b2 = guo[i][7];
+
+    double m00 = s2 * s4 - s3 * s3;
+    double m01 = s2 * s3 - s1 * s4;
+    double m02 = s1 * s3 - s2 * s2;
+    double m11 = s0 * s4 - s2 * s2;
+    double m12 = s1 * s2 - s0 * s3;
+    double m22 = s0 * s2 - s1 * s1;
+    double det = s0 * m00 + s1 * m01 + s2 * m02;
+
+    // Singular matrix gives c = 0, which is rejected as invalid fit
+    double inv = (det != 0) ? 1.0 / det : 0.0;
+    a[i] = (float)((m00 * b0 + m01 * b1 + m02 * b2) * inv);
+    b[i] = (float)((m01 * b0 + m11 * b1 + m12 * b2) * inv);
+    c[i] = (float)((m02 * b0 + m12 * b1 + m22 * b2) * inv);
+  }
+}
+
+void Task_Depthmap::solve_gaussian_qr(const cv::Vec<float, 8> *guo, int count, float *a, float *b, float *c)
 {
   // For each pixel we solve equation of form A * C = B
   cv::Mat A(3, 3, CV_32FC1);
   cv::Mat B(3, 1, CV_32FC1);
   cv::Mat C(3, 1, CV_32FC1);
 
+  for (int i = 0; i < count; i++)
+  {
+    A.at<float>(0, 0) = guo[i][0];
+    A.at<float>(0, 1) = A.at<float>(1, 0) = guo[i][1];
+    A.at<float>(0, 2) = A.at<float>(1, 1) = A.at<float>(2, 0) = guo[i][2];
+    A.at<float>(2, 1) = A.at<float>(1, 2) = guo[i][3];
+    A.at<float>(2, 2) = guo[i][4];
+    B.at<float>(0, 0) = guo[i][5];
+    B.at<float>(1, 0) = guo[i][6];
+    B.at<float>(2, 0) = guo[i][7];
+
+    cv::solve(A, B, C, cv::DECOMP_QR);
+
+    a[i] = C.at<float>(0, 0);
+    b[i] = C.at<float>(1, 0);
+    c[i] = C.at<float>(2, 0);
+  }
+}
+
+void Task_Depthmap::compute_result()
+{
   // Scale results to 1-255, level 0 is left for unknown depth.
   float scaler, offset;
   if (m_maxdepth < 254)
@@ -158,46 +399,47 @@ void Task_Depthmap::compute_result()
   m_gauss_dev.create(m_guo.rows, m_guo.cols, CV_32FC1);
   m_gauss_amp.create(m_guo.rows, m_guo.cols, CV_32FC1);
 
-  for (int yi = 0; yi < m_guo.rows; yi++)
-  {
-    for (int xi = 0; xi < m_guo.cols; xi++)
+  cv::parallel_for_(cv::Range(0, m_guo.rows), [&](const cv::Range &range) {
+    std::vector<float> coeffs(m_guo.cols * 3);
+    float *pa = coeffs.data();
+    float *pb = pa + m_guo.cols;
+    float *pc = pb + m_guo.cols;
+
+    for (int yi = range.start; yi < range.end; yi++)
     {
-      cv::Vec<float, 8> &guo = m_guo.at<cv::Vec<float, 8> >(yi, xi);
-      A.at<float>(0, 0) = guo[0];
-      A.at<float>(0, 1) = A.at<float>(1, 0) = guo[1];
-      A.at<float>(0, 2) = A.at<float>(1, 1) = A.at<float>(2, 0) = guo[2];
-      A.at<float>(2, 1) = A.at<float>(1, 2) = guo[3];
-      A.at<float>(2, 2) = guo[4];
-      B.at<float>(0, 0) = guo[5];
-      B.at<float>(1, 0) = guo[6];
-      B.at<float>(2, 0) = guo[7];
-
-      cv::solve(A, B, C, cv::DECOMP_QR);
-
-      // Compute gaussian parameters
-      // Equations (5) to (7)
-      float a = C.at<float>(0, 0);
-      float b = C.at<float>(1, 0);
-      float c = C.at<float>(2, 0);
-      float mean = -b / (2 * c);
-      float dev = sqrtf(-1 / (2 * c));
-      float amp = expf(a - (b * b) / (4 * c));
-
-      // c should always be negative for valid gaussians.
-      if (c < -0.00001f && mean >= 0 && mean <= m_maxdepth)
-      {
-        m_gauss_mean.at<float>(yi, xi) = mean * scaler + offset;
-        m_gauss_dev.at<float>(yi, xi) = dev * scaler;
-        m_gauss_amp.at<float>(yi, xi) = amp;
-      }
-      else
+      solve_gaussian(m_guo.ptr<cv::Vec<float, 8> >(yi), m_guo.cols, pa, pb, pc);
+
+      float *gauss_mean = m_gauss_mean.ptr<float>(yi);
+      float *gauss_dev = m_gauss_dev.ptr<float>(yi);
+      float *gauss_amp = m_gauss_amp.ptr<float>(yi);
+
+      for (int xi = 0; xi < m_guo.cols; xi++)
       {
-        m_gauss_mean.at<float>(yi, xi) = 0;
-        m_gauss_dev.at<float>(yi, xi) = 255;
-        m_gauss_amp.at<float>(yi, xi) = 0;
+        // Compute gaussian parameters
+        // Equations (5) to (7)
+        float a = pa[xi];
+        float b = pb[xi];
+        float c = pc[xi];
+        float mean = -b / (2 * c);
+        float dev = sqrtf(-1 / (2 * c));
+        float amp = expf(a - (b * b) / (4 * c));
+
+        // c should always be negative for valid gaussians.
+        if (c < -0.00001f && mean >= 0 && mean <= m_maxdepth)
+        {
+          gauss_mean[xi] = mean * scaler + offset;
+          gauss_dev[xi] = dev * scaler;
+          gauss_amp[xi] = amp;
+        }
+        else
+        {
+          gauss_mean[xi] = 0;
+          gauss_dev[xi] = 255;
+          gauss_amp[xi] = 0;
+        }
       }
     }
-  }
+  });
 
   m_gauss_mean.convertTo(m_result, CV_8UC1);
   
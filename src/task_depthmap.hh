@@ -9,30 +9,52 @@ namespace focusstack {
 // This task works incrementally, updating the depthmap array for each new image.
 // The focus measure for each layer is compared against its neighbours.
 // If the current layer has the best focus, the depthmap value is set to depth.
+// With scale > 1, the focus measures are accumulated on a grid reduced by that
+// factor, and the resulting depthmap is at the reduced resolution.
+// Layers can be split between several independent chains of tasks, which are
+// then summed together by a final task constructed from the list of partials.
 class Task_Depthmap: public ImgTask
 {
 public:
   Task_Depthmap(std::shared_ptr<ImgTask> input,
                 int depth, bool last,
                 std::shared_ptr<Task_Depthmap> previous = nullptr,
+                bool save_steps = false, int scale = 1);
+
+  // Combine partial depthmaps that have accumulated different layers and compute the result
+  Task_Depthmap(const std::vector<std::shared_ptr<Task_Depthmap> > &partials,
                 bool save_steps = false);
 
   const cv::Mat &depthmap() const { return m_result; }
 
   int maxdepth() const { return m_maxdepth; }
 
+  // Downsampling factor of the depthmap and the size of the input images
+  int scale() const { return m_scale; }
+  cv::Size fullsize() const { return m_fullsize; }
+
   // Form a rough mask of known depth values.
   // Halo radius is the blur distance for eliminating halo artefacts around high contrast edges.
   cv::Mat mask(int halo_radius) const;
 
+  // Solve the Gaussian coefficients ln y = a + b x + c x² from the m_guo
+  // sums of count pixels. solve_gaussian() uses a closed-form solution,
+  // solve_gaussian_qr() is the slower reference implementation.
+  static void solve_gaussian(const cv::Vec<float, 8> *guo, int count, float *a, float *b, float *c);
+  static void solve_gaussian_qr(const cv::Vec<float, 8> *guo, int count, float *a, float *b, float *c);
+
 private:
   virtual void task();
 
+  // Convert an area in input image coordinates to the reduced grid
+  cv::Rect scaled_area(const cv::Rect &area) const;
+
   // Estimate the background noise level (camera noise level)
   float estimate_noise_level(const cv::Mat &data);
 
   // Add one depth level to m_guo estimation matrix.
-  void add_to_guo(const cv::Mat &y_values, float x);
+  // Noise level is subtracted from the input focus measure in the same pass.
+  void add_to_guo(const cv::Mat &input, float x);
 
   // Compute the final fitted Gaussian function for each pixel
   void compute_result();
@@ -62,8 +84,11 @@ private:
   std::shared_ptr<ImgTask> m_input;
   int m_depth;
   std::shared_ptr<Task_Depthmap> m_previous;
+  std::vector<std::shared_ptr<Task_Depthmap> > m_partials;
   bool m_last;
   bool m_save_steps;
+  int m_scale;
+  cv::Size m_fullsize;
 };
 
 }
@@ -7,11 +7,13 @@
 using namespace focusstack;
 
 Task_Depthmap_Inpaint::Task_Depthmap_Inpaint(std::shared_ptr<Task_Depthmap> depthmap,
-    int threshold, int smooth_xy, int smooth_z, int halo_radius, bool save_steps):
+    int threshold, int smooth_xy, int smooth_z, int halo_radius, bool save_steps,
+    std::shared_ptr<ImgTask> guide):
   m_depthmap(depthmap), m_threshold(threshold),
   m_smooth_xy(smooth_xy), m_smooth_z(smooth_z),
   m_halo_radius(halo_radius),
-  m_save_steps(save_steps)
+  m_save_steps(save_steps),
+  m_guide(guide)
 {
   m_filename = "filtered_depthmap.png";
   m_name = "Inpaint depthmap";
@@ -19,6 +21,9 @@ Task_Depthmap_Inpaint::Task_Depthmap_Inpaint(std::shared_ptr<Task_Depthmap> dept
   if (m_threshold < 1) m_threshold = 1;
 
   m_depends_on.push_back(m_depthmap);
+
+  if (m_guide)
+    m_depends_on.push_back(m_guide);
 }
 
 static void masked_blur(const cv::Mat &input, cv::Mat &output, const cv::Mat &mask, int radius)
@@ -39,12 +44,73 @@ static void masked_blur(const cv::Mat &input, cv::Mat &output, const cv::Mat &ma
   in_masked.convertTo(output, input.type());
 }
 
+cv::Mat Task_Depthmap_Inpaint::guided_upsample(const cv::Mat &depth, const cv::Mat &guide)
+{
+  // Fast guided filter: the local linear model depth = a * guide + b is
+  // solved at the depthmap resolution, and only the coefficients are upsampled.
+  // The window is given in depthmap pixels, so that it always covers both
+  // sides of an edge regardless of the scale factor.
+  const int radius = 2;
+  cv::Size ksize(radius * 2 + 1, radius * 2 + 1);
+
+  cv::Mat guide_full, guide_lowres, p;
+  guide.convertTo(guide_full, CV_32F);
+  cv::resize(guide_full, guide_lowres, depth.size(), 0, 0, cv::INTER_AREA);
+  depth.convertTo(p, CV_32F);
+
+  // Regularization is relative to the overall contrast of the guide image,
+  // which decreases with the amount of averaging in the downscaling.
+  cv::Scalar mean, stddev;
+  cv::meanStdDev(guide_lowres, mean, stddev);
+  float eps = 0.01f * stddev[0] * stddev[0] + 1.0f;
+
+  cv::Mat mean_i, mean_p, corr_ii, corr_ip;
+  cv::boxFilter(guide_lowres, mean_i, CV_32F, ksize);
+  cv::boxFilter(p, mean_p, CV_32F, ksize);
+  cv::boxFilter(guide_lowres.mul(guide_lowres), corr_ii, CV_32F, ksize);
+  cv::boxFilter(guide_lowres.mul(p), corr_ip, CV_32F, ksize);
+
+  cv::Mat var_i = corr_ii - mean_i.mul(mean_i);
+  cv::Mat cov_ip = corr_ip - mean_i.mul(mean_p);
+  cv::Mat a = cov_ip / (var_i + eps);
+  cv::Mat b = mean_p - a.mul(mean_i);
+  cv::boxFilter(a, a, CV_32F, ksize);
+  cv::boxFilter(b, b, CV_32F, ksize);
+
+  cv::resize(a, a, guide.size(), 0, 0, cv::INTER_LINEAR);
+  cv::resize(b, b, guide.size(), 0, 0, cv::INTER_LINEAR);
+
+  // The guide texture finer than the depthmap grid is not part of the
+  // linear model. Limit the result to the range of the neighbouring depth
+  // values, so that the texture doesn't appear in smooth depth regions.
+  cv::Mat minlimit, maxlimit;
+  cv::Mat kernel = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(3, 3));
+  cv::erode(p, minlimit, kernel);
+  cv::dilate(p, maxlimit, kernel);
+  cv::resize(minlimit, minlimit, guide.size(), 0, 0, cv::INTER_LINEAR);
+  cv::resize(maxlimit, maxlimit, guide.size(), 0, 0, cv::INTER_LINEAR);
+
+  cv::Mat upsampled = a.mul(guide_full) + b;
+  cv::max(upsampled, minlimit, upsampled);
+  cv::min(upsampled, maxlimit, upsampled);
+
+  cv::Mat result;
+  upsampled.convertTo(result, CV_8U);
+  return result;
+}
+
 void Task_Depthmap_Inpaint::task()
 {
+  // Distances are given at full resolution
+  int scale = m_depthmap->scale();
+  cv::Size fullsize = m_depthmap->fullsize();
+  int halo_radius = m_halo_radius / scale;
+  int smooth_xy = m_smooth_xy / scale;
+
   int max_depth = m_depthmap->maxdepth();
   cv::Mat depth = m_depthmap->depthmap().clone();
-  cv::Mat mask = m_depthmap->mask(m_halo_radius * 2);
-  cv::Mat mask_nh = m_depthmap->mask(m_halo_radius / 2);
+  cv::Mat mask = m_depthmap->mask(halo_radius * 2);
+  cv::Mat mask_nh = m_depthmap->mask(halo_radius / 2);
   m_valid_area = m_depthmap->valid_area();
   m_depthmap.reset();
 
@@ -56,7 +122,7 @@ void Task_Depthmap_Inpaint::task()
 
   // Make an initial low resolution depthmap
   cv::Mat depth_lowres;
-  const int lowres_blur = 16;
+  const int lowres_blur = std::max(1, 16 / scale);
   masked_blur(depth, depth_lowres, mask > m_threshold, lowres_blur);
   cv::resize(depth_lowres, depth_lowres, cv::Size(), 0.25f, 0.25f, cv::INTER_NEAREST);
 
@@ -90,7 +156,12 @@ void Task_Depthmap_Inpaint::task()
     cv::imwrite("depth_inpaint_masked.png", depth);
   }
 
-  masked_blur(depth, depth, depth > 0, 2);
+  // At reduced resolution the downscaling has already averaged over the blur radius
+  int point_blur = 2 / scale;
+  if (point_blur > 0)
+  {
+    masked_blur(depth, depth, depth > 0, point_blur);
+  }
 
   if (m_save_steps)
   {
@@ -118,17 +189,37 @@ void Task_Depthmap_Inpaint::task()
   m_result = depth;
   if (m_smooth_xy > 0)
   {
-    int medsize = 2 * (m_smooth_xy / 8) + 3;
+    int medsize = 2 * (smooth_xy / 8) + 3;
     cv::medianBlur(m_result, m_result, medsize);
 
-    // Bilateral filter gets very slow if smoothing parameters are too small
+    // Bilateral filter gets very slow if smoothing parameters are too small.
+    // The bilateral grid size only depends on the ratio of image size and
+    // smooth_xy, so the limit applies to the full resolution value.
     if (m_smooth_xy >= 8 && m_smooth_z > 4)
     {
       cv::Mat tmp;
-      cv_extend::bilateralFilter(m_result, tmp, m_smooth_z, m_smooth_xy);
+      cv_extend::bilateralFilter(m_result, tmp, m_smooth_z, std::max(1, smooth_xy));
       m_result = tmp;
     }
 
     cv::medianBlur(m_result, m_result, medsize);
   }
+
+  if (scale > 1)
+  {
+    if (m_guide && m_guide->img().size() == fullsize)
+    {
+      m_result = guided_upsample(m_result, m_guide->img());
+    }
+    else
+    {
+      cv::resize(m_result, m_result, fullsize, 0, 0, cv::INTER_LINEAR);
+    }
+
+    m_valid_area = cv::Rect(m_valid_area.x * scale, m_valid_area.y * scale,
+                            m_valid_area.width * scale, m_valid_area.height * scale)
+                   & cv::Rect(cv::Point(0, 0), fullsize);
+  }
+
+  m_guide.reset();
 }
\ No newline at end of file
@@ -1,5 +1,7 @@
 // Interpolate areas of depthmap that couldn't be estimated from the focus data.
 // This uses both the partial depthmap data and the merged grayscale image data.
+// A reduced resolution depthmap is inpainted at that resolution and then
+// upsampled to full size, following the edges of the guide image.
 
 #pragma once
 #include "worker.hh"
@@ -12,7 +14,12 @@ class Task_Depthmap_Inpaint: public ImgTask
 public:
   Task_Depthmap_Inpaint(std::shared_ptr<Task_Depthmap> depthmap,
     int threshold = 16, int smooth_xy = 32, int smooth_z = 64, int halo_radius = 30,
-    bool save_steps = false);
+    bool save_steps = false, std::shared_ptr<ImgTask> guide = nullptr);
+
+  // Upsample depthmap to the size of the grayscale guide image with a guided filter.
+  // Edges in the result follow the guide, but the values stay within the range
+  // of the neighbouring depthmap pixels.
+  static cv::Mat guided_upsample(const cv::Mat &depth, const cv::Mat &guide);
 
 private:
   virtual void task();
@@ -23,6 +30,7 @@ private:
   int m_smooth_z;
   int m_halo_radius;
   bool m_save_steps;
+  std::shared_ptr<ImgTask> m_guide;
 };
 
 
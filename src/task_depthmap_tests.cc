@@ -0,0 +1,216 @@
+#include <gtest/gtest.h>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <opencv2/imgproc.hpp>
+#include "task_depthmap.hh"
+#include "task_depthmap_inpaint.hh"
+#include "logger.hh"
+
+namespace focusstack {
+
+// Accumulate m_guo sums for a Gaussian focus curve
+static cv::Vec<float, 8> guo_sums(int depths, float mean, float dev, float amp)
+{
+  cv::Vec<float, 8> guo = 0;
+  for (int i = 0; i < depths; i++)
+  {
+    float x = i;
+    float y = std::max(1.0f, amp * std::exp(-(x - mean) * (x - mean) / (2 * dev * dev)));
+    float y2 = y * y;
+    float lny = std::log(y);
+    guo[0] += y2;
+    guo[1] += x * y2;
+    guo[2] += x * x * y2;
+    guo[3] += x * x * x * y2;
+    guo[4] += x * x * x * x * y2;
+    guo[5] += y2 * lny;
+    guo[6] += (x * y2) * lny;
+    guo[7] += (x * x * y2) * lny;
+  }
+  return guo;
+}
+
+static std::vector<cv::Vec<float, 8> > random_sums(int count, int depths)
+{
+  cv::RNG rng(1234);
+  std::vector<cv::Vec<float, 8> > result;
+  for (int i = 0; i < count; i++)
+  {
+    result.push_back(guo_sums(depths, rng.uniform(0.0f, (float)(depths - 1)),
+                              rng.uniform(0.7f, 3.0f), rng.uniform(20.0f, 200.0f)));
+  }
+  return result;
+}
+
+// Closed-form solution should match the QR decomposition on shallow stacks.
+// On deep stacks the single precision QR loses accuracy.
+TEST(Task_Depthmap, SolveMatchesQR) {
+  int count = 1000;
+  std::vector<cv::Vec<float, 8> > guo = random_sums(count, 5);
+  std::vector<float> a1(count), b1(count), c1(count);
+  std::vector<float> a2(count), b2(count), c2(count);
+
+  Task_Depthmap::solve_gaussian(guo.data(), count, a1.data(), b1.data(), c1.data());
+  Task_Depthmap::solve_gaussian_qr(guo.data(), count, a2.data(), b2.data(), c2.data());
+
+  for (int i = 0; i < count; i++)
+  {
+    ASSERT_EQ(c1[i] < -0.00001f, c2[i] < -0.00001f);
+    if (c1[i] < -0.00001f)
+    {
+      ASSERT_NEAR(-b1[i] / (2 * c1[i]), -b2[i] / (2 * c2[i]), 0.25f);
+    }
+  }
+}
+
+// Noiseless Gaussian curve should be recovered exactly, also on deep stacks.
+TEST(Task_Depthmap, SolveExact) {
+  cv::Vec<float, 8> guo = guo_sums(31, 12.3f, 10.0f, 200.0f);
+  float a, b, c;
+  Task_Depthmap::solve_gaussian(&guo, 1, &a, &b, &c);
+
+  ASSERT_NEAR(-b / (2 * c), 12.3f, 0.01f);
+  ASSERT_NEAR(std::sqrt(-1 / (2 * c)), 10.0f, 0.01f);
+  ASSERT_NEAR(std::exp(a - b * b / (4 * c)), 200.0f, 0.5f);
+}
+
+// Depth of a Gaussian focus curve over the layers, with the noise level added
+TEST(Task_Depthmap, GaussianDepth) {
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+  std::shared_ptr<Task_Depthmap> depthmap;
+  int layers = 7;
+
+  for (int i = 0; i < layers; i++)
+  {
+    cv::Mat focus(8, 8, CV_32F);
+    focus = 10.0f + 100.0f * std::exp(-(i - 2.5f) * (i - 2.5f) / (2 * 1.5f * 1.5f));
+
+    depthmap = std::make_shared<Task_Depthmap>(std::make_shared<ImgTask>(focus), i, i == layers - 1, depthmap);
+    depthmap->run(logger);
+  }
+
+  // Depth 2.5 of 0..6 is scaled to the middle of 8-bit range
+  float expected = 255.0f / layers * 3.5f;
+  ASSERT_NEAR(depthmap->depthmap().at<uint8_t>(4, 4), expected, 1.5f);
+}
+
+// Accumulation on a reduced grid gives the same depth at reduced size
+TEST(Task_Depthmap, ScaledDepth) {
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+  std::shared_ptr<Task_Depthmap> depthmap;
+  int layers = 7;
+
+  for (int i = 0; i < layers; i++)
+  {
+    cv::Mat focus(9, 17, CV_32F);
+    focus = 10.0f + 100.0f * std::exp(-(i - 2.5f) * (i - 2.5f) / (2 * 1.5f * 1.5f));
+
+    depthmap = std::make_shared<Task_Depthmap>(std::make_shared<ImgTask>(focus), i, i == layers - 1, depthmap, false, 4);
+    depthmap->run(logger);
+  }
+
+  ASSERT_EQ(depthmap->depthmap().size(), cv::Size(5, 3));
+  ASSERT_EQ(depthmap->fullsize(), cv::Size(17, 9));
+
+  float expected = 255.0f / layers * 3.5f;
+  ASSERT_NEAR(depthmap->depthmap().at<uint8_t>(1, 2), expected, 1.5f);
+}
+
+// Summing partial accumulators gives the same result as a single chain
+TEST(Task_Depthmap, PartialAccumulators) {
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+  std::vector<std::shared_ptr<Task_Depthmap> > partials(3);
+  std::shared_ptr<Task_Depthmap> single;
+  int layers = 10;
+
+  for (int i = 0; i < layers; i++)
+  {
+    // Focus peak depth varies along the x axis
+    cv::Mat focus(16, 16, CV_32F);
+    for (int y = 0; y < focus.rows; y++)
+    {
+      for (int x = 0; x < focus.cols; x++)
+      {
+        float mean = 1.0f + x * 0.5f;
+        focus.at<float>(y, x) = 10.0f + (50.0f + y * 10.0f) * std::exp(-(i - mean) * (i - mean) / 4.5f);
+      }
+    }
+    std::shared_ptr<ImgTask> input = std::make_shared<ImgTask>(focus);
+
+    std::shared_ptr<Task_Depthmap> &partial = partials.at(i % partials.size());
+    partial = std::make_shared<Task_Depthmap>(input, i, false, partial);
+    partial->run(logger);
+
+    single = std::make_shared<Task_Depthmap>(input, i, i == layers - 1, single);
+    single->run(logger);
+  }
+
+  std::shared_ptr<Task_Depthmap> combined = std::make_shared<Task_Depthmap>(partials);
+  combined->run(logger);
+
+  ASSERT_EQ(combined->maxdepth(), layers - 1);
+
+  cv::Mat diff;
+  cv::absdiff(combined->depthmap(), single->depthmap(), diff);
+  double maxdiff;
+  cv::minMaxLoc(diff, nullptr, &maxdiff);
+  ASSERT_LE(maxdiff, 1.0);
+}
+
+// Upsampling keeps a depth step at the position of the edge in the guide,
+// also when the edge is not aligned to the reduced grid.
+TEST(Task_Depthmap_Inpaint, GuidedUpsampleEdge) {
+  int size = 64, scale = 4, edge = 29;
+  cv::Mat guide(size, size, CV_8U, cv::Scalar(50));
+  cv::Mat depth(size, size, CV_8U, cv::Scalar(40));
+  guide.colRange(edge, size).setTo(200);
+  depth.colRange(edge, size).setTo(160);
+
+  cv::Mat depth_lowres;
+  cv::resize(depth, depth_lowres, cv::Size(size / scale, size / scale), 0, 0, cv::INTER_AREA);
+
+  cv::Mat result = Task_Depthmap_Inpaint::guided_upsample(depth_lowres, guide);
+  ASSERT_EQ(result.size(), guide.size());
+
+  for (int y = 0; y < size; y++)
+  {
+    for (int x = 0; x < size; x++)
+    {
+      ASSERT_NEAR(result.at<uint8_t>(y, x), depth.at<uint8_t>(y, x), 5) << "at " << x << ", " << y;
+    }
+  }
+}
+
+// Texture in the guide doesn't appear in a constant depth region
+TEST(Task_Depthmap_Inpaint, GuidedUpsampleSmooth) {
+  cv::Mat guide(64, 64, CV_8U);
+  cv::randu(guide, 0, 256);
+
+  cv::Mat depth(16, 16, CV_8U, cv::Scalar(100));
+  cv::Mat result = Task_Depthmap_Inpaint::guided_upsample(depth, guide);
+
+  double minval, maxval;
+  cv::minMaxLoc(result, &minval, &maxval);
+  ASSERT_EQ(minval, 100);
+  ASSERT_EQ(maxval, 100);
+}
+
+// Reports the speed of the closed-form solution compared to QR
+TEST(Task_Depthmap, DISABLED_SolveBenchmark) {
+  int count = 256 * 256;
+  std::vector<cv::Vec<float, 8> > guo = random_sums(count, 16);
+  std::vector<float> a(count), b(count), c(count);
+
+  auto t0 = std::chrono::steady_clock::now();
+  Task_Depthmap::solve_gaussian_qr(guo.data(), count, a.data(), b.data(), c.data());
+  auto t1 = std::chrono::steady_clock::now();
+  Task_Depthmap::solve_gaussian(guo.data(), count, a.data(), b.data(), c.data());
+  auto t2 = std::chrono::steady_clock::now();
+
+  double qr_ms = std::chrono::duration<double, std::milli>(t1 - t0).count();
+  double closed_ms = std::chrono::duration<double, std::milli>(t2 - t1).count();
+  printf("Gaussian fit for %d pixels: QR %0.2f ms, closed-form %0.2f ms\n", count, qr_ms, closed_ms);
+}
+
+}
@@ -1,5 +1,8 @@
 #include "task_grayscale.hh"
+#include "simd.hh"
 #include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/core/utility.hpp>
+#include <algorithm>
 #include <cstdio>
 
 using namespace focusstack;
@@ -41,11 +44,7 @@ void Task_Grayscale::task()
       do_pca();
     }
 
-    cv::Mat channels[3];
-    cv::split(img, channels);
-    m_result = channels[0] * m_weights.at<float>(0)
-             + channels[1] * m_weights.at<float>(1)
-             + channels[2] * m_weights.at<float>(2);
+    convert(img, m_weights, m_result);
   }
 
   m_valid_area = m_input->valid_area();
@@ -53,6 +52,97 @@ void Task_Grayscale::task()
   m_reference.reset();
 }
 
+void Task_Grayscale::convert(const cv::Mat &img, const cv::Mat &weights, cv::Mat &dst)
+{
+  convert(img, weights, &dst, nullptr);
+}
+
+void Task_Grayscale::convert(const cv::Mat &img, const cv::Mat &weights, cv::Mat *gray, cv::Mat *gray_float)
+{
+  if (img.channels() == 1)
+  {
+    if (gray) *gray = img;
+    if (gray_float) img.convertTo(*gray_float, CV_32F);
+    return;
+  }
+
+  if (gray) gray->create(img.rows, img.cols, CV_8U);
+  if (gray_float) gray_float->create(img.rows, img.cols, CV_32F);
+
+  float w0 = weights.at<float>(0);
+  float w1 = weights.at<float>(1);
+  float w2 = weights.at<float>(2);
+
+  cv::parallel_for_(cv::Range(0, img.rows), [&](const cv::Range &range) {
+    for (int y = range.start; y < range.end; y++)
+    {
+      convert_row(img.ptr<uint8_t>(y), img.cols, w0, w1, w2,
+                  gray ? gray->ptr<uint8_t>(y) : nullptr,
+                  gray_float ? gray_float->ptr<float>(y) : nullptr);
+    }
+  });
+}
+
+// Gives the same result as the matrix expression
+// channels[0] * w0 + channels[1] * w1 + channels[2] * w2
+// on 8-bit images, which rounds and saturates the sum of the first two
+// terms to 8 bits before adding the third one.
+void Task_Grayscale::convert_row(const uint8_t *src, int cols, float w0, float w1, float w2,
+                                 uint8_t *gray, float *gray_float)
+{
+  int x = 0;
+
+#if CV_SIMD
+  const int step = simd::lanes<uint8_t>();
+  const int fstep = simd::lanes<float>();
+  cv::v_float32 vw0 = cv::vx_setall_f32(w0);
+  cv::v_float32 vw1 = cv::vx_setall_f32(w1);
+  cv::v_float32 vw2 = cv::vx_setall_f32(w2);
+  cv::v_int32 vmin = cv::vx_setzero_s32();
+  cv::v_int32 vmax = cv::vx_setall_s32(255);
+
+  for (; x <= cols - step; x += step)
+  {
+    cv::v_uint8 c0, c1, c2;
+    cv::v_load_deinterleave(src + 3 * x, c0, c1, c2);
+
+    cv::v_float32 f0[4], f1[4], f2[4];
+    simd::expand_f32(c0, f0[0], f0[1], f0[2], f0[3]);
+    simd::expand_f32(c1, f1[0], f1[1], f1[2], f1[3]);
+    simd::expand_f32(c2, f2[0], f2[1], f2[2], f2[3]);
+
+    cv::v_int32 v[4];
+    for (int i = 0; i < 4; i++)
+    {
+      cv::v_int32 t = cv::v_round(simd::v_add(simd::v_mul(f0[i], vw0), simd::v_mul(f1[i], vw1)));
+      t = cv::v_min(cv::v_max(t, vmin), vmax);
+      v[i] = cv::v_round(simd::v_add(cv::v_cvt_f32(t), simd::v_mul(f2[i], vw2)));
+      v[i] = cv::v_min(cv::v_max(v[i], vmin), vmax);
+
+      if (gray_float)
+      {
+        cv::v_store(gray_float + x + i * fstep, cv::v_cvt_f32(v[i]));
+      }
+    }
+
+    if (gray)
+    {
+      cv::v_uint16 lo = cv::v_pack_u(v[0], v[1]);
+      cv::v_uint16 hi = cv::v_pack_u(v[2], v[3]);
+      cv::v_store(gray + x, cv::v_pack(lo, hi));
+    }
+  }
+#endif
+
+  for (; x < cols; x++)
+  {
+    uint8_t t = cv::saturate_cast<uint8_t>(src[3 * x] * w0 + src[3 * x + 1] * w1);
+    uint8_t v = cv::saturate_cast<uint8_t>(t + src[3 * x + 2] * w2);
+    if (gray) gray[x] = v;
+    if (gray_float) gray_float[x] = v;
+  }
+}
+
 // Collect samples from image and do principal component analysis
 // to determine the best weights for grayscale conversion.
 void Task_Grayscale::do_pca()
@@ -14,10 +14,19 @@ public:
 
   const cv::Mat &weights() const { return m_weights; };
 
+  // Convert color image to grayscale using given weights
+  static void convert(const cv::Mat &img, const cv::Mat &weights, cv::Mat &dst);
+
+  // Convert to CV_8U and/or CV_32F grayscale in a single pass, either output may be null.
+  // The float output has the same rounded values as the 8-bit output.
+  static void convert(const cv::Mat &img, const cv::Mat &weights, cv::Mat *gray, cv::Mat *gray_float);
+
 private:
   virtual void task();
 
   void do_pca();
+  static void convert_row(const uint8_t *src, int cols, float w0, float w1, float w2,
+                          uint8_t *gray, float *gray_float);
 
   std::shared_ptr<ImgTask> m_input;
   std::shared_ptr<Task_Grayscale> m_reference;
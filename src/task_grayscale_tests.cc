@@ -18,4 +18,41 @@ TEST(Task_Grayscale, PCA) {
   ASSERT_EQ(task.weights().at<float>(2), 0.0f);
 }
 
+// Fused conversion must give the same result as the matrix expression
+// used for grayscale conversion before, which rounds and saturates the
+// sum of the first two channels. Weights are exact binary fractions, so
+// the products are exact whether or not OpenCV uses fused multiply-add,
+// and there are exact ties in rounding. Negative weights test saturation.
+TEST(Task_Grayscale, FusedOutputs) {
+  cv::Mat input(37, 253, CV_8UC3);
+  cv::randu(input, 0, 256);
+
+  std::vector<cv::Mat> channels;
+  cv::split(input, channels);
+
+  const float weight_sets[][3] = {{0.25f, 0.625f, 0.125f}, {0.75f, 0.5f, -0.25f}};
+  for (const float *w : weight_sets)
+  {
+    cv::Mat weights(3, 1, CV_32F);
+    weights.at<float>(0) = w[0];
+    weights.at<float>(1) = w[1];
+    weights.at<float>(2) = w[2];
+
+    cv::Mat expected = channels[0] * w[0] + channels[1] * w[1] + channels[2] * w[2];
+
+    cv::Mat gray, gray_float, gray_only;
+    Task_Grayscale::convert(input, weights, &gray, &gray_float);
+    Task_Grayscale::convert(input, weights, gray_only);
+
+    ASSERT_EQ(gray.type(), CV_8U);
+    ASSERT_EQ(gray_float.type(), CV_32F);
+    ASSERT_EQ(expected.type(), CV_8U);
+
+    cv::Mat expected_float;
+    expected.convertTo(expected_float, CV_32F);
+    EXPECT_EQ(cv::norm(gray, expected, cv::NORM_INF), 0.0);
+    EXPECT_EQ(cv::norm(gray_only, expected, cv::NORM_INF), 0.0);
+    EXPECT_EQ(cv::norm(gray_float, expected_float, cv::NORM_INF), 0.0);
+  }
+}
 }
@@ -10,6 +10,7 @@ Task_LoadImg::Task_LoadImg(std::string filename, float wait_images)
 {
   m_filename = filename;
   m_name = "Load " + filename;
+  m_memimg = false;
   m_wait_images = wait_images;
   m_wait_images_until = std::chrono::system_clock::now()
                       + std::chrono::milliseconds((int)(m_wait_images * 1000));
@@ -20,6 +21,7 @@ Task_LoadImg::Task_LoadImg(std::string name, const cv::Mat &img)
   m_filename = name;
   m_name = "Memory image " + name;
   m_result = img.clone();
+  m_memimg = true;
   m_wait_images = 0;
   m_wait_images_until = std::chrono::system_clock::now()
                       + std::chrono::milliseconds((int)(m_wait_images * 1000));
@@ -13,8 +13,15 @@ public:
 
   virtual bool ready_to_run();
 
+  // Delay loading until the given task has completed, to limit
+  // the number of decoded images in memory at a time.
+  void set_load_after(std::shared_ptr<Task> task) { m_depends_on.push_back(task); }
+
   cv::Size orig_size() const { return m_orig_size; }
 
+  // True if image was given in memory instead of loaded from file
+  bool is_memory_image() const { return m_memimg; }
+
 private:
   virtual void task();
 
@@ -1,12 +1,15 @@
 #include "task_merge.hh"
 #include "task_wavelet.hh"
+#include "simd.hh"
+#include <opencv2/core/utility.hpp>
+#include <stdexcept>
 
 using namespace focusstack;
 
 Task_Merge::Task_Merge(std::shared_ptr<Task_Merge> prev_merge,
                        const std::vector<std::shared_ptr<ImgTask> > &images,
                        int consistency):
-  m_prev_merge(prev_merge), m_images(images), m_consistency(consistency)
+  m_consistency(consistency), m_source_fallback(nullptr), m_prev_merge(prev_merge), m_images(images)
 {
   m_filename = "merge_result.jpg";
   m_name = "Merge " + std::to_string(m_images.size()) + " images";
@@ -17,47 +20,161 @@ Task_Merge::Task_Merge(std::shared_ptr<Task_Merge> prev_merge,
   m_depends_on.insert(m_depends_on.begin(), images.begin(), images.end());
 }
 
+Task_Merge::Task_Merge(int consistency):
+  m_consistency(consistency), m_source_fallback(nullptr)
+{
+  m_filename = "merge_result.jpg";
+  m_name = "Merge images";
+}
+
+// Select the index plane type based on the largest image index.
+// 8-bit plane halves the memory traffic in the consistency filters.
+static int index_plane_type(int max_index)
+{
+  return (max_index <= UINT8_MAX) ? CV_8U : CV_16U;
+}
+
+// Convert index plane to 16 bits if the new index doesn't fit.
+static void widen_index_plane(cv::Mat &plane, int max_index)
+{
+  if (plane.depth() == CV_8U && index_plane_type(max_index) != CV_8U)
+  {
+    cv::Mat tmp;
+    plane.convertTo(tmp, CV_16U);
+    plane = tmp;
+  }
+}
+
+#if CV_SIMD
+// Merge one vector of complex coefficients starting at x and return
+// the mask of pixels that were taken from the source.
+static inline cv::v_uint32 merge_max_absval_block(const float *src, float *dst, float *maxval, int x)
+{
+  cv::v_float32 re, im, dst_re, dst_im;
+  cv::v_load_deinterleave(src + 2 * x, re, im);
+  cv::v_load_deinterleave(dst + 2 * x, dst_re, dst_im);
+
+  cv::v_float32 absval = simd::v_add(simd::v_mul(re, re), simd::v_mul(im, im));
+  cv::v_float32 oldmax = cv::vx_load(maxval + x);
+  cv::v_float32 take = simd::v_gt(absval, oldmax);
+
+  cv::v_store(maxval + x, cv::v_select(take, absval, oldmax));
+  cv::v_store_interleave(dst + 2 * x, cv::v_select(take, re, dst_re), cv::v_select(take, im, dst_im));
+  return cv::v_reinterpret_as_u32(take);
+}
+
+// Merge one vector of index plane values, narrowing the masks to the index type.
+static inline void merge_max_absval_index(const float *src, float *dst, float *maxval, uint16_t *idx, int x, int index)
+{
+  const int n = simd::lanes<float>();
+  cv::v_uint16 take = cv::v_pack(merge_max_absval_block(src, dst, maxval, x),
+                                 merge_max_absval_block(src, dst, maxval, x + n));
+  cv::v_store(idx + x, cv::v_select(take, cv::vx_setall_u16((uint16_t)index), cv::vx_load(idx + x)));
+}
+
+static inline void merge_max_absval_index(const float *src, float *dst, float *maxval, uint8_t *idx, int x, int index)
+{
+  const int n = simd::lanes<float>();
+  cv::v_uint16 take0 = cv::v_pack(merge_max_absval_block(src, dst, maxval, x),
+                                  merge_max_absval_block(src, dst, maxval, x + n));
+  cv::v_uint16 take1 = cv::v_pack(merge_max_absval_block(src, dst, maxval, x + 2 * n),
+                                  merge_max_absval_block(src, dst, maxval, x + 3 * n));
+  cv::v_uint8 take = cv::v_pack(take0, take1);
+  cv::v_store(idx + x, cv::v_select(take, cv::vx_setall_u8((uint8_t)index), cv::vx_load(idx + x)));
+}
+#endif
+
+// For each pixel in the wavelet image, select the wavelet with highest
+// absolute value. T is the type of the index plane.
+template <typename T>
+static void merge_max_absval(const cv::Mat &wavelet, int index,
+                             cv::Mat &result, cv::Mat &max_absval, cv::Mat &depthmap)
+{
+  cv::parallel_for_(cv::Range(0, wavelet.rows), [&](const cv::Range &range) {
+    for (int y = range.start; y < range.end; y++)
+    {
+      const cv::Vec2f *src = wavelet.ptr<cv::Vec2f>(y);
+      cv::Vec2f *dst = result.ptr<cv::Vec2f>(y);
+      float *maxval = max_absval.ptr<float>(y);
+      T *idx = depthmap.ptr<T>(y);
+
+      int x = 0;
+#if CV_SIMD
+      for (; x <= wavelet.cols - simd::lanes<T>(); x += simd::lanes<T>())
+      {
+        merge_max_absval_index(reinterpret_cast<const float*>(src), reinterpret_cast<float*>(dst),
+                               maxval, idx, x, index);
+      }
+#endif
+
+      for (; x < wavelet.cols; x++)
+      {
+        float absval = src[x][0] * src[x][0] + src[x][1] * src[x][1];
+        if (absval > maxval[x])
+        {
+          maxval[x] = absval;
+          dst[x] = src[x];
+          idx[x] = (T)index;
+        }
+      }
+    }
+  });
+}
+
 void Task_Merge::task()
 {
   int rows = m_images.front()->img().rows;
   int cols = m_images.front()->img().cols;
 
+  int max_index = 0;
+  for (const std::shared_ptr<ImgTask> &image: m_images)
+  {
+    max_index = std::max(max_index, image->index());
+  }
+
   cv::Mat max_absval(rows, cols, CV_32F);
 
   if (m_prev_merge)
   {
     m_result = m_prev_merge->img().clone();
     m_depthmap = m_prev_merge->depthmap();
+    widen_index_plane(m_depthmap, max_index);
     get_sq_absval(m_result, max_absval);
   }
   else
   {
     m_result.create(rows, cols, CV_32FC2);
-    m_depthmap.create(rows, cols, CV_16U);
+    m_depthmap.create(rows, cols, index_plane_type(max_index));
     m_depthmap = 0;
     max_absval = -1.0f;
   }
 
-  // Most of the pixel copying is done in loop below using masks, as it is faster.
   // Minor touch-ups are done per-pixel in denoise loops.
-  // Keep a map from image index to image pointer for the denoise step.
-  m_index_map.clear();
-  m_index_map.reserve(m_images.size());
+  // Keep a table from image index to image data for the denoise step.
+  // Indexes that are not in this batch refer to the previous merge result.
+  const cv::Vec2f *fallback = nullptr;
+  if (m_prev_merge)
+  {
+    // m_result is a copy that gets modified below, so refer to the original.
+    assert(m_prev_merge->img().isContinuous());
+    fallback = m_prev_merge->img().ptr<cv::Vec2f>();
+  }
+
+  m_source_imgs.assign(max_index + 1, fallback);
+  m_source_fallback = fallback;
 
-  // For each pixel in the wavelet image, select the wavelet with highest
-  // absolute value.
   for (int i = 0; i < m_images.size(); i++)
   {
     const cv::Mat &wavelet = m_images.at(i)->img();
-    cv::Mat absval(rows, cols, CV_32F);
-    get_sq_absval(wavelet, absval);
+    int index = m_images.at(i)->index();
 
-    cv::Mat mask = (absval > max_absval);
-    absval.copyTo(max_absval, mask);
-    wavelet.copyTo(m_result, mask);
-    m_depthmap.setTo(m_images.at(i)->index(), mask);
+    if (m_depthmap.depth() == CV_8U)
+      merge_max_absval<uint8_t>(wavelet, index, m_result, max_absval, m_depthmap);
+    else
+      merge_max_absval<uint16_t>(wavelet, index, m_result, max_absval, m_depthmap);
 
-    m_index_map[m_images.at(i)->index()] = m_images.at(i);
+    assert(wavelet.isContinuous());
+    m_source_imgs.at(index) = wavelet.ptr<cv::Vec2f>();
   }
 
   if (m_consistency >= 1)
@@ -78,7 +195,7 @@ void Task_Merge::task()
   }
 
   m_images.clear();
-  m_index_map.clear();
+  m_source_imgs.clear();
   m_prev_merge.reset();
 }
 
@@ -94,18 +211,100 @@ void Task_Merge::get_sq_absval(const cv::Mat& complex_mat, cv::Mat& absval)
   }
 }
 
-cv::Mat Task_Merge::get_source_img(int index)
+bool Task_Merge::get_source_pixel(int index, int y, int x, cv::Vec2f &value)
 {
-  auto iter = m_index_map.find(index);
-  if (iter != m_index_map.end())
-    return iter->second->img();
+  const cv::Vec2f *src = (index < m_source_imgs.size()) ? m_source_imgs[index] : m_source_fallback;
+  if (!src)
+  {
+    return false;
+  }
+
+  value = src[(size_t)y * m_result.cols + x];
+  return true;
+}
+
+void Task_Merge::denoise_subbands()
+{
+  if (m_depthmap.depth() == CV_8U)
+    denoise_subbands_impl<uint8_t>();
   else
-    return m_prev_merge->img();
+    denoise_subbands_impl<uint16_t>();
+}
+
+void Task_Merge::denoise_neighbours()
+{
+  if (m_depthmap.depth() == CV_8U)
+    denoise_neighbours_impl<uint8_t>();
+  else
+    denoise_neighbours_impl<uint16_t>();
+}
+
+// Check if the three index rows differ anywhere in range x0 .. x1 - 1
+template <typename T>
+static bool subbands_differ(const T *p1, const T *p2, const T *p3, int x0, int x1)
+{
+  int x = x0;
+#if CV_SIMD
+  for (; x <= x1 - simd::lanes<T>(); x += simd::lanes<T>())
+  {
+    auto v1 = cv::vx_load(p1 + x);
+    auto v2 = cv::vx_load(p2 + x);
+    auto v3 = cv::vx_load(p3 + x);
+    if (cv::v_check_any(simd::v_or(simd::v_ne(v1, v2), simd::v_ne(v2, v3))))
+      return true;
+  }
+#endif
+
+  for (; x < x1; x++)
+  {
+    if (p1[x] != p2[x] || p2[x] != p3[x])
+      return true;
+  }
+
+  return false;
+}
+
+// Mark pixels in range x0 .. x1 - 1 whose index is above or below all four
+// neighbours. Returns true if any outliers were found.
+template <typename T>
+static bool find_outliers(const T *top, const T *center, const T *bottom, T *outlier, int x0, int x1)
+{
+  bool found = false;
+  int x = x0;
+#if CV_SIMD
+  for (; x <= x1 - simd::lanes<T>(); x += simd::lanes<T>())
+  {
+    auto c = cv::vx_load(center + x);
+    auto t = cv::vx_load(top + x);
+    auto b = cv::vx_load(bottom + x);
+    auto l = cv::vx_load(center + x - 1);
+    auto r = cv::vx_load(center + x + 1);
+    auto above = simd::v_and(simd::v_and(simd::v_gt(c, t), simd::v_gt(c, b)),
+                             simd::v_and(simd::v_gt(c, l), simd::v_gt(c, r)));
+    auto below = simd::v_and(simd::v_and(simd::v_lt(c, t), simd::v_lt(c, b)),
+                             simd::v_and(simd::v_lt(c, l), simd::v_lt(c, r)));
+    auto mask = simd::v_or(above, below);
+    cv::v_store(outlier + x, mask);
+    found |= cv::v_check_any(mask);
+  }
+#endif
+
+  for (; x < x1; x++)
+  {
+    T c = center[x];
+    bool above = (c > top[x]) && (c > bottom[x]) && (c > center[x - 1]) && (c > center[x + 1]);
+    bool below = (c < top[x]) && (c < bottom[x]) && (c < center[x - 1]) && (c < center[x + 1]);
+    outlier[x] = (above || below) ? 1 : 0;
+    found |= outlier[x] != 0;
+  }
+
+  return found;
 }
 
 // Compare the horizontal / vertical / diagonal subbands at each level
 // and perform two-out-of-three voting filter.
-void Task_Merge::denoise_subbands()
+template <typename T>
+void Task_Merge::denoise_subbands_impl()
 {
   int levels = Task_Wavelet::levels_for_size(m_result.size());
   for (int level = 0; level < levels; level++)
@@ -119,64 +318,253 @@ void Task_Merge::denoise_subbands()
     cv::Mat sub2 = m_depthmap(cv::Rect(w2, h2, w2, h2));
     cv::Mat sub3 = m_depthmap(cv::Rect(0, h2, w2, h2));
 
-    for (int y = 0; y < h2; y++)
-    {
-      for (int x = 0; x < w2; x++)
+    // Each row is independent, so the rows can be processed in parallel.
+    cv::parallel_for_(cv::Range(0, h2), [&](const cv::Range &range) {
+      const int chunk = 64;
+
+      for (int y = range.start; y < range.end; y++)
       {
-        uint16_t v1 = sub1.at<uint16_t>(y, x);
-        uint16_t v2 = sub2.at<uint16_t>(y, x);
-        uint16_t v3 = sub3.at<uint16_t>(y, x);
+        T *p1 = sub1.ptr<T>(y);
+        T *p2 = sub2.ptr<T>(y);
+        T *p3 = sub3.ptr<T>(y);
 
-        // If two out of three subbands match, update the third one to match also.
-        if (v1 == v2 && v2 == v3)
+        for (int x0 = 0; x0 < w2; x0 += chunk)
         {
-          // Nothing to do
-        }
-        else if (v2 == v3)
-        {
-          // Update sub1
-          sub1.at<uint16_t>(y, x) = v2;
-          m_result.at<cv::Vec2f>(y, w2 + x) = get_source_img(v2).at<cv::Vec2f>(y, w2 + x);
-        }
-        else if (v1 == v3)
-        {
-          // Update sub2
-          sub2.at<uint16_t>(y, x) = v1;
-          m_result.at<cv::Vec2f>(h2 + y, w2 + x) = get_source_img(v1).at<cv::Vec2f>(h2 + y, w2 + x);
-        }
-        else if (v1 == v2)
-        {
-          // Update sub3
-          sub3.at<uint16_t>(y, x) = v1;
-          m_result.at<cv::Vec2f>(h2 + y, x) = get_source_img(v1).at<cv::Vec2f>(h2 + y, x);
+          int x1 = std::min(x0 + chunk, w2);
+
+          // Usually all three subbands agree, so check that first
+          if (!subbands_differ(p1, p2, p3, x0, x1))
+            continue;
+
+          for (int x = x0; x < x1; x++)
+          {
+            T v1 = p1[x];
+            T v2 = p2[x];
+            T v3 = p3[x];
+
+            // If two out of three subbands match, update the third one to match also.
+            if (v1 == v2 && v2 == v3)
+            {
+              // Nothing to do
+            }
+            else if (v2 == v3)
+            {
+              // Update sub1
+              if (get_source_pixel(v2, y, w2 + x, m_result.at<cv::Vec2f>(y, w2 + x)))
+                p1[x] = v2;
+            }
+            else if (v1 == v3)
+            {
+              // Update sub2
+              if (get_source_pixel(v1, h2 + y, w2 + x, m_result.at<cv::Vec2f>(h2 + y, w2 + x)))
+                p2[x] = v1;
+            }
+            else if (v1 == v2)
+            {
+              // Update sub3
+              if (get_source_pixel(v1, h2 + y, x, m_result.at<cv::Vec2f>(h2 + y, x)))
+                p3[x] = v1;
+            }
+          }
         }
       }
-    }
+    });
   }
 }
 
 // Compare the four neighbours of each pixel and if they all
 // are above/below, eliminate the center outlier.
-void Task_Merge::denoise_neighbours()
+//
+// Pixels are processed in scan order, so that the left and top neighbours
+// have already been filtered when a pixel is compared against them.
+// For parallel processing the image is split into tiles, and each tile
+// depends only on the tiles to its left and above it. The tiles are
+// processed in diagonal wavefronts, where all tiles of one wavefront
+// can be processed in parallel. The result is identical to a sequential scan.
+template <typename T>
+void Task_Merge::denoise_neighbours_impl()
 {
-  for (int y = 1; y < m_depthmap.rows - 1; y++)
+  int rows = m_depthmap.rows;
+  int cols = m_depthmap.cols;
+  if (rows < 3 || cols < 3) return;
+
+  // Filter rows 1 .. rows - 2 and columns 1 .. cols - 2, leaving the image border untouched.
+  const int tile_rows = 32;
+  const int tile_cols = 256;
+  int bands = (rows - 2 + tile_rows - 1) / tile_rows;
+  int columns = (cols - 2 + tile_cols - 1) / tile_cols;
+
+  for (int wave = 0; wave < bands + columns - 1; wave++)
   {
-    for (int x = 1; x < m_depthmap.cols - 1; x++)
-    {
-      uint16_t left = m_depthmap.at<uint16_t>(y, x - 1);
-      uint16_t right = m_depthmap.at<uint16_t>(y, x + 1);
-      uint16_t top = m_depthmap.at<uint16_t>(y - 1, x);
-      uint16_t bottom = m_depthmap.at<uint16_t>(y + 1, x);
-      uint16_t center = m_depthmap.at<uint16_t>(y, x);
-
-      if ((center > top && center > bottom && center > left && center > right) ||
-          (center < top && center < bottom && center < left && center < right))
+    int first_band = std::max(0, wave - columns + 1);
+    int last_band = std::min(bands - 1, wave);
+
+    cv::parallel_for_(cv::Range(first_band, last_band + 1), [&](const cv::Range &range) {
+      const int chunk = 64;
+      std::vector<T> outlier(cols);
+
+      for (int band = range.start; band < range.end; band++)
       {
-        // Center pixel is an outlier, average the side pixels to get a better value.
-        int avg = (top + bottom + left + right + 2) / 4;
-        m_depthmap.at<uint16_t>(y, x) = avg;
-        m_result.at<cv::Vec2f>(y, x) = get_source_img(avg).at<cv::Vec2f>(y, x);
+        int y0 = 1 + band * tile_rows;
+        int y1 = std::min(y0 + tile_rows, rows - 1);
+        int tx0 = 1 + (wave - band) * tile_cols;
+        int tx1 = std::min(tx0 + tile_cols, cols - 1);
+
+        for (int y = y0; y < y1; y++)
+        {
+          const T *top = m_depthmap.ptr<T>(y - 1);
+          const T *bottom = m_depthmap.ptr<T>(y + 1);
+          T *center = m_depthmap.ptr<T>(y);
+
+          for (int x0 = tx0; x0 < tx1; x0 += chunk)
+          {
+            int x1 = std::min(x0 + chunk, tx1);
+
+            // The vectorized test sees the left neighbours before filtering.
+            // If a pixel changes, the pixel right of it has to be tested again.
+            if (!find_outliers(top, center, bottom, outlier.data(), x0, x1))
+              continue;
+
+            bool left_changed = false;
+            for (int x = x0; x < x1; x++)
+            {
+              if (!outlier[x] && !left_changed)
+                continue;
+
+              left_changed = false;
+              T c = center[x];
+              T left = center[x - 1];
+              T right = center[x + 1];
+              bool above = (c > top[x]) && (c > bottom[x]) && (c > left) && (c > right);
+              bool below = (c < top[x]) && (c < bottom[x]) && (c < left) && (c < right);
+
+              if (above || below)
+              {
+                // Center pixel is an outlier, average the side pixels to get a better value.
+                int avg = (top[x] + bottom[x] + left + right + 2) / 4;
+                if (get_source_pixel(avg, y, x, m_result.at<cv::Vec2f>(y, x)))
+                {
+                  center[x] = avg;
+                  left_changed = true;
+                }
+              }
+            }
+          }
+        }
       }
+    });
+  }
+}
+
+Task_Merge_Stream::Task_Merge_Stream(int consistency):
+  Task_Merge(consistency), m_image_count(0)
+{
+  m_name = "Finish streamed merge";
+}
+
+std::shared_ptr<Task> Task_Merge_Stream::add(std::shared_ptr<ImgTask> wavelet)
+{
+  std::shared_ptr<Task> fold = std::make_shared<Task_Merge_Fold>(shared_from_this(), wavelet);
+  m_depends_on.push_back(fold);
+  m_image_count++;
+  return fold;
+}
+
+void Task_Merge_Stream::fold(const ImgTask &wavelet)
+{
+  const cv::Mat &src = wavelet.img();
+  int rows = src.rows;
+  int cols = src.cols;
+  int index = wavelet.index();
+
+  // Keep a copy of the coefficients for the consistency filters
+  std::unique_ptr<MappedArray<cv::Vec2f> > source;
+  if (m_consistency > 0)
+  {
+    assert(src.isContinuous());
+    source.reset(new MappedArray<cv::Vec2f>());
+    source->allocate(src.total(), true);
+    std::copy_n(src.ptr<cv::Vec2f>(), src.total(), source->data());
+  }
+
+  std::unique_lock<std::mutex> lock(m_fold_mutex);
+
+  if (source)
+  {
+    m_sources[index] = std::move(source);
+  }
+
+  if (m_result.empty())
+  {
+    m_result.create(rows, cols, CV_32FC2);
+    m_max_absval.create(rows, cols, CV_32F);
+    m_depthmap.create(rows, cols, index_plane_type(index));
+    m_result = cv::Scalar(0, 0);
+    m_max_absval = -1.0f;
+    m_depthmap = 0;
+    m_valid_area = wavelet.valid_area();
+  }
+  else
+  {
+    widen_index_plane(m_depthmap, index);
+    limit_valid_area(wavelet.valid_area());
+  }
+
+  assert(src.rows == rows && src.cols == cols && src.type() == CV_32FC2);
+
+  if (m_depthmap.depth() == CV_8U)
+    merge_max_absval<uint8_t>(src, index, m_result, m_max_absval, m_depthmap);
+  else
+    merge_max_absval<uint16_t>(src, index, m_result, m_max_absval, m_depthmap);
+}
+
+void Task_Merge_Stream::task()
+{
+  if (m_result.empty())
+  {
+    throw std::runtime_error("No images were added to streamed merge");
+  }
+
+  m_logger->verbose("Streamed merge of %d images complete, %d-bit index plane\n",
+                    m_image_count, (m_depthmap.depth() == CV_8U) ? 8 : 16);
+
+  m_max_absval.release();
+
+  if (m_consistency > 0)
+  {
+    m_source_imgs.assign(m_sources.rbegin()->first + 1, nullptr);
+    for (const auto &source: m_sources)
+    {
+      m_source_imgs.at(source.first) = source.second->data();
+    }
+
+    denoise_subbands();
+
+    if (m_consistency >= 2)
+    {
+      denoise_neighbours();
     }
+
+    m_source_imgs.clear();
+    m_sources.clear();
   }
 }
+
+Task_Merge_Fold::Task_Merge_Fold(std::shared_ptr<Task_Merge_Stream> merge, std::shared_ptr<ImgTask> wavelet):
+  m_merge(merge), m_wavelet(wavelet)
+{
+  m_filename = wavelet->filename();
+  m_name = "Merge " + wavelet->basename();
+  m_index = wavelet->index();
+
+  m_depends_on.push_back(wavelet);
+}
+
+void Task_Merge_Fold::task()
+{
+  m_merge->fold(*m_wavelet);
+
+  // Release the wavelet image and break the reference cycle with merge task.
+  m_wavelet.reset();
+  m_merge.reset();
+}
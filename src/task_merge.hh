@@ -4,7 +4,8 @@
 
 #pragma once
 #include "worker.hh"
-#include <unordered_map>
+#include "mappedbuffer.hh"
+#include <map>
 
 namespace focusstack {
 
@@ -19,19 +20,84 @@ public:
 
   static void get_sq_absval(const cv::Mat &complex_mat, cv::Mat &absval);
 
-private:
-  virtual void task();
+protected:
+  Task_Merge(int consistency);
+
+  // Fetch the wavelet coefficient of source image 'index' at given position.
+  // Returns false if the value is not available, in which case
+  // the consistency filters leave the pixel unchanged.
+  bool get_source_pixel(int index, int y, int x, cv::Vec2f &value);
 
-  cv::Mat get_source_img(int index);
   void denoise_subbands();
   void denoise_neighbours();
 
+  // Implementations of the above, for index plane element type T
+  template <typename T> void denoise_subbands_impl();
+  template <typename T> void denoise_neighbours_impl();
+
+  // Index of the source image selected for each pixel.
+  // CV_8U if all image indexes fit, otherwise CV_16U.
   cv::Mat m_depthmap;
+  int m_consistency;
+
+  // Wavelet image data for each image index, or m_source_fallback
+  // if the index is not part of this batch.
+  std::vector<const cv::Vec2f*> m_source_imgs;
+  const cv::Vec2f *m_source_fallback;
+
+private:
+  virtual void task();
 
-  std::unordered_map<int, std::shared_ptr<ImgTask> > m_index_map;
   std::shared_ptr<Task_Merge> m_prev_merge;
   std::vector<std::shared_ptr<ImgTask> > m_images;
-  int m_consistency;
+};
+
+// Streaming version of Task_Merge.
+// Each wavelet image is folded into a running merge state by a separate
+// task as soon as it is ready, after which the image can be released.
+// This keeps memory usage flat regardless of batch size.
+//
+// The consistency filters are run once after all images have been folded,
+// based on the recorded index plane. The filters can switch a pixel to any
+// other source image, so with consistency level above 0 each folded image
+// is copied to a temporary file that the operating system can page out.
+// The result is the same as Task_Merge with all images in one batch.
+class Task_Merge_Stream: public Task_Merge, public std::enable_shared_from_this<Task_Merge_Stream>
+{
+public:
+  Task_Merge_Stream(int consistency = 0);
+
+  // Create a task that folds the wavelet image into the running state.
+  // The returned task must be added to the worker by the caller.
+  // This task must not be added to the worker before all images have been added.
+  std::shared_ptr<Task> add(std::shared_ptr<ImgTask> wavelet);
+
+private:
+  virtual void task();
+
+  void fold(const ImgTask &wavelet);
+
+  friend class Task_Merge_Fold;
+
+  std::mutex m_fold_mutex;
+  int m_image_count;
+  cv::Mat m_max_absval;
+
+  // Copies of the folded images for the consistency filters, by image index
+  std::map<int, std::unique_ptr<MappedArray<cv::Vec2f> > > m_sources;
+};
+
+// Folds one wavelet image into a Task_Merge_Stream
+class Task_Merge_Fold: public Task
+{
+public:
+  Task_Merge_Fold(std::shared_ptr<Task_Merge_Stream> merge, std::shared_ptr<ImgTask> wavelet);
+
+private:
+  virtual void task();
+
+  std::shared_ptr<Task_Merge_Stream> m_merge;
+  std::shared_ptr<ImgTask> m_wavelet;
 };
 
 }
@@ -0,0 +1,249 @@
+#include <gtest/gtest.h>
+#include "task_merge.hh"
+#include "task_wavelet.hh"
+#include "logger.hh"
+#include <map>
+
+namespace focusstack {
+
+static std::shared_ptr<ImgTask> make_wavelet(int index, float value, int rows = 32, int cols = 32)
+{
+  cv::Mat img(rows, cols, CV_32FC2);
+  img = cv::Scalar(0, 0);
+
+  // Give each image its own area with strongest coefficients
+  for (int y = 0; y < rows; y++)
+  {
+    for (int x = 0; x < cols; x++)
+    {
+      float v = (x / 4 % 4 == index) ? value : value / (index + 2);
+      img.at<cv::Vec2f>(y, x) = cv::Vec2f(v, -v);
+    }
+  }
+
+  std::shared_ptr<ImgTask> task = std::make_shared<ImgTask>(img);
+  task->set_index(index);
+  return task;
+}
+
+// Without consistency filter, streamed merge must match batch merge exactly.
+TEST(Task_Merge, StreamMatchesBatch) {
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+  std::vector<std::shared_ptr<ImgTask> > images;
+  for (int i = 0; i < 4; i++)
+  {
+    images.push_back(make_wavelet(i, 10.0f + i));
+  }
+
+  Task_Merge batch(nullptr, images, 0);
+  batch.run(logger);
+
+  std::shared_ptr<Task_Merge_Stream> stream = std::make_shared<Task_Merge_Stream>(0);
+  std::vector<std::shared_ptr<Task> > folds;
+
+  // Fold in different order than the batch
+  for (int i = 3; i >= 0; i--)
+  {
+    folds.push_back(stream->add(images.at(i)));
+  }
+
+  for (std::shared_ptr<Task> &fold: folds)
+  {
+    fold->run(logger);
+  }
+
+  stream->run(logger);
+
+  // Few images, so the index planes should be compact
+  ASSERT_EQ(batch.depthmap().type(), CV_8U);
+  ASSERT_EQ(stream->depthmap().type(), CV_8U);
+
+  for (int y = 0; y < 32; y++)
+  {
+    for (int x = 0; x < 32; x++)
+    {
+      ASSERT_EQ(batch.img().at<cv::Vec2f>(y, x)[0], stream->img().at<cv::Vec2f>(y, x)[0]);
+      ASSERT_EQ(batch.img().at<cv::Vec2f>(y, x)[1], stream->img().at<cv::Vec2f>(y, x)[1]);
+      ASSERT_EQ(batch.depthmap().at<uint8_t>(y, x), stream->depthmap().at<uint8_t>(y, x));
+    }
+  }
+}
+
+// With consistency filter, the filters are run once after all images have
+// been folded, which must match batch merge of all images exactly.
+TEST(Task_Merge, StreamMatchesBatchConsistency) {
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+  const int size = 128;
+
+  std::vector<std::shared_ptr<ImgTask> > images;
+  for (int i = 0; i < 4; i++)
+  {
+    cv::Mat img(size, size, CV_32FC2);
+    cv::randu(img, -100.0, 100.0);
+    std::shared_ptr<ImgTask> task = std::make_shared<ImgTask>(img);
+    task->set_index(i);
+    images.push_back(task);
+  }
+
+  for (int consistency = 1; consistency <= 2; consistency++)
+  {
+    Task_Merge batch(nullptr, images, consistency);
+    batch.run(logger);
+
+    std::shared_ptr<Task_Merge_Stream> stream = std::make_shared<Task_Merge_Stream>(consistency);
+    std::vector<std::shared_ptr<Task> > folds;
+    for (int i = 3; i >= 0; i--)
+    {
+      folds.push_back(stream->add(images.at(i)));
+    }
+
+    for (std::shared_ptr<Task> &fold: folds)
+    {
+      fold->run(logger);
+    }
+
+    stream->run(logger);
+
+    for (int y = 0; y < size; y++)
+    {
+      for (int x = 0; x < size; x++)
+      {
+        ASSERT_EQ(batch.depthmap().at<uint8_t>(y, x), stream->depthmap().at<uint8_t>(y, x));
+        ASSERT_EQ(batch.img().at<cv::Vec2f>(y, x)[0], stream->img().at<cv::Vec2f>(y, x)[0]);
+        ASSERT_EQ(batch.img().at<cv::Vec2f>(y, x)[1], stream->img().at<cv::Vec2f>(y, x)[1]);
+      }
+    }
+  }
+}
+
+// Serial reference implementation of the consistency filters.
+// Both filters are processed in scan order, like the original sequential loops,
+// so the neighbour filter sees the already filtered left and top neighbours.
+static void reference_consistency(const std::vector<std::shared_ptr<ImgTask> > &images, int consistency,
+                                  cv::Mat &result, cv::Mat &depthmap)
+{
+  std::map<int, cv::Mat> sources;
+  for (const std::shared_ptr<ImgTask> &image: images)
+  {
+    sources[image->index()] = image->img();
+  }
+
+  if (consistency >= 1)
+  {
+    int levels = Task_Wavelet::levels_for_size(result.size());
+    for (int level = 0; level < levels; level++)
+    {
+      int w2 = (result.cols >> level) / 2;
+      int h2 = (result.rows >> level) / 2;
+
+      for (int y = 0; y < h2; y++)
+      {
+        for (int x = 0; x < w2; x++)
+        {
+          int v1 = depthmap.at<uint16_t>(y, w2 + x);
+          int v2 = depthmap.at<uint16_t>(h2 + y, w2 + x);
+          int v3 = depthmap.at<uint16_t>(h2 + y, x);
+
+          if (v1 == v2 && v2 == v3)
+          {
+          }
+          else if (v2 == v3)
+          {
+            depthmap.at<uint16_t>(y, w2 + x) = v2;
+            result.at<cv::Vec2f>(y, w2 + x) = sources.at(v2).at<cv::Vec2f>(y, w2 + x);
+          }
+          else if (v1 == v3)
+          {
+            depthmap.at<uint16_t>(h2 + y, w2 + x) = v1;
+            result.at<cv::Vec2f>(h2 + y, w2 + x) = sources.at(v1).at<cv::Vec2f>(h2 + y, w2 + x);
+          }
+          else if (v1 == v2)
+          {
+            depthmap.at<uint16_t>(h2 + y, x) = v1;
+            result.at<cv::Vec2f>(h2 + y, x) = sources.at(v1).at<cv::Vec2f>(h2 + y, x);
+          }
+        }
+      }
+    }
+  }
+
+  if (consistency >= 2)
+  {
+    for (int y = 1; y < depthmap.rows - 1; y++)
+    {
+      for (int x = 1; x < depthmap.cols - 1; x++)
+      {
+        int left = depthmap.at<uint16_t>(y, x - 1);
+        int right = depthmap.at<uint16_t>(y, x + 1);
+        int top = depthmap.at<uint16_t>(y - 1, x);
+        int bottom = depthmap.at<uint16_t>(y + 1, x);
+        int center = depthmap.at<uint16_t>(y, x);
+
+        if ((center > top && center > bottom && center > left && center > right) ||
+            (center < top && center < bottom && center < left && center < right))
+        {
+          int avg = (top + bottom + left + right + 2) / 4;
+          depthmap.at<uint16_t>(y, x) = avg;
+          result.at<cv::Vec2f>(y, x) = sources.at(avg).at<cv::Vec2f>(y, x);
+        }
+      }
+    }
+  }
+}
+
+// Compare the parallel consistency filters against the serial reference.
+// Random coefficients give plenty of disagreeing subbands and outliers.
+// The image is large enough to be split into several tiles in both directions.
+static void check_consistency_matches_serial(int first_index, int expected_type)
+{
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+  const int rows = 192, cols = 640;
+
+  std::vector<std::shared_ptr<ImgTask> > images;
+  for (int i = 0; i < 4; i++)
+  {
+    cv::Mat img(rows, cols, CV_32FC2);
+    cv::randu(img, -100.0, 100.0);
+    std::shared_ptr<ImgTask> task = std::make_shared<ImgTask>(img);
+    task->set_index(first_index + i);
+    images.push_back(task);
+  }
+
+  Task_Merge unfiltered(nullptr, images, 0);
+  unfiltered.run(logger);
+
+  for (int consistency = 1; consistency <= 2; consistency++)
+  {
+    cv::Mat expected = unfiltered.img().clone();
+    cv::Mat expected_depth;
+    unfiltered.depthmap().convertTo(expected_depth, CV_16U);
+    reference_consistency(images, consistency, expected, expected_depth);
+
+    Task_Merge merge(nullptr, images, consistency);
+    merge.run(logger);
+    ASSERT_EQ(merge.depthmap().type(), expected_type);
+
+    cv::Mat depth;
+    merge.depthmap().convertTo(depth, CV_16U);
+
+    for (int y = 0; y < rows; y++)
+    {
+      for (int x = 0; x < cols; x++)
+      {
+        ASSERT_EQ(expected_depth.at<uint16_t>(y, x), depth.at<uint16_t>(y, x));
+        ASSERT_EQ(expected.at<cv::Vec2f>(y, x)[0], merge.img().at<cv::Vec2f>(y, x)[0]);
+        ASSERT_EQ(expected.at<cv::Vec2f>(y, x)[1], merge.img().at<cv::Vec2f>(y, x)[1]);
+      }
+    }
+  }
+}
+
+TEST(Task_Merge, ConsistencyMatchesSerial8bit) {
+  check_consistency_matches_serial(0, CV_8U);
+}
+
+TEST(Task_Merge, ConsistencyMatchesSerial16bit) {
+  check_consistency_matches_serial(300, CV_16U);
+}
+
+}
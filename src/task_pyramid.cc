@@ -0,0 +1,89 @@
+#include "task_pyramid.hh"
+#include <opencv2/imgproc.hpp>
+#include <algorithm>
+#include <functional>
+
+using namespace focusstack;
+
+Task_Pyramid::Task_Pyramid(std::shared_ptr<ImgTask> input, const std::vector<int> &resolutions)
+{
+  m_filename = "pyramid_" + input->basename();
+  m_name = "Downscale " + input->basename();
+  m_index = input->index();
+
+  m_input = input;
+  m_resolutions = resolutions;
+  m_depends_on.push_back(input);
+
+  // Build the levels from largest to smallest, so that each one can be
+  // computed from the previous level.
+  std::sort(m_resolutions.begin(), m_resolutions.end(), std::greater<int>());
+  m_resolutions.erase(std::unique(m_resolutions.begin(), m_resolutions.end()), m_resolutions.end());
+}
+
+void Task_Pyramid::downscale(const cv::Mat &src, cv::Mat &dst, int max_resolution, float &scale_ratio)
+{
+  int resolution = std::max(src.cols, src.rows);
+
+  if (resolution <= max_resolution)
+  {
+    scale_ratio = 1.0f;
+    dst = src;
+  }
+  else
+  {
+    scale_ratio = max_resolution / (float)resolution;
+    cv::resize(src, dst, cv::Size(), scale_ratio, scale_ratio, cv::INTER_AREA);
+  }
+}
+
+void Task_Pyramid::task()
+{
+  m_result = m_input->img();
+  m_valid_area = m_input->valid_area();
+
+  // Each level is downscaled from the previous one, but to the same size
+  // as downscale() would give from full resolution.
+  int resolution = std::max(m_result.cols, m_result.rows);
+  cv::Mat prev = m_result;
+  for (int max_resolution : m_resolutions)
+  {
+    cv::Mat level = prev;
+    if (resolution > max_resolution)
+    {
+      float ratio = max_resolution / (float)resolution;
+      cv::Size size(cvRound(m_result.cols * ratio), cvRound(m_result.rows * ratio));
+      cv::resize(prev, level, size, 0, 0, cv::INTER_AREA);
+    }
+
+    m_levels.push_back(level);
+    prev = level;
+  }
+
+  m_input.reset();
+}
+
+cv::Mat Task_Pyramid::level(int max_resolution, float &scale_ratio) const
+{
+  int resolution = std::max(m_result.cols, m_result.rows);
+  if (resolution <= max_resolution)
+  {
+    scale_ratio = 1.0f;
+    return m_result;
+  }
+
+  scale_ratio = max_resolution / (float)resolution;
+
+  for (size_t i = 0; i < m_resolutions.size(); i++)
+  {
+    if (m_resolutions.at(i) == max_resolution)
+    {
+      return m_levels.at(i);
+    }
+  }
+
+  // Level was not prebuilt
+  cv::Mat result;
+  downscale(m_result, result, max_resolution, scale_ratio);
+  return result;
+}
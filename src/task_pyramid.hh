@@ -0,0 +1,32 @@
+// Builds downscaled versions of a grayscale image for alignment.
+// Each image is used both as alignment source and as reference for its
+// neighbour, so the downscaled levels are computed once and shared.
+
+#pragma once
+#include "worker.hh"
+
+namespace focusstack {
+
+class Task_Pyramid: public ImgTask
+{
+public:
+  // Resolutions give the maximum dimension of each level to build.
+  Task_Pyramid(std::shared_ptr<ImgTask> input, const std::vector<int> &resolutions);
+
+  // Get image limited to given maximum dimension.
+  // Returns the full resolution image if it already fits.
+  // scale_ratio is set to the ratio of returned image size to full size.
+  cv::Mat level(int max_resolution, float &scale_ratio) const;
+
+  // Downscale image the same way as the levels are built.
+  static void downscale(const cv::Mat &src, cv::Mat &dst, int max_resolution, float &scale_ratio);
+
+private:
+  virtual void task();
+
+  std::shared_ptr<ImgTask> m_input;
+  std::vector<int> m_resolutions;
+  std::vector<cv::Mat> m_levels;
+};
+
+}
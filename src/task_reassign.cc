@@ -1,14 +1,19 @@
 #include "task_reassign.hh"
 #include <opencv2/core/core.hpp>
+#include <opencv2/core/utility.hpp>
+#include <opencv2/imgproc.hpp>
 #include <opencv2/imgcodecs.hpp>
+#include <algorithm>
+#include <cstdint>
 
 #define REASSIGN_MAX_BATCH 32
 
 using namespace focusstack;
 
 Task_Reassign_Map::Task_Reassign_Map(const std::vector<std::shared_ptr<ImgTask> > &grayscale_imgs,
-                                     const std::vector<std::shared_ptr<ImgTask> > &color_imgs, std::shared_ptr<Task_Reassign_Map> old_map):
-  m_grayscale_imgs(grayscale_imgs), m_color_imgs(color_imgs), m_old_map(old_map)
+                                     const std::vector<std::shared_ptr<ImgTask> > &color_imgs, std::shared_ptr<Task_Reassign_Map> old_map,
+                                     bool disk_backed):
+  m_disk_backed(disk_backed), m_incremental(false), m_grayscale_imgs(grayscale_imgs), m_color_imgs(color_imgs), m_old_map(old_map)
 {
   m_filename = "reassign_map";
   m_name = "Build color reassignment map from " + std::to_string(m_color_imgs.size()) + " images";
@@ -21,6 +26,16 @@ Task_Reassign_Map::Task_Reassign_Map(const std::vector<std::shared_ptr<ImgTask>
   }
 }
 
+Task_Reassign_Map::Task_Reassign_Map(std::shared_ptr<ImgTask> grayscale_img,
+                                     std::shared_ptr<ImgTask> color_img,
+                                     std::shared_ptr<Task_Reassign_Map> old_map):
+  Task_Reassign_Map(std::vector<std::shared_ptr<ImgTask> >{grayscale_img},
+                    std::vector<std::shared_ptr<ImgTask> >{color_img}, old_map)
+{
+  m_name = "Update color reassignment map from " + color_img->basename();
+  m_incremental = true;
+}
+
 void Task_Reassign_Map::task()
 {
   if (m_old_map)
@@ -36,6 +51,10 @@ void Task_Reassign_Map::task()
   {
     build_gray();
   }
+  else if (m_incremental)
+  {
+    build_incremental();
+  }
   else
   {
     build_color();
@@ -46,6 +65,13 @@ void Task_Reassign_Map::task()
   m_old_map.reset();
 }
 
+// Number of row bands for parallel processing.
+// Using more bands than threads evens out the load.
+static int band_count(int rows)
+{
+  return std::max(1, std::min(cv::getNumThreads() * 4, rows));
+}
+
 void Task_Reassign_Map::build_color()
 {
   // Check that all input images are in correct format
@@ -57,74 +83,285 @@ void Task_Reassign_Map::build_color()
     assert(m_color_imgs.at(i)->img().type() == CV_8UC3);
   }
 
-  // Calculate how much space we may need for the data
-  const color_entry_t *old_colors = m_old_map ? (m_old_map->m_colors.data()) : nullptr;
+  const uint8_t *old_grays = m_old_map ? (m_old_map->m_grays.data()) : nullptr;
+  const cv::Vec3b *old_colors = m_old_map ? (m_old_map->m_colors.data()) : nullptr;
   const uint8_t *old_counts = m_old_map ? (m_old_map->m_counts.data()) : nullptr;
-  size_t old_map_size = m_old_map ? (m_old_map->m_colors.size()) : 0;
+  const size_t *old_row_offsets = m_old_map ? (m_old_map->m_row_offsets.data()) : nullptr;
   int width = m_grayscale_imgs.at(0)->img().cols;
   int height = m_grayscale_imgs.at(0)->img().rows;
+  int bands = band_count(height);
+
+  // Old map is read through once, so it is just a sequential merge of old and new data.
+  if (m_old_map)
+  {
+    m_old_map->m_grays.advise_sequential();
+    m_old_map->m_colors.advise_sequential();
+    m_old_map->m_counts.advise_sequential();
+  }
+
+  m_counts.allocate((size_t)width * height, m_disk_backed);
+  m_row_offsets.assign(height + 1, 0);
+
+  // Go through all pixels in the band, and combine the colors in old map
+  // with any new values. When fill is false, only the entries are
+  // counted into m_counts and m_row_offsets.
+  auto process_band = [&](int band, bool fill) {
+    int y0 = height * band / bands;
+    int y1 = height * (band + 1) / bands;
+
+    // Each new pixel is checked against gray_seen[] array. If the entry matches current pixel_idx,
+    // we have already seen this pixel value at this position, so it is not necessary to add new entry.
+    uint32_t gray_seen[256] = {0};
+    uint32_t pixel_idx = 1;
+    const uint8_t *grayscale_row_ptrs[REASSIGN_MAX_BATCH] = {nullptr};
+    const cv::Vec3b *color_row_ptrs[REASSIGN_MAX_BATCH] = {nullptr};
+
+    for (int y = y0; y < y1; y++)
+    {
+      // Get row pointers for each image, to speed up inner loop
+      for (int i = 0; i < imgcount; i++)
+      {
+        grayscale_row_ptrs[i] = m_grayscale_imgs.at(i)->img().ptr<uint8_t>(y);
+        color_row_ptrs[i] = m_color_imgs.at(i)->img().ptr<cv::Vec3b>(y);
+      }
+
+      size_t old_pos = old_row_offsets ? old_row_offsets[y] : 0;
+      size_t pos = fill ? m_row_offsets[y] : 0;
+      uint8_t *counts_wrpos = m_counts.data() + (size_t)y * width;
+      size_t row_total = 0;
+
+      for (int x = 0; x < width; x++)
+      {
+        pixel_idx++;
+
+        int color_count = 0;
+        uint8_t *grays = fill ? m_grays.data() + pos : nullptr;
+        cv::Vec3b *colors = fill ? m_colors.data() + pos : nullptr;
 
-  // Preallocate the arrays to as much size as we may need to avoid checks during inner loop.
-  m_colors.resize(width * height * (m_grayscale_imgs.size() + 1) + old_map_size);
-  m_counts.resize(width * height);
-  color_entry_t *colors_wrpos = m_colors.data();
-  uint8_t *counts_wrpos = m_counts.data();
+        // Bring in values from old map, which are already sorted.
+        // Copy each color into the map and mark it present in gray_seen[].
+        if (old_counts)
+        {
+          color_count = old_counts[(size_t)y * width + x] + 1;
+          for (int i = 0; i < color_count; i++)
+          {
+            gray_seen[old_grays[old_pos + i]] = pixel_idx;
+          }
+
+          if (fill)
+          {
+            std::copy_n(old_grays + old_pos, color_count, grays);
+            std::copy_n(old_colors + old_pos, color_count, colors);
+          }
+
+          old_pos += color_count;
+        }
 
-  // Each new pixel is checked against gray_seen[] array. If the entry matches current pixel_idx,
-  // we have already seen this pixel value at this position, so it is not necessary to add new entry.
-  uint32_t gray_seen[256] = {0};
-  uint32_t pixel_idx = 1;
-  const uint8_t *grayscale_row_ptrs[REASSIGN_MAX_BATCH] = {nullptr};
-  const cv::Vec3b *color_row_ptrs[REASSIGN_MAX_BATCH] = {nullptr};
+        // Check for new values in the input images.
+        // Insert them in sorted position.
+        for (int i = 0; i < imgcount; i++)
+        {
+          uint8_t gray = grayscale_row_ptrs[i][x];
+          if (gray_seen[gray] != pixel_idx)
+          {
+            gray_seen[gray] = pixel_idx;
+
+            if (fill)
+            {
+              int j = color_count;
+              while (j > 0 && grays[j - 1] > gray)
+              {
+                grays[j] = grays[j - 1];
+                colors[j] = colors[j - 1];
+                j--;
+              }
+              grays[j] = gray;
+              colors[j] = color_row_ptrs[i][x];
+            }
+
+            color_count++;
+          }
+        }
+
+        if (!fill)
+        {
+          counts_wrpos[x] = color_count - 1;
+        }
+
+        pos += color_count;
+        row_total += color_count;
+      }
+
+      if (!fill)
+      {
+        m_row_offsets[y + 1] = row_total;
+      }
+    }
+  };
+
+  // Counting pass gives the exact size of each row
+  cv::parallel_for_(cv::Range(0, bands), [&](const cv::Range &range) {
+    for (int band = range.start; band < range.end; band++)
+    {
+      process_band(band, false);
+    }
+  });
 
-  // Go through all pixels in order, and add any color values that aren't already in map.
   for (int y = 0; y < height; y++)
   {
-    // Get row pointers for each image, to speed up inner loop
-    for (int i = 0; i < imgcount; i++)
+    m_row_offsets[y + 1] += m_row_offsets[y];
+  }
+
+  // Fill pass writes the entries to their final positions
+  m_grays.allocate(m_row_offsets[height], m_disk_backed);
+  m_colors.allocate(m_row_offsets[height], m_disk_backed);
+  m_grays.advise_sequential();
+  m_colors.advise_sequential();
+  cv::parallel_for_(cv::Range(0, bands), [&](const cv::Range &range) {
+    for (int band = range.start; band < range.end; band++)
     {
-      grayscale_row_ptrs[i] = m_grayscale_imgs.at(i)->img().ptr<uint8_t>(y);
-      color_row_ptrs[i] = m_color_imgs.at(i)->img().ptr<cv::Vec3b>(y);
+      process_band(band, true);
     }
+  });
+
+  size_t bytes = m_grays.size() * (sizeof(uint8_t) + sizeof(cv::Vec3b))
+               + m_counts.size() * sizeof(uint8_t) + m_row_offsets.size() * sizeof(size_t);
+  m_logger->verbose("Color reassignment map has %zu entries, %.1f entries per pixel, %.1f MB (%.2f bytes per entry)%s\n",
+                    m_grays.size(), (double)m_grays.size() / m_counts.size(),
+                    bytes / 1.0e6, (double)bytes / m_grays.size(),
+                    m_disk_backed ? ", stored in temporary file" : "");
+}
 
-    for (int x = 0; x < width; x++)
-    {
-      pixel_idx++;
+// Capacity to allocate for a pixel that needs room for count entries.
+// The extra room lets most pixels grow without moving.
+static int incremental_capacity(int count)
+{
+  return std::min(256, count + count / 2 + 1);
+}
+
+void Task_Reassign_Map::build_incremental()
+{
+  const cv::Mat &gray = m_grayscale_imgs.at(0)->img();
+  const cv::Mat &color = m_color_imgs.at(0)->img();
+  assert(gray.type() == CV_8U && color.type() == CV_8UC3);
+  int width = gray.cols;
+  int height = gray.rows;
+
+  if (m_old_map && !m_old_map->m_incremental_map)
+  {
+    throw std::runtime_error("Incremental reassignment map cannot continue from a batch map");
+  }
+
+  bool first = !m_old_map;
+  if (first)
+  {
+    m_incremental_map.reset(new incremental_map_t());
+    m_incremental_map->offsets.resize((size_t)width * height);
+    m_incremental_map->counts.resize((size_t)width * height);
+    m_incremental_map->capacities.resize((size_t)width * height);
+    m_incremental_map->row_grays.resize(height);
+    m_incremental_map->row_colors.resize(height);
+    m_incremental_map->row_waste.resize(height);
+  }
+  else
+  {
+    // Old map has no other users, so take over its storage instead of copying.
+    m_incremental_map = std::move(m_old_map->m_incremental_map);
+  }
 
-      int color_count = 0;
+  incremental_map_t &map = *m_incremental_map;
 
-      // Bring in values from old map.
-      // Copy each color into m_colors and mark it present in gray_seen[].
-      if (old_colors)
+  cv::parallel_for_(cv::Range(0, height), [&](const cv::Range &range) {
+    for (int y = range.start; y < range.end; y++)
+    {
+      const uint8_t *gray_row = gray.ptr<uint8_t>(y);
+      const cv::Vec3b *color_row = color.ptr<cv::Vec3b>(y);
+      uint32_t *offsets = map.offsets.data() + (size_t)y * width;
+      uint8_t *counts = map.counts.data() + (size_t)y * width;
+      uint8_t *capacities = map.capacities.data() + (size_t)y * width;
+      std::vector<uint8_t> &grays = map.row_grays[y];
+      std::vector<cv::Vec3b> &colors = map.row_colors[y];
+
+      if (first)
       {
-        color_count = (*old_counts++) + 1;
-        for (int i = 0; i < color_count; i++)
+        int capacity = incremental_capacity(1);
+        grays.resize((size_t)width * capacity);
+        colors.resize((size_t)width * capacity);
+        for (int x = 0; x < width; x++)
         {
-          color_entry_t color = *old_colors++;
-          gray_seen[color.gray] = pixel_idx;
-          *colors_wrpos++ = color;
+          offsets[x] = x * capacity;
+          counts[x] = 0;
+          capacities[x] = capacity - 1;
+          grays[offsets[x]] = gray_row[x];
+          colors[offsets[x]] = color_row[x];
         }
+        continue;
       }
 
-      // Check for new values in the input images
-      for (int i = 0; i < imgcount; i++)
+      for (int x = 0; x < width; x++)
       {
-        uint8_t gray = grayscale_row_ptrs[i][x];
-        if (gray_seen[gray] != pixel_idx)
+        uint8_t value = gray_row[x];
+        int count = counts[x] + 1;
+        const uint8_t *start = grays.data() + offsets[x];
+        int idx = std::lower_bound(start, start + count, value) - start;
+        if (idx < count && start[idx] == value)
+        {
+          continue; // Already present
+        }
+
+        if (count > capacities[x])
         {
-          gray_seen[gray] = pixel_idx;
-          *colors_wrpos++ = color_entry_t(gray, color_row_ptrs[i][x]);
-          color_count++;
+          // Out of room, move the entries to end of the row
+          int capacity = incremental_capacity(count + 1);
+          uint32_t new_offset = grays.size();
+          grays.resize(grays.size() + capacity);
+          colors.resize(colors.size() + capacity);
+          std::copy_n(grays.begin() + offsets[x], count, grays.begin() + new_offset);
+          std::copy_n(colors.begin() + offsets[x], count, colors.begin() + new_offset);
+          map.row_waste[y] += capacities[x] + 1;
+          offsets[x] = new_offset;
+          capacities[x] = capacity - 1;
         }
+
+        // Insert in sorted position
+        uint8_t *g = grays.data() + offsets[x];
+        cv::Vec3b *c = colors.data() + offsets[x];
+        std::copy_backward(g + idx, g + count, g + count + 1);
+        std::copy_backward(c + idx, c + count, c + count + 1);
+        g[idx] = value;
+        c[idx] = color_row[x];
+        counts[x] = count;
       }
 
-      *counts_wrpos++ = color_count - 1;
-    }
-  }
+      // Compact the row when half of it is unused
+      if (map.row_waste[y] * 2 > grays.size())
+      {
+        size_t total = grays.size() - map.row_waste[y];
+        std::vector<uint8_t> new_grays(total);
+        std::vector<cv::Vec3b> new_colors(total);
+        uint32_t pos = 0;
+        for (int x = 0; x < width; x++)
+        {
+          int capacity = capacities[x] + 1;
+          std::copy_n(grays.begin() + offsets[x], capacity, new_grays.begin() + pos);
+          std::copy_n(colors.begin() + offsets[x], capacity, new_colors.begin() + pos);
+          offsets[x] = pos;
+          pos += capacity;
+        }
 
-  // Release any extra memory that was preallocated
-  assert(colors_wrpos - m_colors.data() < m_colors.size());
-  m_colors.resize(colors_wrpos - m_colors.data());
+        grays.swap(new_grays);
+        colors.swap(new_colors);
+        map.row_waste[y] = 0;
+      }
+    }
+  });
+
+  size_t entries = 0;
+  for (int y = 0; y < height; y++) entries += map.row_grays[y].size();
+  size_t bytes = entries * (sizeof(uint8_t) + sizeof(cv::Vec3b))
+               + map.counts.size() * (sizeof(uint32_t) + 2 * sizeof(uint8_t));
+  m_logger->verbose("Incremental color reassignment map has %zu allocated entries, %.1f MB\n",
+                    entries, bytes / 1.0e6);
 }
 
 void Task_Reassign_Map::build_gray()
@@ -183,44 +420,65 @@ void Task_Reassign::task()
   return;
 }
 
+// Find the entry closest to given gray value from a sorted list.
+// Ties go to the lower gray value.
+static inline int closest_entry(const uint8_t *grays, int count, uint8_t gray)
+{
+  // Binary search finds the first entry that is not less than target.
+  // Closest is either that or the one before.
+  int idx = std::lower_bound(grays, grays + count, gray) - grays;
+  if (idx == count || (idx > 0 && gray - grays[idx - 1] <= grays[idx] - gray))
+  {
+    idx--;
+  }
+  return idx;
+}
+
 void Task_Reassign::reassign_color()
 {
   cv::Mat merged = m_merged->img();
   m_result.create(merged.rows, merged.cols, CV_8UC3);
 
-  const Task_Reassign_Map::color_entry_t *colors = m_map->m_colors.data();
-  const uint8_t *counts = m_map->m_counts.data();
   int width = merged.cols;
   int height = merged.rows;
+  const Task_Reassign_Map::incremental_map_t *incremental = m_map->m_incremental_map.get();
 
-  for (int y = 0; y < height; y++)
-  {
-    for (int x = 0; x < width; x++)
+  cv::parallel_for_(cv::Range(0, height), [&](const cv::Range &range) {
+    for (int y = range.start; y < range.end; y++)
     {
-      // Get the number of color map entries for this pixel
-      int color_count = *counts++ + 1;
-      const Task_Reassign_Map::color_entry_t *pos = colors;
-      colors += color_count;
-
-      // Go through all entries and find the closest one
-      uint8_t gray = merged.at<uint8_t>(y, x);
-      Task_Reassign_Map::color_entry_t closest = *pos++;
-      int error = std::abs(closest.gray - gray);
+      const uint8_t *src = merged.ptr<uint8_t>(y);
+      cv::Vec3b *dst = m_result.ptr<cv::Vec3b>(y);
 
-      while (error > 0 && pos != colors)
+      if (incremental)
       {
-        Task_Reassign_Map::color_entry_t candidate = *pos++;
-        int distance = std::abs(candidate.gray - gray);
-        if (distance < error)
+        const uint32_t *offsets = incremental->offsets.data() + (size_t)y * width;
+        const uint8_t *counts = incremental->counts.data() + (size_t)y * width;
+        const uint8_t *grays = incremental->row_grays[y].data();
+        const cv::Vec3b *colors = incremental->row_colors[y].data();
+
+        for (int x = 0; x < width; x++)
         {
-          error = distance;
-          closest = candidate;
+          int idx = closest_entry(grays + offsets[x], counts[x] + 1, src[x]);
+          dst[x] = colors[offsets[x] + idx];
         }
       }
+      else
+      {
+        size_t pos = m_map->m_row_offsets[y];
+        const uint8_t *counts = m_map->m_counts.data() + (size_t)y * width;
+        const uint8_t *grays = m_map->m_grays.data();
+        const cv::Vec3b *colors = m_map->m_colors.data();
 
-      m_result.at<cv::Vec3b>(y, x) = closest.color;
+        for (int x = 0; x < width; x++)
+        {
+          // Entries of each pixel follow each other
+          int color_count = counts[x] + 1;
+          dst[x] = colors[pos + closest_entry(grays + pos, color_count, src[x])];
+          pos += color_count;
+        }
+      }
     }
-  }
+  });
 }
 
 void Task_Reassign::reassign_gray()
@@ -228,4 +486,212 @@ void Task_Reassign::reassign_gray()
   m_result = m_merged->img().clone();
   cv::min(m_result, m_map->m_gray_max, m_result);
   cv::max(m_result, m_map->m_gray_min, m_result);
-}
\ No newline at end of file
+}
+Task_Reassign_Gather::Task_Reassign_Gather():
+  m_channels(0)
+{
+  m_name = "Gather colors from aligned images";
+}
+
+std::shared_ptr<Task> Task_Reassign_Gather::add(std::shared_ptr<ImgTask> grayscale_img,
+                                                std::shared_ptr<ImgTask> color_img)
+{
+  std::shared_ptr<Task> store = std::make_shared<Task_Reassign_Store>(shared_from_this(), grayscale_img, color_img);
+  m_depends_on.push_back(store);
+  return store;
+}
+
+void Task_Reassign_Gather::set_merge(std::shared_ptr<Task_Merge> merge, std::shared_ptr<ImgTask> merged)
+{
+  m_merge = merge;
+  m_merged = merged;
+  m_filename = merged->filename();
+  m_depends_on.push_back(merge);
+  m_depends_on.push_back(merged);
+}
+
+void Task_Reassign_Gather::store(const ImgTask &grayscale_img, const ImgTask &color_img)
+{
+  const cv::Mat &gray = grayscale_img.img();
+  const cv::Mat &color = color_img.img();
+  int channels = color.channels();
+  int rows = color.rows;
+  int cols = color.cols;
+  assert(gray.type() == CV_8U && color.depth() == CV_8U);
+  assert(gray.rows == rows && gray.cols == cols);
+
+  // Interleave color and gray, so that the gather pass reads each file sequentially
+  std::unique_ptr<MappedArray<uint8_t> > image(new MappedArray<uint8_t>());
+  image->allocate((size_t)rows * cols * (channels + 1), true);
+
+  cv::parallel_for_(cv::Range(0, rows), [&](const cv::Range &range) {
+    for (int y = range.start; y < range.end; y++)
+    {
+      const uint8_t *src_gray = gray.ptr<uint8_t>(y);
+      const uint8_t *src_color = color.ptr<uint8_t>(y);
+      uint8_t *dst = image->data() + (size_t)y * cols * (channels + 1);
+      for (int x = 0; x < cols; x++)
+      {
+        for (int c = 0; c < channels; c++)
+        {
+          *dst++ = *src_color++;
+        }
+        *dst++ = src_gray[x];
+      }
+    }
+  });
+
+  std::unique_lock<std::mutex> lock(m_store_mutex);
+
+  if (m_images.empty())
+  {
+    m_channels = channels;
+    m_size = color.size();
+  }
+  else if (m_channels != channels || m_size != color.size())
+  {
+    throw std::runtime_error("Image " + color_img.basename() + " does not match the size and type of previous images");
+  }
+
+  m_images[color_img.index()] = std::move(image);
+}
+
+template <typename T>
+void Task_Reassign_Gather::candidate_range(cv::Mat &lo, cv::Mat &hi, cv::Mat &center)
+{
+  const cv::Mat &depthmap = m_merge->depthmap();
+  int block_h = depthmap.rows / 2;
+  int block_w = depthmap.cols / 2;
+  lo.create(block_h, block_w, CV_16U);
+  hi.create(block_h, block_w, CV_16U);
+  center.create(block_h, block_w, CV_16U);
+
+  cv::parallel_for_(cv::Range(0, block_h), [&](const cv::Range &range) {
+    for (int by = range.start; by < range.end; by++)
+    {
+      // Finest level subbands are in the lower and right halves of the index plane.
+      const T *top = depthmap.ptr<T>(by);
+      const T *bottom = depthmap.ptr<T>(by + block_h);
+      uint16_t *dst_lo = lo.ptr<uint16_t>(by);
+      uint16_t *dst_hi = hi.ptr<uint16_t>(by);
+      uint16_t *dst_center = center.ptr<uint16_t>(by);
+
+      for (int bx = 0; bx < block_w; bx++)
+      {
+        int a = top[bx + block_w];
+        int b = bottom[bx + block_w];
+        int c = bottom[bx];
+        dst_lo[bx] = std::min(a, std::min(b, c));
+        dst_hi[bx] = std::max(a, std::max(b, c));
+        dst_center[bx] = std::max(std::min(a, b), std::min(std::max(a, b), c));
+      }
+    }
+  });
+
+  // Extend the range over the block neighbourhood
+  cv::Mat kernel = cv::Mat::ones(neighbourhood_radius * 2 + 1, neighbourhood_radius * 2 + 1, CV_8U);
+  cv::erode(lo, lo, kernel);
+  cv::dilate(hi, hi, kernel);
+}
+
+void Task_Reassign_Gather::task()
+{
+  const cv::Mat &merged = m_merged->img();
+  int rows = merged.rows;
+  int cols = merged.cols;
+  m_valid_area = m_merged->valid_area();
+
+  if (m_images.empty())
+  {
+    throw std::runtime_error("No images were added to color gather");
+  }
+
+  assert(merged.type() == CV_8U && merged.size() == m_size);
+  assert(m_merge->depthmap().size() == m_size && rows % 2 == 0 && cols % 2 == 0);
+
+  cv::Mat lo, hi, center;
+  if (m_merge->depthmap().depth() == CV_8U)
+    candidate_range<uint8_t>(lo, hi, center);
+  else
+    candidate_range<uint16_t>(lo, hi, center);
+
+  // Merged wavelet coefficients are no longer needed
+  m_merge.reset();
+
+  // Best candidate so far for each pixel. Smaller gray difference wins,
+  // then the image closer to the center index, then the lower index.
+  // Images outside the candidate range are used only if no image inside
+  // it was stored.
+  cv::Mat best(rows, cols, CV_32S, cv::Scalar(INT32_MAX));
+  m_result.create(rows, cols, CV_8UC(m_channels));
+
+  int pixel_bytes = m_channels + 1;
+  size_t bytes = 0;
+  for (auto &image: m_images)
+  {
+    int index = image.first;
+    image.second->advise_sequential();
+    const uint8_t *data = image.second->data();
+    bytes += image.second->size();
+
+    cv::parallel_for_(cv::Range(0, rows), [&](const cv::Range &range) {
+      for (int y = range.start; y < range.end; y++)
+      {
+        const uint8_t *src = data + (size_t)y * cols * pixel_bytes;
+        const uint8_t *target = merged.ptr<uint8_t>(y);
+        const uint16_t *block_lo = lo.ptr<uint16_t>(y / 2);
+        const uint16_t *block_hi = hi.ptr<uint16_t>(y / 2);
+        const uint16_t *block_center = center.ptr<uint16_t>(y / 2);
+        int32_t *best_row = best.ptr<int32_t>(y);
+        uint8_t *dst = m_result.ptr<uint8_t>(y);
+
+        for (int x = 0; x < cols; x++)
+        {
+          const uint8_t *pixel = src + x * pixel_bytes;
+          int bx = x / 2;
+          int outside = (index < block_lo[bx] || index > block_hi[bx]);
+          int32_t key = (outside << 24) | (std::abs(pixel[m_channels] - target[x]) << 16)
+                        | std::abs(index - block_center[bx]);
+
+          if (key < best_row[x])
+          {
+            best_row[x] = key;
+            std::copy_n(pixel, m_channels, dst + x * m_channels);
+          }
+        }
+      }
+    });
+
+    // Each image is read only once
+    image.second.reset();
+  }
+
+  m_logger->verbose("Gathered colors from %d images, %.1f MB of temporary files\n",
+                    (int)m_images.size(), bytes / 1.0e6);
+
+  m_images.clear();
+  m_merged.reset();
+}
+
+Task_Reassign_Store::Task_Reassign_Store(std::shared_ptr<Task_Reassign_Gather> gather,
+                                         std::shared_ptr<ImgTask> grayscale_img,
+                                         std::shared_ptr<ImgTask> color_img):
+  m_gather(gather), m_grayscale_img(grayscale_img), m_color_img(color_img)
+{
+  m_filename = color_img->filename();
+  m_name = "Store " + color_img->basename() + " for color gather";
+  m_index = color_img->index();
+
+  m_depends_on.push_back(grayscale_img);
+  m_depends_on.push_back(color_img);
+}
+
+void Task_Reassign_Store::task()
+{
+  m_gather->store(*m_grayscale_img, *m_color_img);
+
+  // Release the images and break the reference cycle with gather task.
+  m_grayscale_img.reset();
+  m_color_img.reset();
+  m_gather.reset();
+}
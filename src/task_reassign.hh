@@ -4,6 +4,9 @@
 
 #pragma once
 #include "worker.hh"
+#include "mappedbuffer.hh"
+#include "task_merge.hh"
+#include <map>
 
 namespace focusstack {
 
@@ -23,6 +26,14 @@ class Task_Reassign_Map: public Task
 public:
   Task_Reassign_Map(const std::vector<std::shared_ptr<ImgTask> > &grayscale_imgs,
                     const std::vector<std::shared_ptr<ImgTask> > &color_imgs,
+                    std::shared_ptr<Task_Reassign_Map> old_map,
+                    bool disk_backed = false);
+
+  // Update the color map incrementally from a single image.
+  // Storage of the old map is taken over and each pixel's entries are grown
+  // in place, so the old map must not have any other users.
+  Task_Reassign_Map(std::shared_ptr<ImgTask> grayscale_img,
+                    std::shared_ptr<ImgTask> color_img,
                     std::shared_ptr<Task_Reassign_Map> old_map);
 
 private:
@@ -31,35 +42,46 @@ private:
   // Build reassigment map for color input images.
   void build_color();
 
+  // Add entries from single color image to incremental map.
+  void build_incremental();
+
   // Build reassignment map for grayscale images.
   // This only stores the range of grayscale values present in input,
   // which helps with reducing any ringing artefacts.
   void build_gray();
 
   bool m_grayscale_input;
+  bool m_disk_backed;
+  bool m_incremental;
   std::vector<std::shared_ptr<ImgTask> > m_grayscale_imgs;
   std::vector<std::shared_ptr<ImgTask> > m_color_imgs;
   std::shared_ptr<Task_Reassign_Map> m_old_map;
 
-  struct color_entry_t
+  // Color entries for all pixels are concatenated into one structure of arrays.
+  // Entries of each pixel are sorted by the gray value.
+  // m_grays has the gray value of each entry and m_colors the corresponding color.
+  // m_counts has number of entries per each pixel, minus one. Maximum count is 256, minimum count is 1.
+  // m_row_offsets has the index of first entry on each row, with total count at end.
+  // The large arrays can be stored in temporary files, as they are accessed sequentially.
+  MappedArray<uint8_t> m_grays;
+  MappedArray<cv::Vec3b> m_colors;
+  MappedArray<uint8_t> m_counts;
+  std::vector<size_t> m_row_offsets;
+
+  // Incrementally updated color map. Each row has its own storage, where
+  // each pixel has room for a few more entries than it currently uses.
+  // When a pixel runs out of room, its entries are moved to the end of the
+  // row and the row is compacted when enough space has been wasted.
+  struct incremental_map_t
   {
-    uint8_t gray;
-    cv::Vec3b color;
-
-    // Writing out the three elements of Vec3b improves performance
-    // at low optimization levels.
-    color_entry_t(uint8_t _gray, const cv::Vec3b &_color):
-      gray(_gray), color(_color[0], _color[1], _color[2]) {}
-    color_entry_t() {}
-    color_entry_t(const color_entry_t& old):
-      gray(old.gray), color(old.color[0], old.color[1], old.color[2]) {}
-    color_entry_t& operator=(const color_entry_t &old) = default;
+    std::vector<uint32_t> offsets;    // Start of entries of each pixel within its row
+    std::vector<uint8_t> counts;      // Number of entries, minus one
+    std::vector<uint8_t> capacities;  // Number of allocated entries, minus one
+    std::vector<std::vector<uint8_t> > row_grays;
+    std::vector<std::vector<cv::Vec3b> > row_colors;
+    std::vector<size_t> row_waste;    // Number of unused entries on each row
   };
-
-  // m_colors has color entries for all pixels, concatenated into one vector.
-  // m_counts has number of entries per each pixel, minus one. Maximum count is 256, minimum count is 1.
-  std::vector<color_entry_t> m_colors;
-  std::vector<uint8_t> m_counts;
+  std::unique_ptr<incremental_map_t> m_incremental_map;
 
   cv::Mat m_gray_min;
   cv::Mat m_gray_max;
@@ -85,4 +107,70 @@ private:
   std::shared_ptr<ImgTask> m_merged;
 };
 
+// Task_Reassign_Gather assigns colors to the merged grayscale image
+// without building a color map. The index plane of the merge tells which
+// source images were selected for the finest wavelet subbands of each
+// 2x2 pixel block. The candidates for a block are the range of indexes
+// selected in its 3x3 block neighbourhood, and of those the image whose
+// gray value is closest to the merged pixel gives the color.
+//
+// Each aligned image is copied to a temporary file by a separate task as
+// soon as it is ready, after which it can be released. After the merge
+// the images are read through once, so RAM usage does not grow with the
+// number of images.
+class Task_Reassign_Gather: public ImgTask, public std::enable_shared_from_this<Task_Reassign_Gather>
+{
+public:
+  Task_Reassign_Gather();
+
+  // Create a task that stores the aligned image for the gather pass.
+  // The returned task must be added to the worker by the caller.
+  std::shared_ptr<Task> add(std::shared_ptr<ImgTask> grayscale_img,
+                            std::shared_ptr<ImgTask> color_img);
+
+  // Set the merge whose index plane selects the candidates, and the
+  // merged grayscale image. Must be called after all images have been
+  // added and before this task is added to the worker.
+  void set_merge(std::shared_ptr<Task_Merge> merge, std::shared_ptr<ImgTask> merged);
+
+  // Radius of the candidate neighbourhood, in 2x2 pixel blocks
+  static const int neighbourhood_radius = 1;
+
+private:
+  virtual void task();
+
+  void store(const ImgTask &grayscale_img, const ImgTask &color_img);
+
+  // Compute the candidate index range and the center index of each block
+  template <typename T> void candidate_range(cv::Mat &lo, cv::Mat &hi, cv::Mat &center);
+
+  friend class Task_Reassign_Store;
+
+  std::shared_ptr<Task_Merge> m_merge;
+  std::shared_ptr<ImgTask> m_merged;
+
+  // Stored images by image index. Each pixel has the color channels
+  // followed by the gray value.
+  std::mutex m_store_mutex;
+  std::map<int, std::unique_ptr<MappedArray<uint8_t> > > m_images;
+  int m_channels;
+  cv::Size m_size;
+};
+
+// Stores one aligned image for Task_Reassign_Gather
+class Task_Reassign_Store: public Task
+{
+public:
+  Task_Reassign_Store(std::shared_ptr<Task_Reassign_Gather> gather,
+                      std::shared_ptr<ImgTask> grayscale_img,
+                      std::shared_ptr<ImgTask> color_img);
+
+private:
+  virtual void task();
+
+  std::shared_ptr<Task_Reassign_Gather> m_gather;
+  std::shared_ptr<ImgTask> m_grayscale_img;
+  std::shared_ptr<ImgTask> m_color_img;
+};
+
 }
@@ -0,0 +1,278 @@
+#include <gtest/gtest.h>
+#include <opencv2/imgproc.hpp>
+#include "task_reassign.hh"
+#include "task_wavelet.hh"
+#include "logger.hh"
+
+namespace focusstack {
+
+static std::shared_ptr<ImgTask> make_gray(int index, int rows, int cols)
+{
+  cv::Mat img(rows, cols, CV_8U);
+  for (int y = 0; y < rows; y++)
+  {
+    for (int x = 0; x < cols; x++)
+    {
+      img.at<uint8_t>(y, x) = (x + y + 20 * index) % 256;
+    }
+  }
+  return std::make_shared<ImgTask>(img);
+}
+
+static std::shared_ptr<ImgTask> make_color(int index, int rows, int cols)
+{
+  cv::Mat img(rows, cols, CV_8UC3);
+  for (int y = 0; y < rows; y++)
+  {
+    for (int x = 0; x < cols; x++)
+    {
+      uint8_t gray = (x + y + 20 * index) % 256;
+      img.at<cv::Vec3b>(y, x) = cv::Vec3b(gray, 255 - gray, index);
+    }
+  }
+  return std::make_shared<ImgTask>(img);
+}
+
+// Map built in two batches must give back the original colors.
+static void check_color_roundtrip(bool disk_backed)
+{
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+  int rows = 37, cols = 23;
+
+  std::vector<std::shared_ptr<ImgTask> > grays, colors;
+  for (int i = 0; i < 3; i++)
+  {
+    grays.push_back(make_gray(i, rows, cols));
+    colors.push_back(make_color(i, rows, cols));
+  }
+
+  std::shared_ptr<Task_Reassign_Map> map1 = std::make_shared<Task_Reassign_Map>(
+    std::vector<std::shared_ptr<ImgTask> >(grays.begin(), grays.begin() + 2),
+    std::vector<std::shared_ptr<ImgTask> >(colors.begin(), colors.begin() + 2),
+    nullptr, disk_backed);
+  map1->run(logger);
+
+  std::shared_ptr<Task_Reassign_Map> map2 = std::make_shared<Task_Reassign_Map>(
+    std::vector<std::shared_ptr<ImgTask> >(grays.begin() + 2, grays.end()),
+    std::vector<std::shared_ptr<ImgTask> >(colors.begin() + 2, colors.end()),
+    map1, disk_backed);
+  map2->run(logger);
+
+  for (int i = 0; i < 3; i++)
+  {
+    Task_Reassign reassign(map2, grays.at(i));
+    reassign.run(logger);
+
+    for (int y = 0; y < rows; y++)
+    {
+      for (int x = 0; x < cols; x++)
+      {
+        ASSERT_EQ(reassign.img().at<cv::Vec3b>(y, x), colors.at(i)->img().at<cv::Vec3b>(y, x));
+      }
+    }
+  }
+}
+
+TEST(Task_Reassign, ColorRoundtrip) {
+  check_color_roundtrip(false);
+}
+
+TEST(Task_Reassign, ColorRoundtripDiskBacked) {
+  check_color_roundtrip(true);
+}
+
+// Incremental map must give the same colors as the batch map, keeping
+// the first color seen for each gray value.
+TEST(Task_Reassign, Incremental) {
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+  int rows = 19, cols = 29;
+
+  std::shared_ptr<Task_Reassign_Map> map;
+  for (int i = 0; i < 20; i++)
+  {
+    // Repeat the gray values to get duplicate entries
+    std::shared_ptr<ImgTask> gray = make_gray(i % 7, rows, cols);
+    std::shared_ptr<ImgTask> color = make_color(i, rows, cols);
+    map = std::make_shared<Task_Reassign_Map>(gray, color, map);
+    map->run(logger);
+  }
+
+  for (int i = 0; i < 7; i++)
+  {
+    Task_Reassign reassign(map, make_gray(i, rows, cols));
+    reassign.run(logger);
+    cv::Mat expected = make_color(i, rows, cols)->img();
+
+    for (int y = 0; y < rows; y++)
+    {
+      for (int x = 0; x < cols; x++)
+      {
+        ASSERT_EQ(reassign.img().at<cv::Vec3b>(y, x), expected.at<cv::Vec3b>(y, x));
+      }
+    }
+  }
+}
+
+// When the merged gray is equally far from two entries, the entry with
+// the lower gray value is used, regardless of the order the images were
+// added in. For duplicate gray values, the first color seen is kept.
+static void check_tie_rule(bool incremental)
+{
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+  const uint8_t source_grays[3] = {120, 100, 100};
+
+  std::vector<std::shared_ptr<ImgTask> > grays, colors;
+  for (int i = 0; i < 3; i++)
+  {
+    grays.push_back(std::make_shared<ImgTask>(cv::Mat(1, 3, CV_8U, cv::Scalar(source_grays[i]))));
+    colors.push_back(std::make_shared<ImgTask>(cv::Mat(1, 3, CV_8UC3, cv::Scalar(i, 10 * i, 20 * i))));
+  }
+
+  std::shared_ptr<Task_Reassign_Map> map;
+  if (incremental)
+  {
+    for (int i = 0; i < 3; i++)
+    {
+      map = std::make_shared<Task_Reassign_Map>(grays.at(i), colors.at(i), map);
+      map->run(logger);
+    }
+  }
+  else
+  {
+    map = std::make_shared<Task_Reassign_Map>(grays, colors, nullptr);
+    map->run(logger);
+  }
+
+  cv::Mat merged(1, 3, CV_8U);
+  merged.at<uint8_t>(0, 0) = 110;
+  merged.at<uint8_t>(0, 1) = 100;
+  merged.at<uint8_t>(0, 2) = 111;
+
+  Task_Reassign reassign(map, std::make_shared<ImgTask>(merged));
+  reassign.run(logger);
+
+  EXPECT_EQ(reassign.img().at<cv::Vec3b>(0, 0), cv::Vec3b(1, 10, 20));
+  EXPECT_EQ(reassign.img().at<cv::Vec3b>(0, 1), cv::Vec3b(1, 10, 20));
+  EXPECT_EQ(reassign.img().at<cv::Vec3b>(0, 2), cv::Vec3b(0, 0, 0));
+}
+
+TEST(Task_Reassign, TieGoesToLowerGray) {
+  check_tie_rule(false);
+}
+
+TEST(Task_Reassign, TieGoesToLowerGrayIncremental) {
+  check_tie_rule(true);
+}
+
+// Gather must pick colors from the images selected by the merge.
+TEST(Task_Reassign, DepthIndex) {
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+  int rows = 16, cols = 24;
+
+  std::shared_ptr<Task_Reassign_Gather> gather = std::make_shared<Task_Reassign_Gather>();
+  std::vector<std::shared_ptr<ImgTask> > colors, wavelets;
+  for (int i = 0; i < 5; i++)
+  {
+    std::shared_ptr<ImgTask> gray = make_gray(i, rows, cols);
+    std::shared_ptr<ImgTask> color = make_color(i, rows, cols);
+    gray->set_index(i);
+    color->set_index(i);
+    colors.push_back(color);
+    gather->add(gray, color)->run(logger);
+
+    // Image 3 is sharpest on left half, image 1 on right half
+    cv::Mat wavelet(rows, cols, CV_32FC2, cv::Scalar(0, 0));
+    for (int y = 0; y < rows; y++)
+    {
+      for (int x = 0; x < cols; x++)
+      {
+        // Each 2x2 block has its subbands at column x % (cols / 2)
+        bool left = (x % (cols / 2)) < cols / 4;
+        float v = (i == (left ? 3 : 1)) ? 10.0f : 1.0f;
+        wavelet.at<cv::Vec2f>(y, x) = cv::Vec2f(v, 0.0f);
+      }
+    }
+    wavelets.push_back(std::make_shared<ImgTask>(wavelet));
+    wavelets.back()->set_index(i);
+  }
+
+  std::shared_ptr<Task_Merge> merge = std::make_shared<Task_Merge>(nullptr, wavelets, 0);
+  merge->run(logger);
+
+  std::shared_ptr<ImgTask> merged = make_gray(3, rows, cols);
+  gather->set_merge(merge, merged);
+  gather->run(logger);
+
+  for (int y = 0; y < rows; y++)
+  {
+    for (int x = 0; x < cols; x++)
+    {
+      // Images 2 and 4 are closer in gray than image 1, but were not selected.
+      // Blocks next to the edge also have image 3 as candidate.
+      int expected = (x < cols / 2 + 2) ? 3 : 1;
+      ASSERT_EQ(gather->img().at<cv::Vec3b>(y, x), colors.at(expected)->img().at<cv::Vec3b>(y, x));
+    }
+  }
+}
+
+// Gather must give colors at least as close to the sharp image as
+// the full color map on a synthetic focus stack.
+TEST(Task_Reassign, DepthIndexMatchesMap) {
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+  const int rows = 64, cols = 64, count = 6;
+
+  cv::Mat sharp(rows, cols, CV_8UC3);
+  cv::randu(sharp, 0, 256);
+  cv::GaussianBlur(sharp, sharp, cv::Size(0, 0), 1.0);
+
+  // Each image is in focus on one vertical strip of the image,
+  // and gets blurrier further away from it.
+  std::vector<cv::Mat> blurred(count);
+  blurred[0] = sharp;
+  for (int i = 1; i < count; i++)
+  {
+    cv::GaussianBlur(sharp, blurred[i], cv::Size(0, 0), i);
+  }
+
+  std::shared_ptr<Task_Reassign_Gather> gather = std::make_shared<Task_Reassign_Gather>();
+  std::vector<std::shared_ptr<ImgTask> > grays, colors, wavelets;
+  for (int i = 0; i < count; i++)
+  {
+    cv::Mat color(rows, cols, CV_8UC3);
+    for (int x = 0; x < cols; x++)
+    {
+      int focus = x * count / cols;
+      blurred[std::abs(i - focus)].col(x).copyTo(color.col(x));
+    }
+
+    cv::Mat gray, wavelet;
+    cv::cvtColor(color, gray, cv::COLOR_BGR2GRAY);
+    Task_Wavelet::forward(gray, wavelet);
+
+    grays.push_back(std::make_shared<ImgTask>(gray));
+    colors.push_back(std::make_shared<ImgTask>(color));
+    wavelets.push_back(std::make_shared<ImgTask>(wavelet));
+    grays.back()->set_index(i);
+    colors.back()->set_index(i);
+    wavelets.back()->set_index(i);
+    gather->add(grays.back(), colors.back())->run(logger);
+  }
+
+  cv::Mat merged;
+  cv::cvtColor(sharp, merged, cv::COLOR_BGR2GRAY);
+
+  std::shared_ptr<Task_Reassign_Map> color_map = std::make_shared<Task_Reassign_Map>(grays, colors, nullptr);
+  color_map->run(logger);
+  Task_Reassign color_result(color_map, std::make_shared<ImgTask>(merged));
+  color_result.run(logger);
+
+  std::shared_ptr<Task_Merge> merge = std::make_shared<Task_Merge>(nullptr, wavelets, 2);
+  merge->run(logger);
+  gather->set_merge(merge, std::make_shared<ImgTask>(merged));
+  gather->run(logger);
+
+  EXPECT_GT(cv::PSNR(color_result.img(), gather->img()), 30.0);
+  EXPECT_GE(cv::PSNR(sharp, gather->img()), cv::PSNR(sharp, color_result.img()) - 1.0);
+}
+
+}
@@ -0,0 +1,75 @@
+#include "task_warp_wavelet.hh"
+#include "task_wavelet.hh"
+
+using namespace focusstack;
+
+// Passes one of the side results of Task_Warp_Wavelet on as an image task.
+class Task_Warp_Wavelet::Output: public ImgTask
+{
+public:
+  Output(std::shared_ptr<Task_Warp_Wavelet> parent, bool gray)
+  {
+    m_filename = parent->filename();
+    m_name = (gray ? "Aligned grayscale " : "Aligned color ") + m_filename;
+    m_index = parent->index();
+    m_parent = parent;
+    m_gray = gray;
+    m_depends_on.push_back(parent);
+  }
+
+private:
+  virtual void task()
+  {
+    // Each output takes only its own image, so they don't interfere
+    cv::Mat &src = m_gray ? m_parent->m_gray : m_parent->m_aligned;
+    m_result = src;
+    src.release();
+
+    m_valid_area = m_parent->valid_area();
+    m_parent.reset();
+  }
+
+  std::shared_ptr<Task_Warp_Wavelet> m_parent;
+  bool m_gray;
+};
+
+Task_Warp_Wavelet::Task_Warp_Wavelet(std::shared_ptr<ImgTask> input, std::shared_ptr<Task_Align> alignment,
+                                     std::shared_ptr<Task_Grayscale> refgray)
+{
+  m_filename = alignment->filename();
+  m_name = "Align and wavelet " + input->basename();
+  m_index = alignment->index();
+
+  m_input = input;
+  m_alignment = alignment;
+  m_refgray = refgray;
+
+  m_depends_on.push_back(input);
+  m_depends_on.push_back(alignment);
+  m_depends_on.push_back(refgray);
+}
+
+std::shared_ptr<ImgTask> Task_Warp_Wavelet::aligned_color(std::shared_ptr<Task_Warp_Wavelet> task)
+{
+  return std::make_shared<Output>(task, false);
+}
+
+std::shared_ptr<ImgTask> Task_Warp_Wavelet::aligned_gray(std::shared_ptr<Task_Warp_Wavelet> task)
+{
+  return std::make_shared<Output>(task, true);
+}
+
+void Task_Warp_Wavelet::task()
+{
+  // Grayscale conversion is done in the same pass as the warp. The 8-bit
+  // gray image is used both for reassignment and as the wavelet input,
+  // as in the default pipeline.
+  m_alignment->apply_alignment(m_input->img(), m_aligned, &m_gray, m_refgray->weights());
+  Task_Wavelet::forward(m_gray, m_result);
+
+  m_valid_area = m_alignment->valid_area();
+
+  m_input.reset();
+  m_alignment.reset();
+  m_refgray.reset();
+}
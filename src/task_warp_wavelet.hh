@@ -0,0 +1,41 @@
+// Applies alignment, grayscale conversion and forward wavelet transform
+// to a source image in a single task. This is used in two-phase processing,
+// where all alignment transforms are first estimated from downscaled images.
+// Only the wavelet image and the aligned color and grayscale images needed
+// for color reassignment are kept after the task.
+
+#pragma once
+#include "worker.hh"
+#include "task_align.hh"
+#include "task_grayscale.hh"
+
+namespace focusstack {
+
+class Task_Warp_Wavelet: public ImgTask
+{
+public:
+  // input is the unaligned color image, alignment is a completed Task_Align
+  // that gives the transform and refgray gives the grayscale conversion weights.
+  Task_Warp_Wavelet(std::shared_ptr<ImgTask> input, std::shared_ptr<Task_Align> alignment,
+                    std::shared_ptr<Task_Grayscale> refgray);
+
+  // Create tasks that give access to the aligned color or grayscale image.
+  // The images are handed over to the output tasks, so that the wavelet
+  // result can be kept without them.
+  static std::shared_ptr<ImgTask> aligned_color(std::shared_ptr<Task_Warp_Wavelet> task);
+  static std::shared_ptr<ImgTask> aligned_gray(std::shared_ptr<Task_Warp_Wavelet> task);
+
+private:
+  virtual void task();
+
+  class Output;
+
+  std::shared_ptr<ImgTask> m_input;
+  std::shared_ptr<Task_Align> m_alignment;
+  std::shared_ptr<Task_Grayscale> m_refgray;
+
+  cv::Mat m_aligned;
+  cv::Mat m_gray;
+};
+
+}
@@ -0,0 +1,75 @@
+#include <gtest/gtest.h>
+#include "task_warp_wavelet.hh"
+#include "task_wavelet.hh"
+#include "logger.hh"
+
+namespace focusstack {
+
+static cv::Mat make_color(int seed)
+{
+  cv::Mat img(64, 64, CV_8UC3);
+  for (int y = 0; y < img.rows; y++)
+  {
+    for (int x = 0; x < img.cols; x++)
+    {
+      img.at<cv::Vec3b>(y, x) = cv::Vec3b((x * 3 + seed) & 255, (y * 5 + x) & 255, (x * y + seed) & 255);
+    }
+  }
+  return img;
+}
+
+// Warping, grayscale conversion and wavelet transform in one task should
+// give the same results as the separate tasks.
+TEST(Task_Warp_Wavelet, MatchesSeparateSteps) {
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+
+  std::shared_ptr<ImgTask> refcolor = std::make_shared<ImgTask>(make_color(0));
+  std::shared_ptr<ImgTask> srccolor = std::make_shared<ImgTask>(make_color(7));
+  std::shared_ptr<Task_Grayscale> refgray = std::make_shared<Task_Grayscale>(refcolor);
+  std::shared_ptr<Task_Grayscale> srcgray = std::make_shared<Task_Grayscale>(srccolor, refgray);
+  refgray->run(logger);
+  srcgray->run(logger);
+
+  AlignmentStore::entry_t entry;
+  entry.transformation = cv::Mat::eye(2, 3, CV_32F);
+  entry.transformation.at<float>(0, 2) = 1.5f;
+  entry.transformation.at<float>(1, 2) = -2.0f;
+  entry.contrast = cv::Mat::zeros(5, 1, CV_32F);
+  entry.contrast.at<float>(0) = 1.1f;
+  entry.contrast.at<float>(1) = 0.05f;
+  entry.whitebalance = cv::Mat::zeros(6, 1, CV_32F);
+  entry.whitebalance.at<float>(1) = 1.0f;
+  entry.whitebalance.at<float>(3) = 0.9f;
+  entry.whitebalance.at<float>(4) = 3.0f;
+  entry.whitebalance.at<float>(5) = 1.0f;
+
+  // Separate steps
+  std::shared_ptr<Task_Align> aligned = std::make_shared<Task_Align>(refgray, refcolor, srcgray, srccolor);
+  aligned->set_loaded_transform(entry, true);
+  aligned->run(logger);
+  Task_Grayscale gray(aligned, refgray);
+  gray.run(logger);
+  cv::Mat wavelet;
+  Task_Wavelet::forward(gray.img(), wavelet);
+
+  // Fused task
+  std::shared_ptr<Task_Align> transform = std::make_shared<Task_Align>(refgray, refcolor, srcgray, srccolor);
+  transform->set_loaded_transform(entry, true);
+  transform->set_transform_only();
+  transform->run(logger);
+  ASSERT_TRUE(transform->img().empty());
+
+  std::shared_ptr<Task_Warp_Wavelet> fused = std::make_shared<Task_Warp_Wavelet>(srccolor, transform, refgray);
+  fused->run(logger);
+  std::shared_ptr<ImgTask> fused_color = Task_Warp_Wavelet::aligned_color(fused);
+  std::shared_ptr<ImgTask> fused_gray = Task_Warp_Wavelet::aligned_gray(fused);
+  fused_color->run(logger);
+  fused_gray->run(logger);
+
+  EXPECT_EQ(cv::norm(fused_color->img(), aligned->img(), cv::NORM_INF), 0);
+  EXPECT_EQ(cv::norm(fused_gray->img(), gray.img(), cv::NORM_INF), 0);
+  EXPECT_EQ(cv::norm(fused->img(), wavelet, cv::NORM_INF), 0);
+  EXPECT_EQ(fused->valid_area(), aligned->valid_area());
+}
+
+}
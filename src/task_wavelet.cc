@@ -1,5 +1,6 @@
 #include "task_wavelet.hh"
 #include "task_wavelet_templates.hh"
+#include <opencv2/core/utility.hpp>
 
 using namespace focusstack;
 
@@ -7,6 +8,8 @@ Task_Wavelet::Task_Wavelet(std::shared_ptr<ImgTask> input, bool inverse)
 {
   m_input = input;
   m_inverse = inverse;
+  m_denoise = 0.0f;
+  m_in_place = false;
 
   m_filename = input->filename();
   m_index = input->index();
@@ -19,6 +22,16 @@ Task_Wavelet::Task_Wavelet(std::shared_ptr<ImgTask> input, bool inverse)
   m_depends_on.push_back(input);
 }
 
+Task_Wavelet::Task_Wavelet(std::shared_ptr<ImgTask> input, float denoise, bool in_place):
+  Task_Wavelet(input, true)
+{
+  m_denoise = denoise;
+  m_in_place = in_place;
+
+  if (denoise > 0)
+    m_name = "Denoise and inverse-wavelet " + m_filename;
+}
+
 int Task_Wavelet::levels_for_size(cv::Size size, cv::Size *expanded_size)
 {
   int dimension = std::max(size.width, size.height);
@@ -62,40 +75,16 @@ void Task_Wavelet::task()
 {
   if (!m_inverse)
   {
-    // Perform decomposition from real-valued image to complex wavelets
-
-    cv::Mat img = m_input->img();
-
-    // nth level wavelet decomposition requires image width to be multiple of 2^n
-    int levels = levels_for_size(img.size());
-    int factor = (1 << levels);
-    assert(img.rows % factor == 0 && img.cols % factor == 0);
-
-    cv::Mat tmp(img.rows, img.cols, CV_32FC2);
-    m_result.create(img.rows, img.cols, CV_32FC2);
-
-    // Convert input image to complex values
-    {
-      cv::Mat fimg(img.rows, img.cols, CV_32F);
-      cv::Mat zeros(img.rows, img.cols, CV_32F);
-
-      img.convertTo(fimg, CV_32F);
-      zeros = 0;
-
-      cv::Mat channels[] = {fimg, zeros};
-      cv::merge(channels, 2, tmp);
-    }
-
-    Wavelet<cv::Mat>::decompose_multilevel(tmp, m_result, levels);
+    forward(m_input->img(), m_result);
   }
   else
   {
     // Perform composition from complex wavelets to real-valued image
-    cv::Mat src = m_input->img();
+    cv::Mat src = inverse_coefficients(true);
     cv::Mat tmp(src.rows, src.cols, CV_32FC2);
     int levels = levels_for_size(src.size());
 
-    Wavelet<cv::Mat>::compose_multilevel(src, tmp, levels);
+    Wavelet<cv::Mat>::compose_multilevel_inplace(src, tmp, levels);
 
     cv::Mat channels[2];
     cv::split(tmp, channels);
@@ -107,12 +96,100 @@ void Task_Wavelet::task()
   m_input.reset();
 }
 
+void Task_Wavelet::forward(const cv::Mat &img, cv::Mat &result)
+{
+  // Perform decomposition from real-valued image to complex wavelets
 
+  // nth level wavelet decomposition requires image width to be multiple of 2^n
+  int levels = levels_for_size(img.size());
+  int factor = (1 << levels);
+  assert(img.rows % factor == 0 && img.cols % factor == 0);
 
+  cv::Mat tmp(img.rows, img.cols, CV_32FC2);
+  result.create(img.rows, img.cols, CV_32FC2);
 
+  // Convert input image to complex values, directly from 8-bit or float grayscale
+  cv::parallel_for_(cv::Range(0, img.rows), [&](const cv::Range &range) {
+    for (int y = range.start; y < range.end; y++)
+    {
+      float *dst = tmp.ptr<float>(y);
+      if (img.depth() == CV_32F)
+      {
+        const float *src = img.ptr<float>(y);
+        for (int x = 0; x < img.cols; x++)
+        {
+          dst[2 * x] = src[x];
+          dst[2 * x + 1] = 0.0f;
+        }
+      }
+      else
+      {
+        const uint8_t *src = img.ptr<uint8_t>(y);
+        for (int x = 0; x < img.cols; x++)
+        {
+          dst[2 * x] = src[x];
+          dst[2 * x + 1] = 0.0f;
+        }
+      }
+    }
+  });
 
+  Wavelet<cv::Mat>::decompose_multilevel(tmp, result, levels);
+}
 
+void Task_Wavelet::shrink_coefficients(const cv::Mat &src, cv::Mat &dst, float level)
+{
+  dst.create(src.rows, src.cols, CV_32FC2);
 
+  int levels = levels_for_size(src.size());
+  int lowest_w = src.cols >> levels;
+  int lowest_h = src.rows >> levels;
 
+  cv::parallel_for_(cv::Range(0, src.rows), [&](const cv::Range &range) {
+    for (int y = range.start; y < range.end; y++)
+    {
+      const cv::Vec2f *in = src.ptr<cv::Vec2f>(y);
+      cv::Vec2f *out = dst.ptr<cv::Vec2f>(y);
+
+      // Don't filter the downscaled image
+      int x0 = (y < lowest_h) ? lowest_w : 0;
+      if (in != out)
+      {
+        std::copy_n(in, x0, out);
+      }
+
+      for (int x = x0; x < src.cols; x++)
+      {
+        cv::Vec2f v = in[x];
+        float absval = v[0] * v[0] + v[1] * v[1];
+
+        // Cut off all wavelets below the threshold, and diminish
+        // other wavelets without changing the phase.
+        float ratio = (absval <= level) ? 0.0f : (absval - level) / absval;
+        out[x] = cv::Vec2f(v[0] * ratio, v[1] * ratio);
+      }
+    }
+  });
+}
 
+cv::Mat Task_Wavelet::inverse_coefficients(bool writable)
+{
+  cv::Mat src = m_input->img();
 
+  if (m_denoise > 0)
+  {
+    // Shrinkage pass doubles as the copy when not working in place
+    cv::Mat dst;
+    if (m_in_place) dst = src;
+    shrink_coefficients(src, dst, m_denoise);
+    return dst;
+  }
+  else if (writable && !m_in_place)
+  {
+    return src.clone();
+  }
+  else
+  {
+    return src;
+  }
+}
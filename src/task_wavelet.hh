@@ -14,6 +14,11 @@ class Task_Wavelet: public ImgTask
 public:
   Task_Wavelet(std::shared_ptr<ImgTask> input, bool inverse);
 
+  // Inverse transform that applies denoise shrinkage while reading
+  // the coefficients. If in_place is true, the input image data is
+  // overwritten, so it must not have any other consumers.
+  Task_Wavelet(std::shared_ptr<ImgTask> input, float denoise, bool in_place = false);
+
   // Decide the number of decomposition levels that will be
   // used for given image size. Ideally (1 << levels) should
   // be larger than largest blur in the image, but small enough
@@ -23,6 +28,15 @@ public:
   // is equal or larger than input and divisible by (1 << levels).
   static int levels_for_size(cv::Size size, cv::Size *expanded_size = nullptr);
 
+  // Forward transform of a grayscale image, as done by this task.
+  // Image can be either CV_8U or CV_32F.
+  static void forward(const cv::Mat &img, cv::Mat &result);
+
+  // Nonlinear wavelet denoising: apply magnitude shrinkage to src and
+  // store result in dst. The lowest level downscaled image is copied
+  // unchanged. dst may refer to the same data as src.
+  static void shrink_coefficients(const cv::Mat &src, cv::Mat &dst, float level);
+
   // Range of return values for levels_for_size().
   static const int min_levels = 5;
   static const int max_levels = 10;
@@ -30,8 +44,14 @@ public:
 protected:
   virtual void task();
 
+  // Get coefficients for inverse transform, with denoising applied.
+  // If writable is true, caller may overwrite the returned data.
+  cv::Mat inverse_coefficients(bool writable);
+
   std::shared_ptr<ImgTask> m_input;
   bool m_inverse;
+  float m_denoise;
+  bool m_in_place;
 };
 
 }
@@ -8,37 +8,57 @@ Task_Wavelet_OpenCL::Task_Wavelet_OpenCL(std::shared_ptr<ImgTask> input, bool in
 {
 }
 
+Task_Wavelet_OpenCL::Task_Wavelet_OpenCL(std::shared_ptr<ImgTask> input, float denoise, bool in_place):
+  Task_Wavelet(input, denoise, in_place)
+{
+}
+
 void Task_Wavelet_OpenCL::task()
 {
   if (!m_inverse)
   {
     // Perform decomposition from real-valued image to complex wavelets
 
-    cv::Mat img = m_input->img();
+    // Input may be only in OpenCL memory, so its size is taken from there
+    const cv::UMat &uimg = m_input->uimg();
+    cv::Size size = uimg.empty() ? m_input->img().size() : uimg.size();
 
     // nth level wavelet decomposition requires image width to be multiple of 2^n
-    int levels = levels_for_size(img.size());
+    int levels = levels_for_size(size);
     int factor = (1 << levels);
-    assert(img.rows % factor == 0 && img.cols % factor == 0);
+    assert(size.height % factor == 0 && size.width % factor == 0);
 
-    cv::Mat tmp(img.rows, img.cols, CV_32FC2);
+    cv::UMat utmp(size.height, size.width, CV_32FC2);
 
-    // Convert input image to complex values
+    if (!uimg.empty())
+    {
+      // Input is already in OpenCL memory, convert it to complex values there
+      cv::UMat fimg, zeros(size.height, size.width, CV_32F, cv::Scalar(0));
+      uimg.convertTo(fimg, CV_32F);
+      std::vector<cv::UMat> channels = {fimg, zeros};
+      cv::merge(channels, utmp);
+    }
+    else
     {
-      cv::Mat fimg(img.rows, img.cols, CV_32F);
-      cv::Mat zeros(img.rows, img.cols, CV_32F);
+      cv::Mat img = m_input->img();
+      cv::Mat tmp(img.rows, img.cols, CV_32FC2);
 
-      img.convertTo(fimg, CV_32F);
-      zeros = 0;
+      // Convert input image to complex values
+      {
+        cv::Mat fimg(img.rows, img.cols, CV_32F);
+        cv::Mat zeros(img.rows, img.cols, CV_32F);
 
-      cv::Mat channels[] = {fimg, zeros};
-      cv::merge(channels, 2, tmp);
-    }
+        img.convertTo(fimg, CV_32F);
+        zeros = 0;
 
-    cv::UMat utmp(img.rows, img.cols, CV_32FC2);
-    tmp.copyTo(utmp);
+        cv::Mat channels[] = {fimg, zeros};
+        cv::merge(channels, 2, tmp);
+      }
+
+      tmp.copyTo(utmp);
+    }
 
-    cv::UMat uresult(img.rows, img.cols, CV_32FC2);
+    cv::UMat uresult(size.height, size.width, CV_32FC2);
     Wavelet<cv::UMat>::decompose_multilevel(utmp, uresult, levels);
 
     uresult.copyTo(m_result);
@@ -46,7 +66,8 @@ void Task_Wavelet_OpenCL::task()
   else
   {
     // Perform composition from complex wavelets to real-valued image
-    cv::UMat usrc = m_input->img().getUMat(cv::ACCESS_READ);
+    cv::Mat src = inverse_coefficients(false);
+    cv::UMat usrc = src.getUMat(cv::ACCESS_READ);
     cv::UMat utmp(usrc.rows, usrc.cols, CV_32FC2);
     int levels = levels_for_size(usrc.size());
 
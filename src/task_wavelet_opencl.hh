@@ -9,6 +9,7 @@ class Task_Wavelet_OpenCL: public Task_Wavelet
 {
 public:
   Task_Wavelet_OpenCL(std::shared_ptr<ImgTask> input, bool inverse);
+  Task_Wavelet_OpenCL(std::shared_ptr<ImgTask> input, float denoise, bool in_place = false);
 
   virtual bool uses_opencl() { return true; }
 
@@ -19,6 +19,7 @@ public:
   static void decompose_1d(const M &src, M &dest, bool vertical);
 
   static void compose_multilevel(const M &input, M &output, int levelcount);
+  static void compose_multilevel_inplace(M &input, M &output, int levelcount);
   static void compose(const M &input, M &output);
   static void compose_1d(const M &src, M &dest, bool vertical);
 
@@ -93,16 +94,24 @@ void Wavelet<M>::compose_multilevel(const M& input, M& output, int levelcount)
 
   input.copyTo(tmp);
 
+  compose_multilevel_inplace(tmp, output, levelcount);
+}
+
+// Same as compose_multilevel(), but uses the input matrix as temporary
+// storage. Contents of input are destroyed.
+template <typename M>
+void Wavelet<M>::compose_multilevel_inplace(M& input, M& output, int levelcount)
+{
   for (int i = levelcount - 1; i >= 0; i--)
   {
     int w = input.cols >> i;
     int h = input.rows >> i;
-    M srcarea = tmp(cv::Rect(0, 0, w, h));
+    M srcarea = input(cv::Rect(0, 0, w, h));
     M dstarea = output(cv::Rect(0, 0, w, h));
 
     compose(srcarea, dstarea);
 
-    dstarea.copyTo(tmp(cv::Rect(0, 0, w, h)));
+    dstarea.copyTo(input(cv::Rect(0, 0, w, h)));
   }
 }
 
@@ -1,5 +1,7 @@
 #include <gtest/gtest.h>
 #include "task_wavelet_templates.hh"
+#include "task_wavelet.hh"
+#include "logger.hh"
 
 namespace focusstack {
 
@@ -144,4 +146,105 @@ TEST(Task_Wavelet, Multilevel) {
   }
 }
 
+static cv::Mat make_coefficients()
+{
+  cv::Mat input(32, 32, CV_32FC2);
+
+  for (int y = 0; y < 32; y++)
+  {
+    for (int x = 0; x < 32; x++)
+    {
+      input.at<cv::Vec2f>(y, x) = cv::Vec2f((x * 7 + y * 3) % 11 - 5.0f, (x * 5 + y) % 7 - 3.0f);
+    }
+  }
+
+  return input;
+}
+
+// Shrinkage must match the original separate denoise pass.
+TEST(Task_Wavelet, ShrinkCoefficients) {
+  cv::Mat input = make_coefficients();
+  const float level = 4.0f;
+
+  cv::Mat expected = input.clone();
+  int levels = Task_Wavelet::levels_for_size(input.size());
+  int lowest_w = input.cols >> levels;
+  int lowest_h = input.rows >> levels;
+
+  for (int y = 0; y < input.rows; y++)
+  {
+    for (int x = 0; x < input.cols; x++)
+    {
+      if (y < lowest_h && x < lowest_w)
+        continue;
+
+      cv::Vec2f v = expected.at<cv::Vec2f>(y, x);
+      float absval = v[0] * v[0] + v[1] * v[1];
+
+      if (absval <= level)
+      {
+        v[0] = 0.0f;
+        v[1] = 0.0f;
+      }
+      else
+      {
+        float ratio = (absval - level) / absval;
+        v[0] *= ratio;
+        v[1] *= ratio;
+      }
+
+      expected.at<cv::Vec2f>(y, x) = v;
+    }
+  }
+
+  cv::Mat copy;
+  Task_Wavelet::shrink_coefficients(input, copy, level);
+
+  cv::Mat in_place = input.clone();
+  Task_Wavelet::shrink_coefficients(in_place, in_place, level);
+
+  for (int y = 0; y < input.rows; y++)
+  {
+    for (int x = 0; x < input.cols; x++)
+    {
+      ASSERT_EQ(expected.at<cv::Vec2f>(y, x)[0], copy.at<cv::Vec2f>(y, x)[0]);
+      ASSERT_EQ(expected.at<cv::Vec2f>(y, x)[1], copy.at<cv::Vec2f>(y, x)[1]);
+      ASSERT_EQ(expected.at<cv::Vec2f>(y, x)[0], in_place.at<cv::Vec2f>(y, x)[0]);
+      ASSERT_EQ(expected.at<cv::Vec2f>(y, x)[1], in_place.at<cv::Vec2f>(y, x)[1]);
+    }
+  }
+}
+
+// Fused denoise and inverse transform must match separate steps,
+// both when working in place and on a copy.
+TEST(Task_Wavelet, FusedDenoise) {
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+  cv::Mat input = make_coefficients();
+
+  cv::Mat denoised;
+  Task_Wavelet::shrink_coefficients(input, denoised, 4.0f);
+  Task_Wavelet separate(std::make_shared<ImgTask>(denoised), true);
+  separate.run(logger);
+
+  cv::Mat copy_input = input.clone();
+  Task_Wavelet fused_copy(std::make_shared<ImgTask>(copy_input), 4.0f, false);
+  fused_copy.run(logger);
+
+  Task_Wavelet fused_in_place(std::make_shared<ImgTask>(input.clone()), 4.0f, true);
+  fused_in_place.run(logger);
+
+  for (int y = 0; y < 32; y++)
+  {
+    for (int x = 0; x < 32; x++)
+    {
+      ASSERT_EQ(separate.img().at<uint8_t>(y, x), fused_copy.img().at<uint8_t>(y, x));
+      ASSERT_EQ(separate.img().at<uint8_t>(y, x), fused_in_place.img().at<uint8_t>(y, x));
+
+      // Working on a copy must leave the input untouched
+      ASSERT_EQ(input.at<cv::Vec2f>(y, x)[0], copy_input.at<cv::Vec2f>(y, x)[0]);
+      ASSERT_EQ(input.at<cv::Vec2f>(y, x)[1], copy_input.at<cv::Vec2f>(y, x)[1]);
+    }
+  }
+}
+
 }
@@ -58,14 +58,28 @@ class ImgTask: public Task
 public:
   ImgTask() {};
   ImgTask(cv::Mat result): m_result(result) {}
-  virtual const cv::Mat &img() const { return m_result; }
+  // Result in host memory. If the task produced the result only in
+  // OpenCL memory, it is copied on the first call.
+  virtual const cv::Mat &img() const
+  {
+    if (!m_uresult.empty())
+    {
+      std::call_once(m_download, [this]() { if (m_result.empty()) m_uresult.copyTo(m_result); });
+    }
+    return m_result;
+  }
+
+  // Copy of the result in OpenCL memory, if the task produced one.
+  // Otherwise empty.
+  const cv::UMat &uimg() const { return m_uresult; }
 
   bool has_valid_area() const { return m_valid_area.width != 0 && m_valid_area.height != 0; }
   cv::Rect valid_area() const {
     if (!has_valid_area())
     {
       if (m_logger) m_logger->verbose("Valid area not defined for %s, using default.\n", m_filename.c_str());
-      return cv::Rect(0, 0, m_result.cols, m_result.rows);
+      cv::Size size = m_result.empty() ? m_uresult.size() : m_result.size();
+      return cv::Rect(0, 0, size.width, size.height);
     }
     else
     {
@@ -85,9 +99,14 @@ public:
   }
 
 protected:
-  cv::Mat m_result;
+  mutable cv::Mat m_result; // Filled from m_uresult by img() if empty
+  cv::UMat m_uresult;
   cv::Rect m_valid_area;
 
+private:
+  mutable std::once_flag m_download;
+
+protected:
   // Limit valid area by intersection
   void limit_valid_area(cv::Rect other)
   {